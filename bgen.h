@@ -61,6 +61,13 @@
 #define BGEN_MAXITEMS  (BGEN_FANOUTUSED-1)
 #define BGEN_MINITEMS  (BGEN_MAXITEMS/2)
 
+// With BGEN_DEQUE the items of a leaf may start up to HEADROOM slots into the
+// node, so that items can be added and removed at the front of the leaf
+// without moving all the others.
+#ifdef BGEN_DEQUE
+#define BGEN_HEADROOM  BGEN_MINITEMS
+#endif
+
 // Estimated compile time worst case max height for a 64-bit system.
 // In other words, this is the maximum possible height of a tree when it's
 // fully loaded with SIZE_MAX items.
@@ -83,8 +90,10 @@
 #define BGEN_INLINE inline
 #ifdef __GNUC__
 #define BGEN_NOINLINE __attribute__((noinline))
+#define BGEN_PREFETCH(addr) __builtin_prefetch(addr)
 #else
 #define BGEN_NOINLINE
+#define BGEN_PREFETCH(addr)
 #endif
 
 // Provide a custom allocator using BGEN_MALLOC and BGEN_FREE.
@@ -131,6 +140,51 @@ Visit https://github.com/tidwall/bgen for more information.
 #endif
 #endif
 
+// Enable Augmented B-tree support
+#ifdef BGEN_AUGMENT
+#if !defined(BGEN_AUGTYPE) || !defined(BGEN_AUGITEM) || \
+    !defined(BGEN_AUGCOMBINE)
+#error \
+BGEN_AUGTYPE, BGEN_AUGITEM, and BGEN_AUGCOMBINE are required when \
+BGEN_AUGMENT is defined. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+#else
+#if defined(BGEN_AUGTYPE) || defined(BGEN_AUGITEM) || defined(BGEN_AUGCOMBINE)
+#error \
+BGEN_AUGTYPE, BGEN_AUGITEM, and BGEN_AUGCOMBINE must not be defined without \
+BGEN_AUGMENT. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+#define BGEN_AUGTYPE int
+#endif
+
+// Store the child counts of counted branches as running totals
+#if defined(BGEN_PREFIXCOUNTS) && !defined(BGEN_COUNTED)
+#error \
+BGEN_PREFIXCOUNTS requires BGEN_COUNTED. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+
+// Integer type for the child counts of counted branches
+#if defined(BGEN_COUNTTYPE) && !defined(BGEN_COUNTED)
+#error \
+BGEN_COUNTTYPE requires BGEN_COUNTED. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+#ifdef BGEN_COUNTTYPE
+#define BGEN_COUNTCHECK
+#else
+#define BGEN_COUNTTYPE size_t
+#endif
+
+// Allow for duplicate keys, where each insert goes after its existing equals
+#if defined(BGEN_MULTI) && defined(BGEN_NOORDER)
+#error \
+BGEN_MULTI must not be defined with BGEN_NOORDER. \
+Visit https://github.com/tidwall/bgen for more information.
+#endif
+
 // Number of dimensions for Spatial B-tree
 #ifndef BGEN_DIMS
 #define BGEN_DIMS 2
@@ -148,7 +202,8 @@ Visit https://github.com/tidwall/bgen for more information.
 // A path hint is a search optimization.
 // It's most useful when bsearching, and is turned on by default when
 // BGEN_BSEARCH is provided.
-// This implementation uses one thread local path hint per each btree namespace.
+// This implementation uses one thread local path hint per each btree namespace,
+// and one per tree header.
 // See https://github.com/tidwall/btree/blob/master/PATH_HINT.md
 #if defined(BGEN_BSEARCH) && BGEN_FANOUT < 256
 #ifndef BGEN_PATHHINT
@@ -158,11 +213,16 @@ Visit https://github.com/tidwall/bgen for more information.
 #ifdef BGEN_NOPATHHINT
 #undef BGEN_PATHHINT
 #endif
+#ifdef BGEN_MULTI
+// A hinted equal item may not be the first of its equals.
+#undef BGEN_PATHHINT
+#endif
 
 // Convenient aliases to common types
 #define BGEN_NODE struct BGEN_NAME
 #define BGEN_ITEM BGEN_TYPE
 #define BGEN_ITER struct BGEN_API(iter)
+#define BGEN_TREE struct BGEN_API(tree)
 #define BGEN_SNODE struct BGEN_SYM(snode)
 #define BGEN_RECT struct BGEN_SYM(rect)
 
@@ -181,6 +241,7 @@ Visit https://github.com/tidwall/bgen for more information.
 #define BGEN_COPIED      9  // Tree was copied: `clone`, `copy`
 #define BGEN_NOMEM       10 // Out of memory
 #define BGEN_UNSUPPORTED 11 // Operation not supported
+#define BGEN_OVERFLOW    12 // Item would overflow the BGEN_COUNTTYPE counts
 
 #ifndef BGEN_SOURCE
 
@@ -198,10 +259,16 @@ enum BGEN_API(status) {
     BGEN_C(BGEN_NAME, _COPIED)      = BGEN_COPIED,
     BGEN_C(BGEN_NAME, _NOMEM)       = BGEN_NOMEM,
     BGEN_C(BGEN_NAME, _UNSUPPORTED) = BGEN_UNSUPPORTED,
+    BGEN_C(BGEN_NAME, _OVERFLOW)    = BGEN_OVERFLOW,
 };
 
 BGEN_NODE;
 BGEN_ITER;
+BGEN_TREE;
+
+// The item type as a single name, so that 'const' applies to the item itself,
+// even when the item is a pointer.
+typedef BGEN_ITEM BGEN_SYM(item_t);
 
 BGEN_EXTERN int BGEN_API(get)(BGEN_NODE **root, BGEN_ITEM key,
     BGEN_ITEM *item_out, void *udata);
@@ -209,9 +276,15 @@ BGEN_EXTERN int BGEN_API(insert)(BGEN_NODE **root, BGEN_ITEM item,
     BGEN_ITEM *item_out, void *udata);
 BGEN_EXTERN int BGEN_API(delete)(BGEN_NODE **root, BGEN_ITEM key, 
     BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN int BGEN_API(upsert)(BGEN_NODE **root, BGEN_ITEM key,
+    void(*fn)(BGEN_ITEM *item, bool exists, void *udata), void *udata);
+BGEN_EXTERN int BGEN_API(update)(BGEN_NODE **root, BGEN_ITEM key,
+    BGEN_ITEM item, BGEN_ITEM *item_out, void *udata);
 BGEN_EXTERN bool BGEN_API(contains)(BGEN_NODE **root, BGEN_ITEM key,
     void *udata);
 BGEN_EXTERN void BGEN_API(clear)(BGEN_NODE **root, void *udata);
+BGEN_EXTERN int BGEN_API(retain_if)(BGEN_NODE **root,
+    bool(*pred)(BGEN_ITEM item, void *udata), void *udata);
 
 BGEN_EXTERN int BGEN_API(front)(BGEN_NODE **root, BGEN_ITEM *item_out,
     void *udata);
@@ -241,20 +314,61 @@ BGEN_EXTERN int BGEN_API(delete_at)(BGEN_NODE **root, size_t index,
     BGEN_ITEM *item_out, void *udata);
 BGEN_EXTERN int BGEN_API(replace_at)(BGEN_NODE **root, size_t index,
     BGEN_ITEM item, BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN int BGEN_API(insert_run_at)(BGEN_NODE **root, size_t index,
+    BGEN_ITEM *items, size_t nitems, void *udata);
+BGEN_EXTERN int BGEN_API(delete_run_at)(BGEN_NODE **root, size_t index,
+    size_t nitems, BGEN_ITEM *items_out, void *udata);
 BGEN_EXTERN int BGEN_API(get_at)(BGEN_NODE **root, size_t index,
     BGEN_ITEM *item_out, void *udata);
 BGEN_EXTERN int BGEN_API(index_of)(BGEN_NODE **root, BGEN_ITEM key,
     size_t *index, void *udata);
+BGEN_EXTERN int BGEN_API(rank)(BGEN_NODE **root, BGEN_ITEM key,
+    size_t *rank, void *udata);
+BGEN_EXTERN size_t BGEN_API(count_range)(BGEN_NODE **root, BGEN_ITEM lo,
+    BGEN_ITEM hi, void *udata);
+BGEN_EXTERN int BGEN_API(quantiles)(BGEN_NODE **root, double *ps, size_t n,
+    BGEN_ITEM *items_out, void *udata);
 BGEN_EXTERN size_t BGEN_API(count)(BGEN_NODE **root, void *udata);
 
+// Duplicate keys (see BGEN_MULTI)
+BGEN_EXTERN int BGEN_API(equal_range)(BGEN_NODE **root, BGEN_ITEM key,
+    size_t *start, size_t *end, void *udata);
+BGEN_EXTERN size_t BGEN_API(count_equal)(BGEN_NODE **root, BGEN_ITEM key,
+    void *udata);
+BGEN_EXTERN int BGEN_API(delete_one)(BGEN_NODE **root, BGEN_ITEM key,
+    BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN int BGEN_API(delete_all)(BGEN_NODE **root, BGEN_ITEM key,
+    void *udata);
+
+// Augmented B-tree
+BGEN_EXTERN int BGEN_API(augment)(BGEN_NODE **root, BGEN_AUGTYPE *aug_out,
+    void *udata);
+BGEN_EXTERN int BGEN_API(augment_find)(BGEN_NODE **root, 
+    bool(*pred)(BGEN_AUGTYPE aug, void *udata), BGEN_ITEM *item_out, 
+    BGEN_AUGTYPE *aug_out, void *udata);
+BGEN_EXTERN int BGEN_API(aggregate_range)(BGEN_NODE **root, BGEN_ITEM lo,
+    BGEN_ITEM hi, BGEN_AUGTYPE *aug_out, void *udata);
+
 // Cursor Iterators
 BGEN_EXTERN void BGEN_API(iter_init)(BGEN_NODE **root, BGEN_ITER **iter,
     void *udata);
+BGEN_EXTERN size_t BGEN_API(iter_size)(void);
+BGEN_EXTERN BGEN_ITER *BGEN_API(iter_init_inplace)(BGEN_NODE **root, 
+    void *mem, void *udata);
 BGEN_EXTERN int BGEN_API(iter_status)(BGEN_ITER *iter);
 BGEN_EXTERN bool BGEN_API(iter_valid)(BGEN_ITER *iter);
 BGEN_EXTERN void BGEN_API(iter_release)(BGEN_ITER *iter);
+BGEN_EXTERN int BGEN_API(iter_reserve)(BGEN_ITER *iter, size_t cap);
 BGEN_EXTERN void BGEN_API(iter_item)(BGEN_ITER *iter, BGEN_ITEM *item);
 BGEN_EXTERN void BGEN_API(iter_next)(BGEN_ITER *iter);
+BGEN_EXTERN void BGEN_API(iter_set_stable)(BGEN_ITER *iter, bool stable);
+BGEN_EXTERN int BGEN_API(iter_replace)(BGEN_ITER *iter, BGEN_ITEM item,
+    BGEN_ITEM *item_out);
+BGEN_EXTERN int BGEN_API(iter_delete)(BGEN_ITER *iter, BGEN_ITEM *item_out);
+BGEN_EXTERN size_t BGEN_API(iter_next_batch)(BGEN_ITER *iter, 
+    BGEN_ITEM *items_out, size_t max);
+BGEN_EXTERN int BGEN_API(iter_next_span)(BGEN_ITER *iter, 
+    const BGEN_SYM(item_t) **items);
 
 // Curstor iterator seekers
 BGEN_EXTERN void BGEN_API(iter_seek)(BGEN_ITER *iter, BGEN_ITEM key);
@@ -266,14 +380,21 @@ BGEN_EXTERN void BGEN_API(iter_intersects)(BGEN_ITER *iter, BGEN_RTYPE min[],
 BGEN_EXTERN void BGEN_API(iter_nearby)(BGEN_ITER *iter, void *target,
     BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
     void *target, void *udata));
+BGEN_EXTERN void BGEN_API(iter_nearby_within)(BGEN_ITER *iter, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE maxdist);
 BGEN_EXTERN void BGEN_API(iter_seek_at)(BGEN_ITER *iter, size_t index);
 BGEN_EXTERN void BGEN_API(iter_seek_at_desc)(BGEN_ITER *iter, size_t index);
+BGEN_EXTERN void BGEN_API(iter_advance)(BGEN_ITER *iter, ptrdiff_t delta);
 
 // Callback iterators
 BGEN_EXTERN int BGEN_API(scan)(BGEN_NODE **root, bool(*iter)(BGEN_ITEM item, 
     void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(scan_desc)(BGEN_NODE **root, 
     bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
+BGEN_EXTERN int BGEN_API(scan_spans)(BGEN_NODE **root, 
+    bool(*iter)(const BGEN_SYM(item_t) *items, int count, void *udata),
+    void *udata);
 BGEN_EXTERN int BGEN_API(seek)(BGEN_NODE **root, BGEN_ITEM key, 
     bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(seek_desc)(BGEN_NODE **root, BGEN_ITEM key, 
@@ -281,15 +402,30 @@ BGEN_EXTERN int BGEN_API(seek_desc)(BGEN_NODE **root, BGEN_ITEM key,
 BGEN_EXTERN int BGEN_API(intersects)(BGEN_NODE **root,
     BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
         bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
+BGEN_EXTERN int BGEN_API(intersects_many)(BGEN_NODE **root,
+    BGEN_RTYPE min[][BGEN_DIMS], BGEN_RTYPE max[][BGEN_DIMS], size_t n,
+    bool(*iter)(size_t index, BGEN_ITEM item, void *udata), void *udata);
+BGEN_EXTERN int BGEN_API(spatial_join)(BGEN_NODE **root, BGEN_NODE **other,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(nearby)(BGEN_NODE **root, void *target,
     BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
     void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata), 
     void *udata);
+BGEN_EXTERN int BGEN_API(nearby_within)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(seek_at)(BGEN_NODE **root, size_t index,
     bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(seek_at_desc)(BGEN_NODE **root, size_t index,
     bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
 
+// Bounded kNN
+BGEN_EXTERN size_t BGEN_API(nearest_k)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), size_t k, BGEN_ITEM items[], 
+    BGEN_RTYPE dists[], void *udata);
+
 // General information
 BGEN_EXTERN int BGEN_API(feat_maxitems)(void);
 BGEN_EXTERN int BGEN_API(feat_minitems)(void);
@@ -323,6 +459,8 @@ BGEN_EXTERN int BGEN_API(back_mut)(BGEN_NODE **root, BGEN_ITEM *item_out,
     void *udata);
 BGEN_EXTERN void BGEN_API(iter_init_mut)(BGEN_NODE **root, BGEN_ITER **iter,
     void *udata);
+BGEN_EXTERN BGEN_ITER *BGEN_API(iter_init_inplace_mut)(BGEN_NODE **root, 
+    void *mem, void *udata);
 BGEN_EXTERN int BGEN_API(scan_mut)(BGEN_NODE **root, bool(*iter)(BGEN_ITEM item,
     void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(scan_desc_mut)(BGEN_NODE **root,
@@ -338,6 +476,10 @@ BGEN_EXTERN int BGEN_API(nearby_mut)(BGEN_NODE **root, void *target,
     BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
     void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata),
     void *udata);
+BGEN_EXTERN int BGEN_API(nearby_within_mut)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+    void *target, void *udata), BGEN_RTYPE maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(seek_at_mut)(BGEN_NODE **root, size_t index,
     bool(*iter)(BGEN_ITEM item, void *udata), void *udata);
 BGEN_EXTERN int BGEN_API(seek_at_desc_mut)(BGEN_NODE **root, size_t index,
@@ -347,6 +489,36 @@ BGEN_EXTERN int BGEN_API(seek_at_desc_mut)(BGEN_NODE **root, size_t index,
 BGEN_EXTERN int BGEN_API(get_mut_ref)(BGEN_NODE **root, BGEN_ITEM key,
     BGEN_ITEM **item, void *udata);
 
+// Tree header
+BGEN_EXTERN void BGEN_API(tree_init)(BGEN_TREE **tree, void *udata);
+BGEN_EXTERN void BGEN_API(tree_release)(BGEN_TREE *tree, void *udata);
+BGEN_EXTERN BGEN_NODE **BGEN_API(tree_root)(BGEN_TREE *tree);
+BGEN_EXTERN int BGEN_API(tree_front)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata);
+BGEN_EXTERN int BGEN_API(tree_back)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata);
+BGEN_EXTERN int BGEN_API(tree_pop_front)(BGEN_TREE *tree,
+    BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN int BGEN_API(tree_pop_back)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata);
+BGEN_EXTERN int BGEN_API(tree_push_front)(BGEN_TREE *tree, BGEN_ITEM item,
+    void *udata);
+BGEN_EXTERN int BGEN_API(tree_push_back)(BGEN_TREE *tree, BGEN_ITEM item,
+    void *udata);
+BGEN_EXTERN int BGEN_API(tree_get)(BGEN_TREE *tree, BGEN_ITEM key,
+    BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN bool BGEN_API(tree_contains)(BGEN_TREE *tree, BGEN_ITEM key,
+    void *udata);
+BGEN_EXTERN int BGEN_API(tree_insert)(BGEN_TREE *tree, BGEN_ITEM item,
+    BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN int BGEN_API(tree_delete)(BGEN_TREE *tree, BGEN_ITEM key,
+    BGEN_ITEM *item_out, void *udata);
+BGEN_EXTERN size_t BGEN_API(tree_count)(BGEN_TREE *tree, void *udata);
+BGEN_EXTERN size_t BGEN_API(tree_height)(BGEN_TREE *tree, void *udata);
+BGEN_EXTERN size_t BGEN_API(tree_version)(BGEN_TREE *tree);
+BGEN_EXTERN void BGEN_API(tree_stats)(BGEN_TREE *tree, size_t *hits,
+    size_t *misses);
+
 #endif // !BGEN_SOURCE
 
 #ifndef BGEN_HEADER
@@ -427,6 +599,16 @@ Neither BGEN_COMPARE nor BGEN_LESS are allowed when BGEN_NOORDER is defined. \
 Visit https://github.com/tidwall/bgen for more information.
 #endif
 
+// Returns true if item a may be placed before item b. Equal items are only
+// allowed to be neighbors when BGEN_MULTI is defined.
+static bool BGEN_SYM(inorder)(BGEN_ITEM a, BGEN_ITEM b, void *udata) {
+#ifdef BGEN_MULTI
+    return !BGEN_SYM(less)(b, a, udata);
+#else
+    return BGEN_SYM(less)(a, b, udata);
+#endif
+}
+
 #ifdef BGEN_MAYBELESSEQUAL
 static bool BGEN_SYM(maybelessequal)(BGEN_ITEM a, BGEN_ITEM b, void *udata) {
     (void)a, (void)b, (void)udata;
@@ -458,6 +640,20 @@ static BGEN_RECT BGEN_SYM(item_rect)(BGEN_ITEM item, void *udata) {
 }
 #endif
 
+#ifdef BGEN_AUGMENT
+static BGEN_AUGTYPE BGEN_SYM(item_aug)(BGEN_ITEM item, void *udata) {
+    (void)item, (void)udata;
+    BGEN_AUGITEM
+}
+
+static BGEN_AUGTYPE BGEN_SYM(aug_combine)(BGEN_AUGTYPE a, BGEN_AUGTYPE b, 
+    void *udata)
+{
+    (void)a, (void)b, (void)udata;
+    BGEN_AUGCOMBINE
+}
+#endif
+
 static bool BGEN_SYM(item_copy)(BGEN_ITEM item, BGEN_ITEM *copy, void *udata) {
     (void)item, (void)copy, (void)udata;
 #ifdef BGEN_ITEMCOPY
@@ -529,7 +725,12 @@ static bool BGEN_SYM(rc_shared)(BGEN_SYM(rc_t) *rc) {
 #endif
 
 BGEN_NODE {
+#ifdef BGEN_DEQUE
+    BGEN_ITEM *items; // all items in node, ordered, starting within slots
+    BGEN_ITEM slots[BGEN_HEADROOM+BGEN_MAXITEMS];
+#else
     BGEN_ITEM items[BGEN_MAXITEMS];  // all items in node, ordered
+#endif
 #ifdef BGEN_COW
     BGEN_SYM(rc_t) rc; // reference counter
 #endif
@@ -540,11 +741,14 @@ BGEN_NODE {
     // leaves omit the following fields
     BGEN_NODE *children[BGEN_MAXITEMS+1]; // child nodes
 #ifdef BGEN_COUNTED
-    size_t counts[BGEN_MAXITEMS+1]; // counts for child nodes
+    BGEN_COUNTTYPE counts[BGEN_MAXITEMS+1]; // child counts (or prefixed)
 #endif
 #ifdef BGEN_SPATIAL
     BGEN_RECT rects[BGEN_MAXITEMS+1];
 #endif
+#ifdef BGEN_AUGMENT
+    BGEN_AUGTYPE augs[BGEN_MAXITEMS+1]; // summaries of child nodes
+#endif
 };
 
 #ifdef BGEN_ASSERT
@@ -646,9 +850,95 @@ static BGEN_NODE *BGEN_SYM(alloc_node)(bool isleaf, void *udata) {
     node->isleaf = isleaf;
     node->height = 0;
     node->len = 0;
+#ifdef BGEN_DEQUE
+    node->items = node->slots;
+#endif
     return node;
 }
 
+#define BGEN_SPARE struct BGEN_SYM(spare)
+
+// Nodes that are allocated before a split or join changes the nodes of a tree
+// in place, so that it cannot run out of memory half way.
+BGEN_SPARE {
+    BGEN_NODE **leaves;
+    BGEN_NODE **branches;
+    size_t nleaves;
+    size_t nbranches;
+    size_t size; // size of the array that holds both
+};
+
+// Free the nodes that were not taken.
+static void BGEN_SYM(spare_free)(BGEN_SPARE *spare, void *udata) {
+    while (spare->nleaves > 0) {
+        spare->nleaves--;
+        BGEN_SYM(free)(spare->leaves[spare->nleaves], BGEN_LEAF_SIZE, udata);
+    }
+    while (spare->nbranches > 0) {
+        spare->nbranches--;
+        BGEN_SYM(free)(spare->branches[spare->nbranches], BGEN_BRANCH_SIZE,
+            udata);
+    }
+    BGEN_SYM(free)(spare->leaves, spare->size, udata);
+}
+
+// Allocate nleaves leaves and nbranches branches up front.
+// Returns false when out of memory, in which case nothing is kept.
+static bool BGEN_SYM(spare_alloc)(BGEN_SPARE *spare, size_t nleaves,
+    size_t nbranches, void *udata)
+{
+    spare->size = (nleaves+nbranches)*sizeof(BGEN_NODE*);
+    spare->leaves = (BGEN_NODE**)BGEN_SYM(malloc)(spare->size, udata);
+    if (!spare->leaves) {
+        return false;
+    }
+    spare->branches = spare->leaves+nleaves;
+    spare->nleaves = 0;
+    spare->nbranches = 0;
+    while (spare->nleaves < nleaves || spare->nbranches < nbranches) {
+        bool isleaf = spare->nleaves < nleaves;
+        BGEN_NODE *node = BGEN_SYM(alloc_node)(isleaf, udata);
+        if (!node) {
+            BGEN_SYM(spare_free)(spare, udata);
+            return false;
+        }
+        if (isleaf) {
+            spare->leaves[spare->nleaves++] = node;
+        } else {
+            spare->branches[spare->nbranches++] = node;
+        }
+    }
+    return true;
+}
+
+// Take a node from the spare nodes, when provided, otherwise allocate one.
+static BGEN_NODE *BGEN_SYM(take_node)(bool isleaf, BGEN_SPARE *spare,
+    void *udata)
+{
+    if (spare) {
+        if (isleaf) {
+            BGEN_ASSERT(spare->nleaves > 0);
+            if (spare->nleaves > 0) {
+                return spare->leaves[--spare->nleaves];
+            }
+        } else {
+            BGEN_ASSERT(spare->nbranches > 0);
+            if (spare->nbranches > 0) {
+                return spare->branches[--spare->nbranches];
+            }
+        }
+    }
+    return BGEN_SYM(alloc_node)(isleaf, udata);
+}
+
+// Hint that a leaf will soon be read, such as the next leaf in a scan, so 
+// the memory can be loaded while the current leaf is still being read.
+static void BGEN_SYM(prefetch_leaf)(BGEN_NODE *node) {
+    for (size_t i = 0; i < BGEN_LEAF_SIZE; i += 64) {
+        BGEN_PREFETCH((char*)node+i);
+    }
+}
+
 // returns the number of items in a node by counting, recursively
 static size_t BGEN_SYM(deepcount)(BGEN_NODE *node) {
     size_t count = (size_t)node->len;
@@ -768,6 +1058,40 @@ static BGEN_RECT BGEN_SYM(deeprect)(BGEN_NODE *node, void *udata) {
 }
 #endif
 
+#ifdef BGEN_AUGMENT
+// Returns the summary of all items in a node, combined in order.
+static BGEN_AUGTYPE BGEN_SYM(node_aug)(BGEN_NODE *node, void *udata) {
+    BGEN_AUGTYPE aug;
+    int i = 0;
+    if (node->isleaf) {
+        aug = BGEN_SYM(item_aug)(node->items[i++], udata);
+    } else {
+        aug = node->augs[0];
+    }
+    for (; i < node->len; i++) {
+        aug = BGEN_SYM(aug_combine)(aug, 
+            BGEN_SYM(item_aug)(node->items[i], udata), udata);
+        if (!node->isleaf) {
+            aug = BGEN_SYM(aug_combine)(aug, node->augs[i+1], udata);
+        }
+    }
+    return aug;
+}
+
+// Recalculate the summary for the child at index.
+static void BGEN_SYM(aug_calc)(BGEN_NODE *branch, int index, void *udata) {
+    branch->augs[index] = BGEN_SYM(node_aug)(branch->children[index], udata);
+}
+
+// Returns the running summary acc followed by aug. The empty flag is used
+// for when there's nothing in acc yet.
+static BGEN_AUGTYPE BGEN_SYM(aug_append)(BGEN_AUGTYPE acc, bool empty,
+    BGEN_AUGTYPE aug, void *udata)
+{
+    return empty ? aug : BGEN_SYM(aug_combine)(acc, aug, udata);
+}
+#endif
+
 static bool BGEN_SYM(sane0)(BGEN_NODE *node, void *udata, int depth) {
     // check the number of items in node.
     if (depth == 0) {
@@ -786,6 +1110,14 @@ static bool BGEN_SYM(sane0)(BGEN_NODE *node, void *udata, int depth) {
     if (!node->isleaf && node->height < 2) {
         return false;
     }
+#ifdef BGEN_DEQUE
+    // Only leaves may use the head room.
+    if (node->items < node->slots || 
+        node->items > node->slots+(node->isleaf?BGEN_HEADROOM:0))
+    {
+        return false;
+    }
+#endif
     // Check the height
     if (node->height != BGEN_SYM(deepheight)(node)) {
         return false;
@@ -793,7 +1125,7 @@ static bool BGEN_SYM(sane0)(BGEN_NODE *node, void *udata, int depth) {
     // check the order of items.
 #ifndef BGEN_NOORDER
     for (int i = 1; i < node->len; i++) {
-        if (BGEN_SYM(compare)(node->items[i-1], node->items[i], udata) >= 0) {
+        if (!BGEN_SYM(inorder)(node->items[i-1], node->items[i], udata)) {
             return false;
         }
     }
@@ -809,11 +1141,11 @@ static bool BGEN_SYM(sane0)(BGEN_NODE *node, void *udata, int depth) {
                 node->children[i+1]->len > 0 &&
                 node->children[i+1]->len <= BGEN_MAXITEMS)
             {
-                if (BGEN_SYM(compare)(
+                if (!BGEN_SYM(inorder)(
                     node->children[i]->items[node->children[i]->len-1], 
-                    node->items[i], udata) >= 0 ||
-                    BGEN_SYM(compare)(node->items[i],
-                    node->children[i+1]->items[0], udata) >= 0)
+                    node->items[i], udata) ||
+                    !BGEN_SYM(inorder)(node->items[i],
+                    node->children[i+1]->items[0], udata))
                 {
                     return false;
                 }
@@ -824,6 +1156,10 @@ static bool BGEN_SYM(sane0)(BGEN_NODE *node, void *udata, int depth) {
         for (int i = 0; i <= node->len; i++) {
 #ifdef BGEN_COUNTED
             size_t count = BGEN_SYM(deepcount)(node->children[i]);
+#ifdef BGEN_PREFIXCOUNTS
+            // running totals
+            count += 1 + (i > 0 ? node->counts[i-1] : 0);
+#endif
             if (count != node->counts[i]) {
                 return false;
             }
@@ -858,6 +1194,11 @@ static bool BGEN_SYM(sane)(BGEN_NODE **root, void *udata) {
 static size_t BGEN_SYM(count0)(BGEN_NODE *node) {
 #ifndef BGEN_COUNTED
     return BGEN_SYM(deepcount)(node);
+#elif defined(BGEN_PREFIXCOUNTS)
+    if (node->isleaf) {
+        return node->len;
+    }
+    return (size_t)node->counts[node->len]-1;
 #else
     size_t count = node->len;
     if (!node->isleaf) {
@@ -881,16 +1222,137 @@ static size_t BGEN_SYM(height)(BGEN_NODE **root, void *udata) {
     return *root ? (size_t)(*root)->height : 0;
 }
 
+// Returns true when the tree cannot take another item without overflowing a
+// BGEN_COUNTTYPE count. The running totals of BGEN_PREFIXCOUNTS include one
+// extra, and the fastpaths may go one more over before rolling back.
+static bool BGEN_SYM(count_full)(BGEN_NODE **root) {
+#if defined(BGEN_COUNTED) && defined(BGEN_COUNTCHECK)
+    return *root && 
+        BGEN_SYM(count0)(*root) >= (size_t)(BGEN_COUNTTYPE)-1 - 1;
+#else
+    (void)root;
+    return false;
+#endif
+}
+
 // Returns the number of items in child node at index.
 // This will use the 'count' value if available.
 static size_t BGEN_SYM(node_count)(BGEN_NODE *branch, int node_index) {
 #ifndef BGEN_COUNTED
     return BGEN_SYM(count0)(branch->children[node_index]);
+#elif defined(BGEN_PREFIXCOUNTS)
+    return branch->counts[node_index] - 1 - 
+        (node_index > 0 ? branch->counts[node_index-1] : 0);
 #else
     return branch->counts[node_index];
 #endif
 }
 
+#ifdef BGEN_COUNTED
+// With BGEN_PREFIXCOUNTS the counts of a branch are running totals, where
+// counts[i] is the number of items in children[0..i] plus items[0..i].
+// Operations that restructure a branch first convert the counts to plain
+// child counts, and then convert them back when done.
+static void BGEN_SYM(counts_unprefix)(BGEN_NODE *node) {
+#ifdef BGEN_PREFIXCOUNTS
+    if (!node->isleaf) {
+        for (int i = node->len; i > 0; i--) {
+            node->counts[i] -= node->counts[i-1] + 1;
+        }
+        node->counts[0]--;
+    }
+#else
+    (void)node;
+#endif
+}
+
+static void BGEN_SYM(counts_prefix)(BGEN_NODE *node) {
+#ifdef BGEN_PREFIXCOUNTS
+    if (!node->isleaf) {
+        node->counts[0]++;
+        for (int i = 1; i <= node->len; i++) {
+            node->counts[i] += node->counts[i-1] + 1;
+        }
+    }
+#else
+    (void)node;
+#endif
+}
+
+// Add one to the count of the child at index.
+static void BGEN_SYM(count_incr)(BGEN_NODE *branch, int i) {
+#ifdef BGEN_PREFIXCOUNTS
+    for (; i <= branch->len; i++) {
+        branch->counts[i]++;
+    }
+#else
+    branch->counts[i]++;
+#endif
+}
+
+// Subtract one from the count of the child at index.
+static void BGEN_SYM(count_decr)(BGEN_NODE *branch, int i) {
+#ifdef BGEN_PREFIXCOUNTS
+    for (; i <= branch->len; i++) {
+        branch->counts[i]--;
+    }
+#else
+    branch->counts[i]--;
+#endif
+}
+#endif
+
+// Returns the number of items in the branch that come before the child at
+// index. That is all children and items to the left.
+static size_t BGEN_SYM(count_before)(BGEN_NODE *branch, int i) {
+#ifdef BGEN_PREFIXCOUNTS
+    return i > 0 ? branch->counts[i-1] : 0;
+#else
+    size_t count = (size_t)i;
+    for (int j = 0; j < i; j++) {
+        count += BGEN_SYM(node_count)(branch, j);
+    }
+    return count;
+#endif
+}
+
+// Find the position of index in a branch. Returns the child index and
+// updates index to be relative to that child. Found is set to true when the
+// index points to the item that follows the child.
+static int BGEN_SYM(node_find_index)(BGEN_NODE *branch, size_t *index, 
+    bool *found)
+{
+#ifdef BGEN_PREFIXCOUNTS
+    // Branchless search of the running totals for the first child that has
+    // a total greater than index.
+    BGEN_COUNTTYPE *base = branch->counts;
+    int n = branch->len;
+    while (n > 1) {
+        int half = n / 2;
+        base = base[half] <= *index ? base+half : base;
+        n -= half;
+    }
+    int i = (int)(base-branch->counts) + (*base <= *index);
+    if (i > 0) {
+        *index -= branch->counts[i-1];
+    }
+    *found = i < branch->len && *index == BGEN_SYM(node_count)(branch, i);
+    return i;
+#else
+    int i = 0;
+    *found = false;
+    for (; i < branch->len; i++) {
+        size_t count = BGEN_SYM(node_count)(branch, i);
+        if (*index <= count) {
+            *found = *index == count;
+            break;
+        }
+        *index -= count + 1;
+    }
+    return i;
+#endif
+}
+
 static void BGEN_SYM(node_free)(BGEN_NODE *node, void *udata) {
 #ifdef BGEN_COW
     if (!BGEN_SYM(rc_release)(&node->rc)) {
@@ -921,6 +1383,23 @@ BGEN_INLINE
 static int BGEN_SYM(search_bsearch)(BGEN_ITEM *items, int nitems,
     BGEN_ITEM key, void *udata, int *found)
 {
+#ifdef BGEN_MULTI
+    // Lower bound bsearch. Returns the first of the equal items.
+    int i = 0;
+    int n = nitems;
+    *found = 0;
+    while (i < n) {
+        int j = (i + n) / 2;
+        int cmp = BGEN_SYM(compare)(key, items[j], udata);
+        if (cmp <= 0) {
+            *found = cmp == 0;
+            n = j;
+        } else {
+            i = j+1;
+        }
+    }
+    return i;
+#else
     // Standard bsearch. Balanced. Relies on branch prediction.
     int i = 0;
     int n = nitems;
@@ -938,6 +1417,7 @@ static int BGEN_SYM(search_bsearch)(BGEN_ITEM *items, int nitems,
     }
     *found = 0;
     return i;
+#endif
 }
 #else
 BGEN_INLINE
@@ -990,22 +1470,65 @@ static int BGEN_SYM(search_linear)(BGEN_ITEM *items, int nitems, BGEN_ITEM key,
 #endif
 
 
+#ifdef BGEN_MULTI
+// Returns the index of the first item that is greater than key.
+static int BGEN_SYM(search_upper)(BGEN_NODE *node, BGEN_ITEM key, 
+    void *udata)
+{
+    int i = 0;
+    int n = node->len;
+    while (i < n) {
+        int j = (i + n) / 2;
+        if (BGEN_SYM(less)(key, node->items[j], udata)) {
+            n = j;
+        } else {
+            i = j+1;
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef BGEN_PATHHINT
+// The path hint that is shared by all trees in the namespace. A tree header
+// swaps in its own path hint for the duration of its operations.
+static __thread uint8_t BGEN_SYM(ghint)[BGEN_MAXHEIGHT] = { 0 };
+#endif
+
 static int BGEN_SYM(search)(BGEN_NODE *node, BGEN_ITEM key, void *udata,
     int *found, int depth)
 {
 #ifndef BGEN_PATHHINT
     (void)depth; // not used
 #ifdef BGEN_BSEARCH
-    return BGEN_SYM(search_bsearch)(node->items, node->len, key, udata, found);
+    int i = BGEN_SYM(search_bsearch)(node->items, node->len, key, udata, found);
 #else // BGEN_LINEAR
-    return BGEN_SYM(search_linear)(node->items, node->len, key, udata, found);
+    int i = BGEN_SYM(search_linear)(node->items, node->len, key, udata, found);
+#endif
+#ifdef BGEN_MULTI
+    // The lower bound of a branch is only the first of its equals when the
+    // child to its left does not end with an equal item. Otherwise the found
+    // flag is dropped and the search continues into that child. The last
+    // items on the right edge of the child only grow on the way down, so the
+    // walk stops at the first one that is equal to key, and it only reaches
+    // the leaf when there are no equal items to the left.
+    if (*found && !node->isleaf) {
+        BGEN_NODE *child = node->children[i];
+        while (BGEN_SYM(less)(child->items[child->len-1], key, udata)) {
+            if (child->isleaf) {
+                return i;
+            }
+            child = child->children[child->len];
+        }
+        *found = 0;
+    }
 #endif
+    return i;
 #else
     // path hints are activated
     BGEN_ITEM *items = node->items;
     int nitems = node->len;
     int i = 0;
-    static __thread uint8_t BGEN_SYM(ghint)[BGEN_MAXHEIGHT] = { 0 };
     int j = BGEN_SYM(ghint)[depth];
     if (j >= node->len)  {
         j = node->len-1;
@@ -1060,6 +1583,21 @@ okhint:
 #endif
 }
 
+// Search used by the descending seeks. Same as search, but with BGEN_MULTI
+// the position is after the last of the equal items, which are then visited
+// on the way down.
+static int BGEN_SYM(search_desc)(BGEN_NODE *node, BGEN_ITEM key, void *udata,
+    int *found, int depth)
+{
+#ifdef BGEN_MULTI
+    (void)depth;
+    *found = 0;
+    return BGEN_SYM(search_upper)(node, key, udata);
+#else
+    return BGEN_SYM(search)(node, key, udata, found, depth);
+#endif
+}
+
 static void BGEN_SYM(print_spaces)(FILE *file, int depth) {
     for (int i = 0; i < depth; i++) {
         fprintf(file, "    ");
@@ -1089,7 +1627,7 @@ static void BGEN_SYM(node_print)(BGEN_NODE *node, FILE *file,
 #ifdef BGEN_COUNTED
         fprintf(file, ".counts=[ ");
         for (int i = 0; i <= node->len; i++) {
-            fprintf(file, "%zu ", node->counts[i]);
+            fprintf(file, "%zu ", BGEN_SYM(node_count)(node, i));
         }
         fprintf(file, "] ");
 #endif
@@ -1201,6 +1739,11 @@ static BGEN_NODE *BGEN_SYM(node_copy)(BGEN_NODE *node, bool deep, void *udata) {
             node2->rects[i] = node->rects[i];
         }
 #endif
+#ifdef BGEN_AUGMENT
+        for (int i = 0; i <= node->len; i++) {
+            node2->augs[i] = node->augs[i];
+        }
+#endif
 
     }
     return node2;
@@ -1258,6 +1801,9 @@ static bool BGEN_SYM(node_scan)(BGEN_NODE *node, bool(*iter)(BGEN_ITEM item,
         return true;
     }
     for (int i = 0; i < node->len; i++) {
+        if (node->height == 2) {
+            BGEN_SYM(prefetch_leaf)(node->children[i+1]);
+        }
         if (!BGEN_SYM(node_scan)(node->children[i], iter, udata)) {
             return false;
         }
@@ -1280,6 +1826,41 @@ static int BGEN_SYM(scan)(BGEN_NODE **root, bool(*iter)(BGEN_ITEM item,
     return status;
 }
 
+static bool BGEN_SYM(node_scan_spans)(BGEN_NODE *node, 
+    bool(*iter)(const BGEN_SYM(item_t) *items, int count, void *udata),
+    void *udata)
+{
+    if (node->isleaf) {
+        return iter(node->items, node->len, udata);
+    }
+    for (int i = 0; i < node->len; i++) {
+        if (!BGEN_SYM(node_scan_spans)(node->children[i], iter, udata)) {
+            return false;
+        }
+        if (!iter(&node->items[i], 1, udata)) {
+            return false;
+        }
+    }
+    return BGEN_SYM(node_scan_spans)(node->children[node->len], iter, udata);
+}
+
+// Same as scan but the items are not copied. Each leaf is passed as a single
+// span of items that points directly into the node, and the items in the
+// branches are passed as spans of one. The items are read-only and are only
+// valid until the next time the tree is modified.
+static int BGEN_SYM(scan_spans)(BGEN_NODE **root, 
+    bool(*iter)(const BGEN_SYM(item_t) *items, int count, void *udata),
+    void *udata)
+{
+    int status = BGEN_FINISHED;
+    if (*root) {
+        if (!BGEN_SYM(node_scan_spans)(*root, iter, udata)) {
+            status = BGEN_STOPPED;
+        }
+    }
+    return status;
+}
+
 static bool BGEN_SYM(node_scan_mut)(BGEN_NODE *node, bool(*iter)(BGEN_ITEM item, 
     void *udata), void *udata, int *status)
 {
@@ -1339,6 +1920,9 @@ static bool BGEN_SYM(node_scan_desc)(BGEN_NODE *node, bool(*iter)(
         }
         return true;
     }
+    if (node->height == 2) {
+        BGEN_SYM(prefetch_leaf)(node->children[node->len-1]);
+    }
     if (!BGEN_SYM(node_scan_desc)(node->children[node->len], iter, udata)) {
         return false;
     }
@@ -1346,6 +1930,9 @@ static bool BGEN_SYM(node_scan_desc)(BGEN_NODE *node, bool(*iter)(
         if (!iter(node->items[i], udata)) {
             return false;
         }
+        if (node->height == 2 && i > 0) {
+            BGEN_SYM(prefetch_leaf)(node->children[i-1]);
+        }
         if (!BGEN_SYM(node_scan_desc)(node->children[i], iter, udata)) {
             return false;
         }
@@ -1469,16 +2056,8 @@ static bool BGEN_SYM(node_seek_at)(BGEN_NODE *node, size_t index,
         }
         return true;
     }
-    bool found = false;
-    int i = 0;
-    for (; i < node->len; i++) {
-        size_t count = BGEN_SYM(node_count)(node, i);
-        if (index <= count) {
-            found = index == count;
-            break;
-        }
-        index -= count + 1;
-    }
+    bool found;
+    int i = BGEN_SYM(node_find_index)(node, &index, &found);
     if (!found) {
         if (!BGEN_SYM(node_seek_at)(node->children[i], index, iter, udata)) {
             return false;
@@ -1526,16 +2105,8 @@ static bool BGEN_SYM(node_seek_at_desc)(BGEN_NODE *node, size_t index,
         }
         return true;
     }
-    bool found = false;
-    int i = 0;
-    for (; i < node->len; i++) {
-        size_t count = BGEN_SYM(node_count)(node, i);
-        if (index <= count) {
-            found = index == count;
-            break;
-        }
-        index -= count + 1;
-    }
+    bool found;
+    int i = BGEN_SYM(node_find_index)(node, &index, &found);
     if (!found) {
         if (!BGEN_SYM(node_seek_at_desc)(node->children[i], index, iter, 
             udata))
@@ -1580,16 +2151,8 @@ static bool BGEN_SYM(node_seek_at_mut)(BGEN_NODE *node, size_t index,
         }
         return true;
     }
-    bool found = false;
-    int i = 0;
-    for (; i < node->len; i++) {
-        size_t count = BGEN_SYM(node_count)(node, i);
-        if (index <= count) {
-            found = index == count;
-            break;
-        }
-        index -= count + 1;
-    }
+    bool found;
+    int i = BGEN_SYM(node_find_index)(node, &index, &found);
     if (!found) {
         if (!BGEN_SYM(cow)(&node->children[i], udata)) {
             *status = BGEN_NOMEM;
@@ -1656,16 +2219,8 @@ static bool BGEN_SYM(node_seek_at_desc_mut)(BGEN_NODE *node, size_t index,
         }
         return true;
     }
-    bool found = false;
-    int i = 0;
-    for (; i < node->len; i++) {
-        size_t count = BGEN_SYM(node_count)(node, i);
-        if (index <= count) {
-            found = index == count;
-            break;
-        }
-        index -= count + 1;
-    }
+    bool found;
+    int i = BGEN_SYM(node_find_index)(node, &index, &found);
     if (!found) {
         if (!BGEN_SYM(cow)(&node->children[i], udata)) {
             *status = BGEN_NOMEM;
@@ -1773,7 +2328,7 @@ static bool BGEN_SYM(node_seek_desc)(BGEN_NODE *node, BGEN_ITEM key,
     bool(*iter)(BGEN_ITEM item, void *udata), void *udata, int depth) 
 {
     int found;
-    int i = BGEN_SYM(search)(node, key, udata, &found, depth);
+    int i = BGEN_SYM(search_desc)(node, key, udata, &found, depth);
     if (!found) {
         if (!node->isleaf) {
             if (!BGEN_SYM(node_seek_desc)(node->children[i], key, iter, udata,
@@ -1821,7 +2376,7 @@ static bool BGEN_SYM(node_seek_desc_mut)(BGEN_NODE *node, BGEN_ITEM key,
     int *status) 
 {
     int found;
-    int i = BGEN_SYM(search)(node, key, udata, &found, depth);
+    int i = BGEN_SYM(search_desc)(node, key, udata, &found, depth);
     while(1) {
         if (found) {
             if (!iter(node->items[i], udata)) {
@@ -1872,6 +2427,22 @@ static int BGEN_SYM(seek_desc_mut)(BGEN_NODE **root, BGEN_ITEM key,
 
 static void BGEN_SYM(shift_right)(BGEN_NODE *node, int i, int n) {
     BGEN_ASSERT(!BGEN_SYM(shared)(node));
+#ifdef BGEN_DEQUE
+    if (node->isleaf && i == 0 && n == 1) {
+        if (node->items == node->slots) {
+            // Out of head room. Move the items to the back of the room,
+            // which pays for the next HEADROOM items added at the front.
+            BGEN_ITEM *items = node->slots+BGEN_HEADROOM;
+            for (int j = node->len-1; j >= 0; j--) {
+                items[j] = node->items[j];
+            }
+            node->items = items;
+        }
+        node->items--;
+        node->len++;
+        return;
+    }
+#endif
     n--;
     for (int j = node->len; j > i; j--) {
         node->items[j+n] = node->items[j-1];
@@ -1885,6 +2456,9 @@ static void BGEN_SYM(shift_right)(BGEN_NODE *node, int i, int n) {
 #endif
 #ifdef BGEN_SPATIAL
             node->rects[j+n] = node->rects[j-1];
+#endif
+#ifdef BGEN_AUGMENT
+            node->augs[j+n] = node->augs[j-1];
 #endif
         }
     }
@@ -1906,11 +2480,10 @@ static int BGEN_SYM(index_of)(BGEN_NODE **root, BGEN_ITEM key,
     while (1) {
         int i, found;
         i = BGEN_SYM(search)(node, key, udata, &found, depth);
-        index += (size_t)i;
-        if (!node->isleaf) {
-            for (int j = 0; j < i; j++) {
-                index += BGEN_SYM(node_count)(node, j);
-            }
+        if (node->isleaf) {
+            index += (size_t)i;
+        } else {
+            index += BGEN_SYM(count_before)(node, i);
             if (found) {
                 index += BGEN_SYM(node_count)(node, i);
             }
@@ -1929,6 +2502,237 @@ static int BGEN_SYM(index_of)(BGEN_NODE **root, BGEN_ITEM key,
 #endif
 }
 
+#ifndef BGEN_NOORDER
+// Returns the number of items in the node that are less than key.
+static size_t BGEN_SYM(node_rank)(BGEN_NODE *node, BGEN_ITEM key, int *found,
+    int depth, void *udata)
+{
+    size_t rank = 0;
+    while (1) {
+        int i = BGEN_SYM(search)(node, key, udata, found, depth);
+        if (node->isleaf) {
+            return rank + (size_t)i;
+        }
+        rank += BGEN_SYM(count_before)(node, i);
+        if (*found) {
+            return rank + BGEN_SYM(node_count)(node, i);
+        }
+        node = node->children[i];
+        depth++;
+    }
+}
+#endif
+
+// Returns the number of items that are less than key, which is the index of
+// key when it exists, or the index where key would be inserted.
+// Returns FOUND or NOTFOUND
+static int BGEN_SYM(rank)(BGEN_NODE **root, BGEN_ITEM key, size_t *rank_out,
+    void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)key, (void)rank_out, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    int found = 0;
+    size_t rank = 0;
+    if (*root) {
+        rank = BGEN_SYM(node_rank)(*root, key, &found, 0, udata);
+    }
+    if (rank_out) {
+        *rank_out = rank;
+    }
+    return found ? BGEN_FOUND : BGEN_NOTFOUND;
+#endif
+}
+
+// Returns the number of items that are greater than or equal to lo and less
+// than hi. Both keys are searched together until their paths diverge, and
+// from there only the children between the two paths are counted.
+static size_t BGEN_SYM(count_range)(BGEN_NODE **root, BGEN_ITEM lo,
+    BGEN_ITEM hi, void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)lo, (void)hi, (void)udata;
+    return 0;
+#else
+    if (!*root || BGEN_SYM(compare)(lo, hi, udata) >= 0) {
+        return 0;
+    }
+    BGEN_NODE *node = *root;
+    int depth = 0;
+    while (1) {
+        int flo, fhi;
+        int ilo = BGEN_SYM(search)(node, lo, udata, &flo, depth);
+        int ihi = BGEN_SYM(search)(node, hi, udata, &fhi, depth);
+        if (node->isleaf) {
+            return (size_t)(ihi-ilo);
+        }
+        if (ilo == ihi && !flo && !fhi) {
+            // Same path. Continue to the child.
+            node = node->children[ilo];
+            depth++;
+            continue;
+        }
+        // The paths diverge. The rank of each key is the number of items and
+        // children before its position, plus its position in the child.
+        // Everything before ilo is shared by both ranks and is skipped.
+        size_t count = BGEN_SYM(count_before)(node, ihi) - 
+            BGEN_SYM(count_before)(node, ilo);
+        int found;
+        if (fhi) {
+            count += BGEN_SYM(node_count)(node, ihi);
+        } else {
+            count += BGEN_SYM(node_rank)(node->children[ihi], hi, &found,
+                depth+1, udata);
+        }
+        if (flo) {
+            count -= BGEN_SYM(node_count)(node, ilo);
+        } else {
+            count -= BGEN_SYM(node_rank)(node->children[ilo], lo, &found,
+                depth+1, udata);
+        }
+        return count;
+    }
+#endif
+}
+
+// Returns the summary of all items in the tree.
+// Returns FOUND, NOTFOUND when empty, or UNSUPPORTED without BGEN_AUGMENT.
+static int BGEN_SYM(augment)(BGEN_NODE **root, BGEN_AUGTYPE *aug_out,
+    void *udata)
+{
+#ifndef BGEN_AUGMENT
+    (void)root, (void)aug_out, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    if (!*root) {
+        return BGEN_NOTFOUND;
+    }
+    if (aug_out) {
+        *aug_out = BGEN_SYM(node_aug)(*root, udata);
+    }
+    return BGEN_FOUND;
+#endif
+}
+
+// Finds the first item where the summary of it and all items before it
+// satisfies pred. The pred must stay true once it becomes true, such as a
+// running sum of non-negative values reaching some amount. Child nodes that
+// cannot make pred true are skipped using their summaries.
+// Returns FOUND, NOTFOUND, or UNSUPPORTED without BGEN_AUGMENT.
+static int BGEN_SYM(augment_find)(BGEN_NODE **root, 
+    bool(*pred)(BGEN_AUGTYPE aug, void *udata), BGEN_ITEM *item_out, 
+    BGEN_AUGTYPE *aug_out, void *udata)
+{
+#ifndef BGEN_AUGMENT
+    (void)root, (void)pred, (void)item_out, (void)aug_out, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    if (!*root) {
+        return BGEN_NOTFOUND;
+    }
+    BGEN_NODE *node = *root;
+    BGEN_AUGTYPE acc = { 0 };
+    bool empty = true;
+    int i = 0;
+    while (1) {
+        if (!node->isleaf) {
+            BGEN_AUGTYPE aug = BGEN_SYM(aug_append)(acc, empty, 
+                node->augs[i], udata);
+            if (pred(aug, udata)) {
+                node = node->children[i];
+                i = 0;
+                continue;
+            }
+            acc = aug;
+            empty = false;
+        }
+        if (i == node->len) {
+            return BGEN_NOTFOUND;
+        }
+        BGEN_AUGTYPE aug = BGEN_SYM(aug_append)(acc, empty, 
+            BGEN_SYM(item_aug)(node->items[i], udata), udata);
+        if (pred(aug, udata)) {
+            if (item_out) {
+                *item_out = node->items[i];
+            }
+            if (aug_out) {
+                *aug_out = aug;
+            }
+            return BGEN_FOUND;
+        }
+        acc = aug;
+        empty = false;
+        i++;
+    }
+#endif
+}
+
+#if defined(BGEN_AUGMENT) && !defined(BGEN_NOORDER)
+// Combine the summaries of all items in node that are greater than or equal
+// to lo, when haslo, and less than hi, when hashi. Children that are fully
+// inside of the range use their summary. Only the children along the lo and
+// hi paths are visited.
+static void BGEN_SYM(node_aggregate)(BGEN_NODE *node, BGEN_ITEM lo, 
+    BGEN_ITEM hi, bool haslo, bool hashi, BGEN_AUGTYPE *acc, bool *empty, 
+    int depth, void *udata)
+{
+    int flo = 0, fhi = 0;
+    int ilo = haslo ? BGEN_SYM(search)(node, lo, udata, &flo, depth) : 0;
+    int ihi = hashi ? BGEN_SYM(search)(node, hi, udata, &fhi, depth) : 
+        node->len;
+    for (int i = ilo; i <= ihi; i++) {
+        if (!node->isleaf) {
+            bool clo = haslo && i == ilo;
+            bool chi = hashi && i == ihi && !fhi;
+            if (clo || chi) {
+                if (!clo || !flo) {
+                    BGEN_SYM(node_aggregate)(node->children[i], lo, hi, clo,
+                        chi, acc, empty, depth+1, udata);
+                }
+            } else {
+                *acc = BGEN_SYM(aug_append)(*acc, *empty, node->augs[i], 
+                    udata);
+                *empty = false;
+            }
+        }
+        if (i < ihi) {
+            *acc = BGEN_SYM(aug_append)(*acc, *empty, 
+                BGEN_SYM(item_aug)(node->items[i], udata), udata);
+            *empty = false;
+        }
+    }
+}
+#endif
+
+// Returns the summary of all items that are greater than or equal to lo and
+// less than hi.
+// Returns FOUND, NOTFOUND when no items are in the range, or UNSUPPORTED 
+// without BGEN_AUGMENT or with BGEN_NOORDER.
+static int BGEN_SYM(aggregate_range)(BGEN_NODE **root, BGEN_ITEM lo, 
+    BGEN_ITEM hi, BGEN_AUGTYPE *aug_out, void *udata)
+{
+#if !defined(BGEN_AUGMENT) || defined(BGEN_NOORDER)
+    (void)root, (void)lo, (void)hi, (void)aug_out, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    if (!*root || BGEN_SYM(compare)(lo, hi, udata) >= 0) {
+        return BGEN_NOTFOUND;
+    }
+    BGEN_AUGTYPE acc = { 0 };
+    bool empty = true;
+    BGEN_SYM(node_aggregate)(*root, lo, hi, true, true, &acc, &empty, 0, 
+        udata);
+    if (empty) {
+        return BGEN_NOTFOUND;
+    }
+    if (aug_out) {
+        *aug_out = acc;
+    }
+    return BGEN_FOUND;
+#endif
+}
+
 // returns FOUND or NOTFOUND
 static int BGEN_SYM(get)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM *item_out,
     void *udata)
@@ -2014,14 +2818,30 @@ static bool BGEN_SYM(contains)(BGEN_NODE **root, BGEN_ITEM key, void *udata) {
     return BGEN_SYM(get)(root, key, 0, udata) == BGEN_FOUND;
 }
 
-static BGEN_NODE *BGEN_SYM(split)(BGEN_NODE *left, BGEN_ITEM *mitem, 
+// Returns true when inserting the item adds to the tree, rather than replacing
+// an existing item.
+static bool BGEN_SYM(insert_adds)(BGEN_NODE **root, BGEN_ITEM item,
     void *udata)
+{
+#ifdef BGEN_MULTI
+    (void)root, (void)item, (void)udata;
+    return true;
+#else
+    return !BGEN_SYM(contains)(root, item, udata);
+#endif
+}
+
+static BGEN_NODE *BGEN_SYM(split)(BGEN_NODE *left, BGEN_ITEM *mitem, 
+    BGEN_SPARE *spare, void *udata)
 {
     (void)udata;
-    BGEN_NODE *right = BGEN_SYM(alloc_node)(left->isleaf, udata);
+    BGEN_NODE *right = BGEN_SYM(take_node)(left->isleaf, spare, udata);
     if (!right) {
         return 0;
     }
+#ifdef BGEN_COUNTED
+    BGEN_SYM(counts_unprefix)(left);
+#endif
     int mid = BGEN_MAXITEMS / 2;
     *mitem = left->items[mid];
     right->height = left->height;
@@ -2044,22 +2864,34 @@ static BGEN_NODE *BGEN_SYM(split)(BGEN_NODE *left, BGEN_ITEM *mitem,
             right->rects[i] = left->rects[mid+1+i];
         }
         left->rects[left->len] = BGEN_SYM(rect_calc)(left, left->len, udata);
+#endif
+#ifdef BGEN_AUGMENT
+        for (int i = 0; i <= right->len; i++) {
+            right->augs[i] = left->augs[mid+1+i];
+        }
 #endif
     }
+#ifdef BGEN_COUNTED
+    BGEN_SYM(counts_prefix)(left);
+    BGEN_SYM(counts_prefix)(right);
+#endif
     return right;
 }
 
-static bool BGEN_SYM(split_root)(BGEN_NODE **root, void *udata) {
+static bool BGEN_SYM(split_root)(BGEN_NODE **root, BGEN_SPARE *spare,
+    void *udata)
+{
     (void)udata;
     BGEN_ASSERT(!BGEN_SYM(shared)(*root));
-    BGEN_NODE *newroot = BGEN_SYM(alloc_node)(0, udata);
+    BGEN_NODE *newroot = BGEN_SYM(take_node)(0, spare, udata);
     if (!newroot) {
         return false;
     }
     newroot->len = 1;
     newroot->height = (*root)->height+1;
     newroot->children[0] = *root;
-    newroot->children[1] = BGEN_SYM(split)(*root, &newroot->items[0], udata);
+    newroot->children[1] = BGEN_SYM(split)(*root, &newroot->items[0], spare,
+        udata);
     if (!newroot->children[1]) {
         BGEN_SYM(free)(newroot, BGEN_NODE_SIZE(newroot), udata);
         return false;
@@ -2067,34 +2899,50 @@ static bool BGEN_SYM(split_root)(BGEN_NODE **root, void *udata) {
 #ifdef BGEN_COUNTED
     newroot->counts[0] = BGEN_SYM(count0)(newroot->children[0]);
     newroot->counts[1] = BGEN_SYM(count0)(newroot->children[1]);
+    BGEN_SYM(counts_prefix)(newroot);
 #endif
 #ifdef BGEN_SPATIAL
     newroot->rects[0] = BGEN_SYM(rect_calc)(newroot, 0, udata);
     newroot->rects[1] = BGEN_SYM(rect_calc)(newroot, 1, udata);
+#endif
+#ifdef BGEN_AUGMENT
+    BGEN_SYM(aug_calc)(newroot, 0, udata);
+    BGEN_SYM(aug_calc)(newroot, 1, udata);
 #endif
     *root = newroot;
     return true;
 }
 
 
-static bool BGEN_SYM(split_child_at)(BGEN_NODE *node, int i, void *udata) {
+static bool BGEN_SYM(split_child_at)(BGEN_NODE *node, int i,
+    BGEN_SPARE *spare, void *udata)
+{
     (void)udata;
     BGEN_ASSERT(!BGEN_SYM(shared)(node));
     BGEN_ITEM mitem;
-    BGEN_NODE *right = BGEN_SYM(split)(node->children[i], &mitem, udata);
+    BGEN_NODE *right = BGEN_SYM(split)(node->children[i], &mitem, spare,
+        udata);
     if (!right) {
         return false;
     }
+#ifdef BGEN_COUNTED
+    BGEN_SYM(counts_unprefix)(node);
+#endif
     BGEN_SYM(shift_right)(node, i, 1);
     node->items[i] = mitem;
     node->children[i+1] = right;
 #ifdef BGEN_COUNTED
     node->counts[i] = BGEN_SYM(count0)(node->children[i]);
     node->counts[i+1] = BGEN_SYM(count0)(node->children[i+1]);
+    BGEN_SYM(counts_prefix)(node);
 #endif
 #ifdef BGEN_SPATIAL
     node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
     node->rects[i+1] = BGEN_SYM(rect_calc)(node, i+1, udata);
+#endif
+#ifdef BGEN_AUGMENT
+    BGEN_SYM(aug_calc)(node, i, udata);
+    BGEN_SYM(aug_calc)(node, i+1, udata);
 #endif
     return true;
 }
@@ -2126,8 +2974,10 @@ static void BGEN_SYM(give_left)(BGEN_NODE *node, int index, bool balance) {
         right->items[i] = right->items[n+i];
     }
 #ifdef BGEN_COUNTED
+    BGEN_SYM(counts_unprefix)(node);
     node->counts[index-1] = left->len;
     node->counts[index] = right->len;
+    BGEN_SYM(counts_prefix)(node);
 #endif
 
 }
@@ -2159,8 +3009,10 @@ static void BGEN_SYM(give_right)(BGEN_NODE *node, int index, bool balance) {
     right->len += n;
 
 #ifdef BGEN_COUNTED
+    BGEN_SYM(counts_unprefix)(node);
     node->counts[index] = left->len;
     node->counts[index+1] = right->len;
+    BGEN_SYM(counts_prefix)(node);
 #endif
 }
 
@@ -2181,7 +3033,13 @@ static int BGEN_SYM(insert1)(BGEN_NODE *node, int act, size_t index,
 retry:
     switch (act) {
     case BGEN_INSITEM:
+#ifdef BGEN_MULTI
+        // Always insert after the existing equal items.
+        i = BGEN_SYM(search_upper)(node, item, udata);
+        found = 0;
+#else
         i = BGEN_SYM(search)(node, item, udata, &found, depth);
+#endif
         break;
     case BGEN_INSAT: 
     case BGEN_REPAT:
@@ -2197,15 +3055,9 @@ retry:
             i = index;
             found = 1;
         } else {
-            i = 0;
-            for (; i < node->len; i++) {
-                size_t count = BGEN_SYM(node_count)(node, i);
-                if (index <= count) {
-                    found = index == count;
-                    break;
-                }
-                index -= count + 1;
-            }
+            bool bfound;
+            i = BGEN_SYM(node_find_index)(node, &index, &bfound);
+            found = bfound;
         }
 #ifndef BGEN_NOORDER
         // Check order. 
@@ -2215,7 +3067,7 @@ retry:
             child = node->children[i];
             while (1) {
                 if (child->isleaf) {
-                    if (!BGEN_SYM(less)(child->items[child->len-1], item, 
+                    if (!BGEN_SYM(inorder)(child->items[child->len-1], item, 
                         udata))
                     {
                         return BGEN_OUTOFORDER;
@@ -2227,7 +3079,7 @@ retry:
             child = node->children[i+1];
             while (1) {
                 if (child->isleaf) {
-                    if (!BGEN_SYM(less)(item, child->items[0], udata)) {
+                    if (!BGEN_SYM(inorder)(item, child->items[0], udata)) {
                        return BGEN_OUTOFORDER;
                     }
                     break;
@@ -2238,12 +3090,12 @@ retry:
             int i0 = i-1;
             int i1 = act == BGEN_REPAT && node->isleaf ? i+1 : i;
             if (i0 >= 0) {
-                if (!BGEN_SYM(less)(node->items[i0], item, udata)) {
+                if (!BGEN_SYM(inorder)(node->items[i0], item, udata)) {
                 return BGEN_OUTOFORDER;
                 }
             }
             if (i1 < node->len) {
-                if (!BGEN_SYM(less)(item, node->items[i1], udata)) {
+                if (!BGEN_SYM(inorder)(item, node->items[i1], udata)) {
                 return BGEN_OUTOFORDER;
                 }
             }
@@ -2257,7 +3109,7 @@ retry:
         if (node->isleaf) {
 #ifndef BGEN_NOORDER
             // check order
-            if (!BGEN_SYM(less)(item, node->items[0], udata)) {
+            if (!BGEN_SYM(inorder)(item, node->items[0], udata)) {
                 return BGEN_OUTOFORDER;
             }
 #endif
@@ -2270,7 +3122,7 @@ retry:
         if (node->isleaf) {
 #ifndef BGEN_NOORDER
             // check order
-            if (!BGEN_SYM(less)(node->items[node->len-1], item, udata)) {
+            if (!BGEN_SYM(inorder)(node->items[node->len-1], item, udata)) {
                 return BGEN_OUTOFORDER;
             }
 #endif
@@ -2311,7 +3163,7 @@ retry:
         if (ret != BGEN_MUSTSPLIT || node->len == BGEN_MAXITEMS) {
             if (ret == BGEN_INSERTED) {
 #ifdef BGEN_COUNTED
-                node->counts[i]++;
+                BGEN_SYM(count_incr)(node, i);
 #endif
 #ifdef BGEN_SPATIAL
                 // Expand the rectangle on insert
@@ -2322,18 +3174,29 @@ retry:
                 node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
 #endif
             }
+#ifdef BGEN_AUGMENT
+            if (ret == BGEN_INSERTED || ret == BGEN_REPLACED) {
+                BGEN_SYM(aug_calc)(node, i, udata);
+            }
+#endif
             return ret;
         }
-        if (!BGEN_SYM(split_child_at)(node, i, udata)) {
+        if (!BGEN_SYM(split_child_at)(node, i, 0, udata)) {
             return BGEN_NOMEM;
         }
         if (act == BGEN_INSITEM) {
+#ifdef BGEN_MULTI
+            if (!BGEN_SYM(less)(item, node->items[i], udata)) {
+                i++;
+            }
+#else
             int cmp = BGEN_SYM(compare)(item, node->items[i], udata);
             if (cmp <= 0) {
                 found = cmp == 0;
             } else {
                 i++;
             }
+#endif
         } else {
             if (act == BGEN_INSAT) {
                 // revert the index
@@ -2368,13 +3231,13 @@ static int BGEN_SYM(insert0)(BGEN_NODE **root, int act, size_t index,
         if (ret != BGEN_MUSTSPLIT) {
             return ret;
         }
-        if (!BGEN_SYM(split_root)(root, udata)) {
+        if (!BGEN_SYM(split_root)(root, 0, udata)) {
             return BGEN_NOMEM;
         }
     }
 }
 
-#ifndef BGEN_NOORDER
+#if !defined(BGEN_AUGMENT) && !defined(BGEN_NOORDER)
 static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
     BGEN_ITEM *olditem, void *udata)
 {
@@ -2398,8 +3261,13 @@ static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #endif
     while (1) {
         BGEN_ASSERT(!BGEN_SYM(shared)(node));
+#ifdef BGEN_MULTI
+        int found = 0;
+        int i = BGEN_SYM(search_upper)(node, item, udata);
+#else
         int found;
         int i = BGEN_SYM(search)(node, item, udata, &found, depth);
+#endif
         if (found) {
             if (olditem) {
                 *olditem = node->items[i];
@@ -2416,7 +3284,7 @@ static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
                 // Use the standard splitting algorithm
 #if defined(BGEN_COUNTED) || defined(BGEN_SPATIAL)
 #ifdef BGEN_COUNTED
-                parent->counts[cidx]--;
+                BGEN_SYM(count_decr)(parent, cidx);
 #endif
 #ifdef BGEN_SPATIAL
                 parent->rects[cidx] = rects[depth-1];
@@ -2439,12 +3307,16 @@ static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #endif
                     continue;
                 }
-                if (!BGEN_SYM(split_child_at)(node, i, udata)) {
+                if (!BGEN_SYM(split_child_at)(node, i, 0, udata)) {
                     ret = BGEN_NOMEM;
                     break;
                 }
+#ifdef BGEN_MULTI
+                i += !BGEN_SYM(less)(item, node->items[i], udata);
+#else
                 int cmp = BGEN_SYM(compare)(item, node->items[i], udata);
                 i += cmp > 0;
+#endif
             } else {
                 BGEN_SYM(shift_right)(node, i, 1);
                 node->items[i] = item;
@@ -2454,7 +3326,7 @@ static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #if defined(BGEN_COUNTED) || defined(BGEN_SPATIAL)
         path[depth] = i;
 #ifdef BGEN_COUNTED
-        node->counts[i]++;
+        BGEN_SYM(count_incr)(node, i);
 #endif
 #ifdef BGEN_SPATIAL
         rects[depth] = node->rects[i];
@@ -2475,7 +3347,7 @@ static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
     for (int i = 0; i < depth; i++) {
         int j = path[i];
 #ifdef BGEN_COUNTED
-        node->counts[j]--;
+        BGEN_SYM(count_decr)(node, j);
 #endif
 #ifdef BGEN_SPATIAL
         node->rects[j] = rects[i];
@@ -2487,7 +3359,7 @@ static int BGEN_SYM(insert_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 }
 #endif
 
-// returns INSERTED, REPLACED, or NOMEM
+// returns INSERTED, REPLACED, NOMEM, or OVERFLOW
 static int BGEN_SYM(insert)(BGEN_NODE **root, BGEN_ITEM item,
     BGEN_ITEM *olditem, void *udata)
 {
@@ -2495,69 +3367,215 @@ static int BGEN_SYM(insert)(BGEN_NODE **root, BGEN_ITEM item,
     (void)root, (void)item, (void)olditem, (void)udata;
     return BGEN_UNSUPPORTED;
 #else
+    if (BGEN_SYM(count_full)(root)) {
+        // A full tree may still replace an existing item, but not on the
+        // fastpath, which counts the item before knowing if it's new.
+        if (BGEN_SYM(insert_adds)(root, item, udata)) {
+            return BGEN_OVERFLOW;
+        }
+        return BGEN_SYM(insert0)(root, BGEN_INSITEM, 0, item, olditem, udata);
+    }
+#ifndef BGEN_AUGMENT
     int ret = BGEN_SYM(insert_fastpath)(root, item, olditem, udata);
     if (ret) {
         return ret;
     }
+#endif
     return BGEN_SYM(insert0)(root, BGEN_INSITEM, 0, item, olditem, udata);
 #endif
 }
 
-static void BGEN_SYM(shift_left)(BGEN_NODE *node, int i, int n, bool for_merge){
+#ifndef BGEN_NOORDER
+// Same as insert1, but the item is passed to the callback first. When the
+// item exists it is changed in place, otherwise the item is a copy of key
+// that's changed prior to being inserted. The callback is called only once,
+// right before returning FOUND or INSERTED. 
+static int BGEN_SYM(upsert1)(BGEN_NODE *node, BGEN_ITEM *item, 
+    void(*fn)(BGEN_ITEM *item, bool exists, void *udata), bool full, 
+    void *udata, int depth)
+{
     BGEN_ASSERT(!BGEN_SYM(shared)(node));
-    n--;
-    for (int j = i; j < node->len-1; j++) {
-        node->items[j+n] = node->items[j+1];
-    }
-    if (!node->isleaf) {
-        if (for_merge) {
-            i++;
+    int found;
+    int i = BGEN_SYM(search)(node, *item, udata, &found, depth);
+    while (1) {
+        if (found) {
+            fn(&node->items[i], true, udata);
+            BGEN_ASSERT(BGEN_SYM(compare)(*item, node->items[i], udata) == 0);
+#ifdef BGEN_SPATIAL
+            if (!node->isleaf) {
+                node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
+            }
+#endif
+            return BGEN_FOUND;
         }
-        for (int j = i; j < node->len; j++) {
-            node->children[j+n] = node->children[j+1];
+        if (node->isleaf) {
+            if (full) {
+                return BGEN_OVERFLOW;
+            }
+            if (node->len == BGEN_MAXITEMS) {
+                return BGEN_MUSTSPLIT;
+            }
+            BGEN_ITEM key = *item;
+            (void)key;
+            fn(item, false, udata);
+            BGEN_ASSERT(BGEN_SYM(compare)(key, *item, udata) == 0);
+            BGEN_SYM(shift_right)(node, i, 1);
+            node->items[i] = *item;
+            return BGEN_INSERTED;
         }
-#ifdef BGEN_COUNTED
-        for (int j = i; j < node->len; j++) {
-            node->counts[j+n] = node->counts[j+1];
+        if (!BGEN_SYM(cow)(&node->children[i], udata)) {
+            return BGEN_NOMEM;
         }
+        int ret = BGEN_SYM(upsert1)(node->children[i], item, fn, full, udata,
+            depth+1);
+        if (ret != BGEN_MUSTSPLIT || node->len == BGEN_MAXITEMS) {
+            if (ret == BGEN_INSERTED) {
+#ifdef BGEN_COUNTED
+                BGEN_SYM(count_incr)(node, i);
 #endif
 #ifdef BGEN_SPATIAL
-        for (int j = i; j < node->len; j++) {
-            node->rects[j+n] = node->rects[j+1];
-        }
+                node->rects[i] = BGEN_SYM(rect_join)(node->rects[i], 
+                    BGEN_SYM(item_rect)(*item, udata));
+            } else if (ret == BGEN_FOUND) {
+                node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
 #endif
-    }
-    node->len--;
-}
-
-static void BGEN_SYM(join)(BGEN_NODE *left, BGEN_NODE *right, void *udata) {
-    (void)udata;
-    BGEN_ASSERT(!BGEN_SYM(shared)(left));
-    BGEN_ASSERT(!BGEN_SYM(shared)(right));
-    for (int i = 0; i < right->len; i++) {
-        left->items[left->len+i] = right->items[i];
-    }
-    if (!left->isleaf) {
-        for (int i = 0; i <= right->len; i++) {
-            left->children[left->len+i] = right->children[i];
-        }
-#ifdef BGEN_COUNTED
-        for (int i = 0; i <= right->len; i++) {
-            left->counts[left->len+i] = right->counts[i];
-        }
+            }
+#ifdef BGEN_AUGMENT
+            if (ret == BGEN_INSERTED || ret == BGEN_FOUND) {
+                BGEN_SYM(aug_calc)(node, i, udata);
+            }
 #endif
-#ifdef BGEN_SPATIAL
-        for (int i = 0; i <= right->len; i++) {
-            left->rects[left->len+i] = right->rects[i];
+            return ret;
         }
-        left->rects[left->len-1] = 
-            BGEN_SYM(rect_calc)(left, left->len-1, udata);
-#endif
+        if (!BGEN_SYM(split_child_at)(node, i, 0, udata)) {
+            return BGEN_NOMEM;
+        }
+        i = BGEN_SYM(search)(node, *item, udata, &found, depth);
     }
-    left->len += right->len;
 }
+#endif
 
-static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
+// Get or insert an item and change it in place using a single descent.
+// The callback is given the existing item, or a new item that is a copy of
+// key, which is inserted once the callback returns. The callback must not 
+// change the order of the item.
+// returns FOUND, INSERTED, NOMEM, or OVERFLOW
+static int BGEN_SYM(upsert)(BGEN_NODE **root, BGEN_ITEM key,
+    void(*fn)(BGEN_ITEM *item, bool exists, void *udata), void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)key, (void)fn, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    // A full tree may still change existing items.
+    bool full = BGEN_SYM(count_full)(root);
+    if (!*root) {
+        *root = BGEN_SYM(alloc_node)(1, udata);
+        if (!*root) {
+            return BGEN_NOMEM;
+        }
+        fn(&key, false, udata);
+        (*root)->items[0] = key;
+        (*root)->len = 1;
+        (*root)->height = 1;
+        return BGEN_INSERTED;
+    }
+    if (!BGEN_SYM(cow)(root, udata)) {
+        return BGEN_NOMEM;
+    }
+    while (1) {
+        int ret = BGEN_SYM(upsert1)(*root, &key, fn, full, udata, 0);
+        if (ret != BGEN_MUSTSPLIT) {
+            return ret;
+        }
+        if (!BGEN_SYM(split_root)(root, 0, udata)) {
+            return BGEN_NOMEM;
+        }
+    }
+#endif
+}
+
+static void BGEN_SYM(shift_left)(BGEN_NODE *node, int i, int n, bool for_merge){
+    BGEN_ASSERT(!BGEN_SYM(shared)(node));
+#ifdef BGEN_DEQUE
+    if (node->isleaf && i == 0 && n == 1) {
+        if (node->items == node->slots+BGEN_HEADROOM) {
+            // Out of head room. Move the items back to the start of the
+            // slots, which pays for the next HEADROOM items removed.
+            for (int j = 1; j < node->len; j++) {
+                node->slots[j-1] = node->items[j];
+            }
+            node->items = node->slots;
+        } else {
+            node->items++;
+        }
+        node->len--;
+        return;
+    }
+#endif
+    n--;
+    for (int j = i; j < node->len-1; j++) {
+        node->items[j+n] = node->items[j+1];
+    }
+    if (!node->isleaf) {
+        if (for_merge) {
+            i++;
+        }
+        for (int j = i; j < node->len; j++) {
+            node->children[j+n] = node->children[j+1];
+        }
+#ifdef BGEN_COUNTED
+        for (int j = i; j < node->len; j++) {
+            node->counts[j+n] = node->counts[j+1];
+        }
+#endif
+#ifdef BGEN_SPATIAL
+        for (int j = i; j < node->len; j++) {
+            node->rects[j+n] = node->rects[j+1];
+        }
+#endif
+#ifdef BGEN_AUGMENT
+        for (int j = i; j < node->len; j++) {
+            node->augs[j+n] = node->augs[j+1];
+        }
+#endif
+    }
+    node->len--;
+}
+
+static void BGEN_SYM(join)(BGEN_NODE *left, BGEN_NODE *right, void *udata) {
+    (void)udata;
+    BGEN_ASSERT(!BGEN_SYM(shared)(left));
+    BGEN_ASSERT(!BGEN_SYM(shared)(right));
+    for (int i = 0; i < right->len; i++) {
+        left->items[left->len+i] = right->items[i];
+    }
+    if (!left->isleaf) {
+        for (int i = 0; i <= right->len; i++) {
+            left->children[left->len+i] = right->children[i];
+        }
+#ifdef BGEN_COUNTED
+        for (int i = 0; i <= right->len; i++) {
+            left->counts[left->len+i] = right->counts[i];
+        }
+#endif
+#ifdef BGEN_SPATIAL
+        for (int i = 0; i <= right->len; i++) {
+            left->rects[left->len+i] = right->rects[i];
+        }
+        left->rects[left->len-1] = 
+            BGEN_SYM(rect_calc)(left, left->len-1, udata);
+#endif
+#ifdef BGEN_AUGMENT
+        for (int i = 0; i <= right->len; i++) {
+            left->augs[left->len+i] = right->augs[i];
+        }
+#endif
+    }
+    left->len += right->len;
+}
+
+static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
     BGEN_ASSERT(!BGEN_SYM(shared)(node));
 
     if (i == node->len) {
@@ -2577,10 +3595,18 @@ static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
         // that includes (left,item,right), and places the contents into the
         // existing left node. Delete the right node altogether and move the
         // following items and child nodes to the left by one slot.
+#ifdef BGEN_COUNTED
+        BGEN_SYM(counts_unprefix)(left);
+        BGEN_SYM(counts_unprefix)(right);
+#endif
         left->items[left->len] = node->items[i];
         left->len++;
         BGEN_SYM(join)(left, right, udata);
-#ifdef BGEN_COUNTED
+#ifdef BGEN_PREFIXCOUNTS
+        // The running total of the merged child is the one of the right.
+        BGEN_SYM(counts_prefix)(left);
+        size_t count = node->counts[i+1];
+#elif defined(BGEN_COUNTED)
         size_t count = node->counts[i] + 1 + node->counts[i+1];
 #endif
         BGEN_SYM(free)(right, BGEN_NODE_SIZE(right), udata);
@@ -2591,6 +3617,9 @@ static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
 #ifdef BGEN_SPATIAL
         node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
         
+#endif
+#ifdef BGEN_AUGMENT
+        BGEN_SYM(aug_calc)(node, i, udata);
 #endif
         return;
     }
@@ -2605,12 +3634,19 @@ static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
     } else {
         // For branches only.
         // Shift items and children over by one.
+#ifdef BGEN_COUNTED
+        BGEN_SYM(counts_unprefix)(left);
+        BGEN_SYM(counts_unprefix)(right);
+#endif
         if (left->len < right->len) {
             // move right to left
             left->items[left->len] = node->items[i];
             left->children[left->len+1] = right->children[0];
     #ifdef BGEN_COUNTED
             left->counts[left->len+1] = right->counts[0];
+    #endif
+    #ifdef BGEN_AUGMENT
+            left->augs[left->len+1] = right->augs[0];
     #endif
             left->len++;
             node->items[i] = right->items[0];
@@ -2628,6 +3664,9 @@ static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
             right->children[0] = left->children[left->len];
     #ifdef BGEN_COUNTED
             right->counts[0] = left->counts[left->len];
+    #endif
+    #ifdef BGEN_AUGMENT
+            right->augs[0] = left->augs[left->len];
     #endif
             node->items[i] = left->items[left->len-1];
             left->len--;
@@ -2637,15 +3676,25 @@ static void BGEN_SYM(rebalance)(BGEN_NODE *node, int i, void *udata) {
                 udata);
         #endif
         }
+#ifdef BGEN_COUNTED
+        BGEN_SYM(counts_prefix)(left);
+        BGEN_SYM(counts_prefix)(right);
+#endif
     }
 #ifdef BGEN_COUNTED
+    BGEN_SYM(counts_unprefix)(node);
     node->counts[i] = BGEN_SYM(count0)(node->children[i]);
     node->counts[i+1] = BGEN_SYM(count0)(node->children[i+1]);
+    BGEN_SYM(counts_prefix)(node);
 #endif
 #ifdef BGEN_SPATIAL
     node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
     node->rects[i+1] = BGEN_SYM(rect_calc)(node, i+1, udata);
 #endif
+#ifdef BGEN_AUGMENT
+    BGEN_SYM(aug_calc)(node, i, udata);
+    BGEN_SYM(aug_calc)(node, i+1, udata);
+#endif
 
 }
 
@@ -2685,14 +3734,9 @@ static int BGEN_SYM(delete1)(BGEN_NODE *node, int act, BGEN_ITEM key,
                 found = 1;
             }
         } else {
-            for (; i < node->len; i++) {
-                size_t count = BGEN_SYM(node_count)(node, i);
-                if (index <= count) {
-                    found = index == count;
-                    break;
-                }
-                index -= count + 1;
-            }
+            bool bfound;
+            i = BGEN_SYM(node_find_index)(node, &index, &bfound);
+            found = bfound;
         }
         break;
     }
@@ -2745,13 +3789,19 @@ static int BGEN_SYM(delete1)(BGEN_NODE *node, int act, BGEN_ITEM key,
         return ret;
     }
 #ifdef BGEN_COUNTED
-    node->counts[i]--;
+    BGEN_SYM(count_decr)(node, i);
 #endif
 #ifdef BGEN_SPATIAL
     BGEN_RECT rect = BGEN_SYM(item_rect)(*prev, udata);
     if (act == BGEN_POPMAX || BGEN_SYM(rect_onedge)(rect, node->rects[i])) {
         node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
     }
+#endif
+#ifdef BGEN_AUGMENT
+    if (node->children[i]->len >= BGEN_MINITEMS) {
+        // Otherwise the rebalance will take care of it.
+        BGEN_SYM(aug_calc)(node, i, udata);
+    }
 #endif
     if (node->children[i]->len < BGEN_MINITEMS) {
         BGEN_SYM(rebalance)(node, i, udata);
@@ -2803,7 +3853,7 @@ static int BGEN_SYM(delete0)(BGEN_NODE **root, int act, BGEN_ITEM key,
 // conditions, then there may be rollback operations, such as reverting
 // COUNTS and SPATIAL rectangles. As long as those are features of the
 // tree.
-#if !defined(BGEN_SPATIAL) && !defined(BGEN_NOORDER)
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT) && !defined(BGEN_NOORDER)
 static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
     BGEN_ITEM *olditem, void *udata)
 {
@@ -2887,7 +3937,9 @@ static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
                     left->items[left->len] = parent->items[i];
                     left->len++;
                     BGEN_SYM(join)(left, right, udata);
-            #ifdef BGEN_COUNTED
+            #ifdef BGEN_PREFIXCOUNTS
+                    size_t count = parent->counts[i+1];
+            #elif defined(BGEN_COUNTED)
                     size_t count = parent->counts[i] + 1 + parent->counts[i+1];
             #endif
                     BGEN_SYM(free)(right, BGEN_NODE_SIZE(right), udata);
@@ -2914,7 +3966,7 @@ static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
                     node->items[i] = child->items[child->len-1];
                     child->len--;
             #ifdef BGEN_COUNTED
-                    node->counts[i]--;
+                    BGEN_SYM(count_decr)(node, i);
             #endif
                 } else if (node->children[i+1]->len > BGEN_MINITEMS) {
                     if (!BGEN_SYM(cow)(&node->children[i+1], udata)) {
@@ -2926,12 +3978,9 @@ static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
                         *olditem = node->items[i];
                     }
                     node->items[i] = child->items[0];
-                    child->len--;
-                    for (int j = 0; j < child->len; j++) {
-                        child->items[j] = child->items[j+1];
-                    }
+                    BGEN_SYM(shift_left)(child, 0, 1, false);
             #ifdef BGEN_COUNTED
-                    node->counts[i+1]--;
+                    BGEN_SYM(count_decr)(node, i+1);
             #endif
                 } else {
                     break;
@@ -2947,7 +3996,7 @@ static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
         }
         path[depth++] = i;
 #ifdef BGEN_COUNTED
-        node->counts[i]--;
+        BGEN_SYM(count_decr)(node, i);
 #endif
         parent = node;
         node = node->children[i];
@@ -2956,7 +4005,7 @@ static int BGEN_SYM(delete_fastpath)(BGEN_NODE **root, BGEN_ITEM key,
     node = *root;
     for (int i = 0; i < depth; i++) {
         int j = path[i];
-        node->counts[j]++;
+        BGEN_SYM(count_incr)(node, j);
         node = node->children[j];
     }
 #endif
@@ -2973,7 +4022,7 @@ static int BGEN_SYM(delete)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM *olditem,
     return BGEN_UNSUPPORTED;
 #else
     int ret;
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
     ret = BGEN_SYM(delete_fastpath)(root, key, olditem, udata);
     if (ret) {
         return ret;
@@ -3098,24 +4147,101 @@ static int BGEN_SYM(get_at)(BGEN_NODE **root, size_t index, BGEN_ITEM *item,
             }
             return BGEN_FOUND;
         }
-        int i = 0;
-        for (; i < node->len; i++) {
-            size_t count = BGEN_SYM(node_count)(node, i);
-            if (index < count) {
-                break;
-            }
-            if (index == count) {
-                if (item) {
-                    *item = node->items[i];
-                }
-                return BGEN_FOUND;
+        bool found;
+        int i = BGEN_SYM(node_find_index)(node, &index, &found);
+        if (found) {
+            if (item) {
+                *item = node->items[i];
             }
-            index -= count + 1;
+            return BGEN_FOUND;
         }
         node = node->children[i];
     }
 }
 
+// Get the items for a sorted list of indexes, relative to the node, in a
+// single pass. Each child is descended at most once. The slots are the
+// positions in the output array.
+static void BGEN_SYM(node_get_many)(BGEN_NODE *node, size_t *indexes,
+    size_t *slots, size_t n, BGEN_ITEM *items)
+{
+    if (node->isleaf) {
+        for (size_t k = 0; k < n; k++) {
+            items[slots[k]] = node->items[indexes[k]];
+        }
+        return;
+    }
+    size_t k = 0;
+    size_t offset = 0;
+    for (int i = 0; i <= node->len && k < n; i++) {
+        size_t count = BGEN_SYM(node_count)(node, i);
+        size_t j = k;
+        while (j < n && indexes[j] < offset+count) {
+            indexes[j] -= offset;
+            j++;
+        }
+        if (j > k) {
+            BGEN_SYM(node_get_many)(node->children[i], indexes+k, slots+k, 
+                j-k, items);
+            k = j;
+        }
+        offset += count;
+        if (i < node->len) {
+            while (k < n && indexes[k] == offset) {
+                items[slots[k]] = node->items[i];
+                k++;
+            }
+            offset++;
+        }
+    }
+}
+
+// Get the items at each of the quantiles, where each p is from 0.0 to 1.0.
+// The quantiles are converted to indexes, which are sorted and resolved in
+// a single pass over the tree.
+static int BGEN_SYM(quantiles)(BGEN_NODE **root, double *ps, size_t n,
+    BGEN_ITEM *items, void *udata)
+{
+    if (!*root) {
+        return BGEN_NOTFOUND;
+    }
+    // Indexes followed by slots. Small requests use the stack.
+    size_t buf[32];
+    size_t *indexes = buf;
+    if (n > sizeof(buf)/sizeof(size_t)/2) {
+        indexes = (size_t*)BGEN_SYM(malloc)(n*2*sizeof(size_t), udata);
+        if (!indexes) {
+            return BGEN_NOMEM;
+        }
+    }
+    size_t *slots = indexes+n;
+    size_t count = BGEN_SYM(count0)(*root);
+    for (size_t k = 0; k < n; k++) {
+        size_t index = 0;
+        if (ps[k] >= 1.0) {
+            index = count-1;
+        } else if (ps[k] > 0.0) {
+            index = (size_t)(ps[k] * (double)count);
+            index = index < count ? index : count-1;
+        }
+        // Insertion sort, as there are usually only a few quantiles, and
+        // they are often already in order.
+        size_t j = k;
+        while (j > 0 && indexes[j-1] > index) {
+            indexes[j] = indexes[j-1];
+            slots[j] = slots[j-1];
+            j--;
+        }
+        indexes[j] = index;
+        slots[j] = k;
+    }
+    BGEN_SYM(node_get_many)(*root, indexes, slots, n, items);
+    if (indexes != buf) {
+        BGEN_SYM(free)(indexes, n*2*sizeof(size_t), udata);
+    }
+    return BGEN_FOUND;
+}
+
 static int BGEN_SYM(get_at_mut)(BGEN_NODE **root, size_t index, BGEN_ITEM *item,
     void *udata)
 {
@@ -3137,19 +4263,13 @@ static int BGEN_SYM(get_at_mut)(BGEN_NODE **root, size_t index, BGEN_ITEM *item,
             }
             return BGEN_FOUND;
         }
-        int i = 0;
-        for (; i < node->len; i++) {
-            size_t count = BGEN_SYM(node_count)(node, i);
-            if (index < count) {
-                break;
-            }
-            if (index == count) {
-                if (item) {
-                    *item = node->items[i];
-                }
-                return BGEN_FOUND;
+        bool found;
+        int i = BGEN_SYM(node_find_index)(node, &index, &found);
+        if (found) {
+            if (item) {
+                *item = node->items[i];
             }
-            index -= count + 1;
+            return BGEN_FOUND;
         }
         if (!BGEN_SYM(cow)(&node->children[i], udata)) {
             return BGEN_NOMEM;
@@ -3178,7 +4298,7 @@ static int BGEN_SYM(replace_at)(BGEN_NODE **root, size_t index, BGEN_ITEM item,
     return BGEN_SYM(insert0)(root, BGEN_REPAT, index, item, olditem, udata);
 }
 
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
 static int BGEN_SYM(pop_front_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
     void *udata)
 {
@@ -3205,7 +4325,7 @@ static int BGEN_SYM(pop_front_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
                     }
                     BGEN_SYM(give_left)(parent, 1, true);
 #ifdef BGEN_COUNTED
-                    parent->counts[0]--;
+                    BGEN_SYM(count_decr)(parent, 0);
 #endif
                 } else {
                     break;
@@ -3214,14 +4334,11 @@ static int BGEN_SYM(pop_front_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
             if (olditem) {
                 *olditem = node->items[0];
             }
-            for (int i = 1; i < node->len; i++) {
-                node->items[i-1] = node->items[i];
-            }
-            node->len--;
+            BGEN_SYM(shift_left)(node, 0, 1, false);
             return BGEN_DELETED;
         }
 #ifdef BGEN_COUNTED
-        node->counts[0]--;
+        BGEN_SYM(count_decr)(node, 0);
         depth++;
 #endif
         parent = node;
@@ -3234,7 +4351,7 @@ static int BGEN_SYM(pop_front_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
 #ifdef BGEN_COUNTED
     node = *root;
     for (int i = 0; i < depth; i++) {
-        node->counts[0]++;
+        BGEN_SYM(count_incr)(node, 0);
         node = node->children[0];
     }
 #endif
@@ -3246,7 +4363,7 @@ static int BGEN_SYM(pop_front)(BGEN_NODE **root, BGEN_ITEM *olditem,
     void *udata)
 {
     int ret;
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
     ret = BGEN_SYM(pop_front_fastpath)(root, olditem, udata);
     if (ret) {
         return ret;
@@ -3263,7 +4380,7 @@ static int BGEN_SYM(pop_front)(BGEN_NODE **root, BGEN_ITEM *olditem,
     return ret;
 }
 
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
 static int BGEN_SYM(pop_back_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
     void *udata)
 {
@@ -3294,7 +4411,7 @@ static int BGEN_SYM(pop_back_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
                     }
                     BGEN_SYM(give_right)(parent, parent->len-1, true);
 #ifdef BGEN_COUNTED
-                    parent->counts[parent->len]--;
+                    BGEN_SYM(count_decr)(parent, parent->len);
 #endif
                 } else {
                     break;
@@ -3307,7 +4424,7 @@ static int BGEN_SYM(pop_back_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
             return BGEN_DELETED;
         }
 #ifdef BGEN_COUNTED
-        node->counts[node->len]--;
+        BGEN_SYM(count_decr)(node, node->len);
         depth++;
 #endif
         parent = node;
@@ -3320,7 +4437,7 @@ static int BGEN_SYM(pop_back_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
 #ifdef BGEN_COUNTED
     node = *root;
     for (int i = 0; i < depth; i++) {
-        node->counts[node->len]++;
+        BGEN_SYM(count_incr)(node, node->len);
         node = node->children[node->len];
     }
 #endif
@@ -3331,7 +4448,7 @@ static int BGEN_SYM(pop_back_fastpath)(BGEN_NODE **root, BGEN_ITEM *olditem,
 static int BGEN_SYM(pop_back)(BGEN_NODE **root, BGEN_ITEM *olditem, void *udata)
 {
     int ret;
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
     ret = BGEN_SYM(pop_back_fastpath)(root, olditem, udata);
     if (ret) {
         return ret;
@@ -3348,7 +4465,7 @@ static int BGEN_SYM(pop_back)(BGEN_NODE **root, BGEN_ITEM *olditem, void *udata)
     return ret;
 }
 
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
 static int BGEN_SYM(push_front_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
     void *udata)
 {
@@ -3381,18 +4498,18 @@ static int BGEN_SYM(push_front_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
                     BGEN_SYM(give_right)(parent, 0, false);
                 } else {
                     // Use the standard splitting algorithm
-                    if (!BGEN_SYM(split_child_at)(parent, 0, udata)) {
+                    if (!BGEN_SYM(split_child_at)(parent, 0, 0, udata)) {
                         ret = BGEN_NOMEM;
                         break;
                     }
                 }
 #ifdef BGEN_COUNTED
-                parent->counts[0]++;
+                BGEN_SYM(count_incr)(parent, 0);
 #endif
                 node = parent->children[0];
             }
 #ifndef BGEN_NOORDER
-            if (!BGEN_SYM(less)(item, node->items[0], udata)) {
+            if (!BGEN_SYM(inorder)(item, node->items[0], udata)) {
                 ret = BGEN_OUTOFORDER;
                 break;
             }
@@ -3402,7 +4519,7 @@ static int BGEN_SYM(push_front_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
             return BGEN_INSERTED;
         }
 #ifdef BGEN_COUNTED
-        node->counts[0]++;
+        BGEN_SYM(count_incr)(node, 0);
         depth++;
 #endif
         parent = node;
@@ -3415,7 +4532,7 @@ static int BGEN_SYM(push_front_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #ifdef BGEN_COUNTED
     node = *root;
     for (int i = 0; i < depth; i++) {
-        node->counts[0]--;
+        BGEN_SYM(count_decr)(node, 0);
         node = node->children[0];
     }
 #endif
@@ -3424,7 +4541,10 @@ static int BGEN_SYM(push_front_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #endif
 
 static int BGEN_SYM(push_front)(BGEN_NODE **root, BGEN_ITEM item, void *udata) {
-#ifndef BGEN_SPATIAL
+    if (BGEN_SYM(count_full)(root)) {
+        return BGEN_OVERFLOW;
+    }
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
     int ret = BGEN_SYM(push_front_fastpath)(root, item, udata);
     if (ret) {
         return ret;
@@ -3433,7 +4553,7 @@ static int BGEN_SYM(push_front)(BGEN_NODE **root, BGEN_ITEM item, void *udata) {
     return BGEN_SYM(insert0)(root, BGEN_PUSHFRONT, 0, item, 0, udata);
 }
 
-#ifndef BGEN_SPATIAL
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
 static int BGEN_SYM(push_back_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
     void *udata)
 {
@@ -3468,7 +4588,7 @@ static int BGEN_SYM(push_back_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
                     BGEN_SYM(give_left)(parent, parent->len, false);
                 } else {
                     // Use the standard splitting algorithm
-                    if (!BGEN_SYM(split_child_at)(parent, parent->len, 
+                    if (!BGEN_SYM(split_child_at)(parent, parent->len, 0,
                         udata))
                     {
                         ret = BGEN_NOMEM;
@@ -3476,12 +4596,12 @@ static int BGEN_SYM(push_back_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
                     }
                 }
 #ifdef BGEN_COUNTED
-                parent->counts[parent->len]++;
+                BGEN_SYM(count_incr)(parent, parent->len);
 #endif
                 node = parent->children[parent->len];
             }
 #ifndef BGEN_NOORDER
-            if (!BGEN_SYM(less)(node->items[node->len-1], item, udata)) {
+            if (!BGEN_SYM(inorder)(node->items[node->len-1], item, udata)) {
                 ret = BGEN_OUTOFORDER;
                 break;
             }
@@ -3490,7 +4610,7 @@ static int BGEN_SYM(push_back_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
             return BGEN_INSERTED;
         }
 #ifdef BGEN_COUNTED
-        node->counts[node->len]++;
+        BGEN_SYM(count_incr)(node, node->len);
         depth++;
 #endif
         parent = node;
@@ -3503,7 +4623,7 @@ static int BGEN_SYM(push_back_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #ifdef BGEN_COUNTED
     node = *root;
     for (int i = 0; i < depth; i++) {
-        node->counts[node->len]--;
+        BGEN_SYM(count_decr)(node, node->len);
         node = node->children[node->len];
     }
 #endif
@@ -3512,7 +4632,10 @@ static int BGEN_SYM(push_back_fastpath)(BGEN_NODE **root, BGEN_ITEM item,
 #endif
 
 static int BGEN_SYM(push_back)(BGEN_NODE **root, BGEN_ITEM item, void *udata) {
-#ifndef BGEN_SPATIAL
+    if (BGEN_SYM(count_full)(root)) {
+        return BGEN_OVERFLOW;
+    }
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
     int ret = BGEN_SYM(push_back_fastpath)(root, item, udata);
     if (ret) {
         return ret;
@@ -3526,9 +4649,13 @@ static int BGEN_SYM(push_back)(BGEN_NODE **root, BGEN_ITEM item, void *udata) {
 // Returns NOMEM: System is out of memory.
 // Returns NOTFOUND: The item cannot be inserted because the index is out of 
 // bounds, thus the index was > tree count.
+// Returns OVERFLOW: The BGEN_COUNTTYPE counts cannot take another item.
 static int BGEN_SYM(insert_at)(BGEN_NODE **root, size_t index, BGEN_ITEM item,
     void *udata)
 {
+    if (BGEN_SYM(count_full)(root)) {
+        return BGEN_OVERFLOW;
+    }
     return BGEN_SYM(insert0)(root, BGEN_INSAT, index, item, 0, udata);
 }
 
@@ -3564,788 +4691,3005 @@ static int BGEN_SYM(clone)(BGEN_NODE **root, BGEN_NODE **newroot, void *udata) {
     return BGEN_COPIED;
 }
 
-#ifdef BGEN_SPATIAL
-
-// The nearby scanner is a kNN operation that uses a heap-based priority queue.
-
-#define BGEN_PQUEUE struct BGEN_SYM(pqueue)
-#define BGEN_PITEM struct BGEN_SYM(pitem)
-#define BGEN_DSIZE 8
-
-BGEN_PITEM {
-    BGEN_RTYPE dist;
-    uint64_t index;    // 1+ = node, item = UINT64_MAX
-    union {
-        BGEN_ITEM item;
-        BGEN_NODE *node;
-    } u;
-};
+#ifdef BGEN_COUNTED
 
-BGEN_PQUEUE {
-    BGEN_PITEM *items;
-    size_t len;
-    size_t cap;
-    uint64_t index; // index counter, this increments with every added node.
-};
+// Recalculate the counts, rectangles, and summaries for all children of a
+// branch.
+static void BGEN_SYM(branch_calc)(BGEN_NODE *branch, void *udata) {
+    (void)udata;
+    for (int i = 0; i <= branch->len; i++) {
+        branch->counts[i] = BGEN_SYM(count0)(branch->children[i]);
+#ifdef BGEN_SPATIAL
+        branch->rects[i] = BGEN_SYM(rect_calc)(branch, i, udata);
+#endif
+#ifdef BGEN_AUGMENT
+        BGEN_SYM(aug_calc)(branch, i, udata);
+#endif
+    }
+    BGEN_SYM(counts_prefix)(branch);
+}
 
-static void BGEN_SYM(pqueue_init)(BGEN_PQUEUE *queue) {
-    queue->items = 0;
-    queue->len = 0;
-    queue->cap = 0;
-    queue->index = 0;
+// Recalculate the count, rectangle, and summary for the child at index.
+static void BGEN_SYM(child_calc)(BGEN_NODE *branch, int i, void *udata) {
+    (void)udata;
+#ifdef BGEN_PREFIXCOUNTS
+    // Shift the running totals by the difference.
+    BGEN_COUNTTYPE delta = (BGEN_COUNTTYPE)(
+        BGEN_SYM(count0)(branch->children[i]) -
+        BGEN_SYM(node_count)(branch, i));
+    for (int j = i; j <= branch->len; j++) {
+        branch->counts[j] += delta;
+    }
+#else
+    branch->counts[i] = BGEN_SYM(count0)(branch->children[i]);
+#endif
+#ifdef BGEN_SPATIAL
+    branch->rects[i] = BGEN_SYM(rect_calc)(branch, i, udata);
+#endif
+#ifdef BGEN_AUGMENT
+    BGEN_SYM(aug_calc)(branch, i, udata);
+#endif
 }
 
-static int BGEN_SYM(pcompare)(BGEN_PQUEUE *queue, size_t i, size_t j, 
-    void *udata)
+// Same as node_free, but the items at positions start to end are not freed,
+// because they are still owned by the caller.
+static void BGEN_SYM(node_free_except)(BGEN_NODE *node, size_t start,
+    size_t end, void *udata)
 {
-    int cmp;
-    // Compare distances
-    cmp = queue->items[i].dist < queue->items[j].dist ? -1 : 
-          queue->items[i].dist > queue->items[j].dist;
-    if (cmp != 0) {
-        return cmp;
+#ifdef BGEN_COW
+    if (!BGEN_SYM(rc_release)(&node->rc)) {
+        return;
     }
-    // Distances are equal, compare the indexes
-    cmp = queue->items[i].index < queue->items[j].index ? -1 : 
-          queue->items[i].index > queue->items[j].index;
-    if (cmp != 0) {
-        return cmp;
+#endif
+    size_t pos = 0;
+    for (int i = 0; i <= node->len; i++) {
+        if (!node->isleaf) {
+            BGEN_SYM(node_free_except)(node->children[i], 
+                start > pos ? start-pos : 0, end > pos ? end-pos : 0, udata);
+            pos += BGEN_SYM(node_count)(node, i);
+        }
+        if (i < node->len) {
+            if (pos < start || pos >= end) {
+                BGEN_SYM(item_free)(node->items[i], udata);
+            }
+            pos++;
+        }
     }
-    // Indexes are equal, must be an item. compare the items
-    BGEN_ASSERT(queue->items[i].index == UINT64_MAX);
-    BGEN_ASSERT(queue->items[j].index == UINT64_MAX);
-    return BGEN_SYM(compare)(queue->items[i].u.item, queue->items[j].u.item,
-        udata);
+    BGEN_SYM(free)(node, BGEN_NODE_SIZE(node), udata);
 }
 
-static void BGEN_SYM(pclear)(BGEN_PQUEUE *queue, void *udata) {
-    if (queue->items) {
-        BGEN_SYM(free)(queue->items, sizeof(BGEN_PITEM)*queue->cap, udata);
+// Build a new tree from an array of items, bottom up, with the items spread
+// evenly over as few nodes as possible. All nodes are allocated before any
+// are filled. Returns null when out of memory.
+static BGEN_NODE *BGEN_SYM(build)(BGEN_ITEM *items, size_t n, void *udata) {
+    const size_t fanout = BGEN_MAXITEMS+1;
+    size_t nleaves = (n+fanout)/fanout;
+    size_t nnodes = 0;
+    for (size_t k = nleaves; ; k = (k+fanout-1)/fanout) {
+        nnodes += k;
+        if (k == 1) {
+            break;
+        }
     }
-    BGEN_SYM(pqueue_init)(queue);
+    // One array for the nodes of every level followed by the positions of
+    // the items that separate the nodes of the current level.
+    size_t size = nnodes*sizeof(BGEN_NODE*) + nleaves*sizeof(size_t);
+    BGEN_NODE **nodes = (BGEN_NODE**)BGEN_SYM(malloc)(size, udata);
+    if (!nodes) {
+        return 0;
+    }
+    size_t *seps = (size_t*)(nodes+nnodes);
+    for (size_t i = 0; i < nnodes; i++) {
+        nodes[i] = BGEN_SYM(alloc_node)(i < nleaves, udata);
+        if (!nodes[i]) {
+            while (i > 0) {
+                i--;
+                BGEN_SYM(free)(nodes[i], BGEN_NODE_SIZE(nodes[i]), udata);
+            }
+            BGEN_SYM(free)(nodes, size, udata);
+            return 0;
+        }
+    }
+    // Fill the leaves
+    size_t per = (n-nleaves+1)/nleaves;
+    size_t extra = (n-nleaves+1)%nleaves;
+    size_t j = 0;
+    for (size_t i = 0; i < nleaves; i++) {
+        BGEN_NODE *leaf = nodes[i];
+        leaf->height = 1;
+        leaf->len = (int)(per + (i < extra));
+        for (int k = 0; k < leaf->len; k++) {
+            leaf->items[k] = items[j++];
+        }
+        if (i < nleaves-1) {
+            seps[i] = j++;
+        }
+    }
+    // Fill the branches, one level at a time.
+    BGEN_NODE **level = nodes;
+    size_t nlevel = nleaves;
+    while (nlevel > 1) {
+        BGEN_NODE **next = level+nlevel;
+        size_t nnext = (nlevel+fanout-1)/fanout;
+        per = nlevel/nnext;
+        extra = nlevel%nnext;
+        size_t c = 0;
+        for (size_t i = 0; i < nnext; i++) {
+            BGEN_NODE *branch = next[i];
+            int nchildren = (int)(per + (i < extra));
+            branch->height = level[c]->height+1;
+            branch->len = nchildren-1;
+            for (int k = 0; k < nchildren; k++) {
+                branch->children[k] = level[c+k];
+                if (k < branch->len) {
+                    branch->items[k] = items[seps[c+k]];
+                }
+            }
+            c += nchildren;
+            if (i < nnext-1) {
+                seps[i] = seps[c-1];
+            }
+            BGEN_SYM(branch_calc)(branch, udata);
+        }
+        level = next;
+        nlevel = nnext;
+    }
+    BGEN_NODE *root = level[0];
+    BGEN_SYM(free)(nodes, size, udata);
+    return root;
 }
 
-static void BGEN_SYM(pswap)(BGEN_PQUEUE *queue, size_t i, size_t j) {
-    BGEN_PITEM tmp  = queue->items[i];
-    queue->items[i] = queue->items[j];
-    queue->items[j] = tmp;
+// Join the left tree, the item, and the right tree into one. The shorter of
+// the two trees may be empty, in which case the item is added to the edge of
+// the other. On success the result is stored in left, and right is set to
+// null. When out of memory false is returned and both trees still have the
+// same items as before, though their nodes may have been copied or split.
+static bool BGEN_SYM(join_trees)(BGEN_NODE **left, BGEN_ITEM item,
+    BGEN_NODE **right, BGEN_SPARE *spare, void *udata)
+{
+    if ((*left && !BGEN_SYM(cow)(left, udata)) || 
+        (*right && !BGEN_SYM(cow)(right, udata)))
+    {
+        return false;
+    }
+    BGEN_NODE *a = *left;
+    BGEN_NODE *b = *right;
+    int aheight = a ? a->height : 0;
+    int bheight = b ? b->height : 0;
+    BGEN_NODE *path[BGEN_MAXHEIGHT];
+    int depth = 0;
+    if (aheight == bheight) {
+        if (a->len + b->len < BGEN_MAXITEMS) {
+            // Merge (a,item,b) into a.
+            BGEN_SYM(counts_unprefix)(a);
+            BGEN_SYM(counts_unprefix)(b);
+            a->items[a->len++] = item;
+            BGEN_SYM(join)(a, b, udata);
+            BGEN_SYM(counts_prefix)(a);
+            BGEN_SYM(free)(b, BGEN_NODE_SIZE(b), udata);
+        } else {
+            // New root with a and b as children, and then balance them.
+            BGEN_NODE *root = BGEN_SYM(take_node)(0, spare, udata);
+            if (!root) {
+                return false;
+            }
+            root->height = a->height+1;
+            root->len = 1;
+            root->items[0] = item;
+            root->children[0] = a;
+            root->children[1] = b;
+            BGEN_SYM(branch_calc)(root, udata);
+            while (root->children[0]->len < BGEN_MINITEMS ||
+                root->children[1]->len < BGEN_MINITEMS)
+            {
+                BGEN_SYM(rebalance)(root, 0, udata);
+            }
+            *left = root;
+        }
+    } else if (aheight > bheight) {
+        // Go down the right side of a to the node that b will be appended
+        // to, splitting full nodes along the way.
+        if (a->len == BGEN_MAXITEMS) {
+            if (!BGEN_SYM(split_root)(left, spare, udata)) {
+                return false;
+            }
+            a = *left;
+        }
+        BGEN_NODE *node = a;
+        while (node->height > bheight+1) {
+            if (!BGEN_SYM(cow)(&node->children[node->len], udata)) {
+                return false;
+            }
+            if (node->children[node->len]->len == BGEN_MAXITEMS) {
+                if (!BGEN_SYM(split_child_at)(node, node->len, spare, udata)) {
+                    return false;
+                }
+            }
+            path[depth++] = node;
+            node = node->children[node->len];
+        }
+        if (!b) {
+            // Nothing to append but the item, at the end of the leaf.
+            node->items[node->len++] = item;
+        } else {
+            if (!BGEN_SYM(cow)(&node->children[node->len], udata)) {
+                return false;
+            }
+            int i = node->len;
+            BGEN_SYM(counts_unprefix)(node);
+            node->items[i] = item;
+            node->children[i+1] = b;
+            node->len++;
+            node->counts[i+1] = BGEN_SYM(count0)(b);
+            BGEN_SYM(counts_prefix)(node);
+#ifdef BGEN_SPATIAL
+            node->rects[i] = BGEN_SYM(rect_calc)(node, i, udata);
+            node->rects[i+1] = BGEN_SYM(rect_calc)(node, i+1, udata);
+#endif
+#ifdef BGEN_AUGMENT
+            BGEN_SYM(aug_calc)(node, i+1, udata);
+#endif
+            while (node->children[node->len]->len < BGEN_MINITEMS) {
+                BGEN_SYM(rebalance)(node, node->len, udata);
+            }
+        }
+        while (depth > 0) {
+            depth--;
+            BGEN_SYM(child_calc)(path[depth], path[depth]->len, udata);
+        }
+    } else {
+        // Go down the left side of b to the node that a will be prepended
+        // to, splitting full nodes along the way.
+        if (b->len == BGEN_MAXITEMS) {
+            if (!BGEN_SYM(split_root)(right, spare, udata)) {
+                return false;
+            }
+            b = *right;
+        }
+        BGEN_NODE *node = b;
+        while (node->height > aheight+1) {
+            if (!BGEN_SYM(cow)(&node->children[0], udata)) {
+                return false;
+            }
+            if (node->children[0]->len == BGEN_MAXITEMS) {
+                if (!BGEN_SYM(split_child_at)(node, 0, spare, udata)) {
+                    return false;
+                }
+            }
+            path[depth++] = node;
+            node = node->children[0];
+        }
+        if (!a) {
+            // Nothing to prepend but the item, at the start of the leaf.
+            BGEN_SYM(shift_right)(node, 0, 1);
+            node->items[0] = item;
+        } else {
+            if (!BGEN_SYM(cow)(&node->children[0], udata)) {
+                return false;
+            }
+            BGEN_SYM(counts_unprefix)(node);
+            BGEN_SYM(shift_right)(node, 0, 1);
+            node->items[0] = item;
+            node->children[0] = a;
+            node->counts[0] = BGEN_SYM(count0)(a);
+            BGEN_SYM(counts_prefix)(node);
+#ifdef BGEN_SPATIAL
+            node->rects[0] = BGEN_SYM(rect_calc)(node, 0, udata);
+#endif
+#ifdef BGEN_AUGMENT
+            BGEN_SYM(aug_calc)(node, 0, udata);
+#endif
+            while (node->children[0]->len < BGEN_MINITEMS) {
+                BGEN_SYM(rebalance)(node, 0, udata);
+            }
+        }
+        while (depth > 0) {
+            depth--;
+            BGEN_SYM(child_calc)(path[depth], 0, udata);
+        }
+        *left = b;
+    }
+    *right = 0;
+    return true;
 }
 
-
-static BGEN_PITEM BGEN_SYM(pswap_remove)(BGEN_PQUEUE *queue, size_t i) {
-    BGEN_PITEM item = queue->items[i];
-    queue->items[i] = queue->items[queue->len-1];
-    queue->len--;
-    return item;
+// Same as join_trees, but both trees may be empty.
+static bool BGEN_SYM(join3)(BGEN_NODE **left, BGEN_ITEM item,
+    BGEN_NODE **right, BGEN_SPARE *spare, void *udata)
+{
+    if (!*left && !*right) {
+        BGEN_NODE *leaf = BGEN_SYM(take_node)(1, spare, udata);
+        if (!leaf) {
+            return false;
+        }
+        leaf->height = 1;
+        leaf->len = 1;
+        leaf->items[0] = item;
+        *left = leaf;
+        return true;
+    }
+    return BGEN_SYM(join_trees)(left, item, right, spare, udata);
 }
 
-
-static int BGEN_SYM(ppush0)(BGEN_PQUEUE *queue, BGEN_PITEM item, void *udata) {
-    if (queue->len == queue->cap) {
-        int cap = queue->cap == 0 ? 8 : queue->cap*2;
-        BGEN_PITEM *items2 = BGEN_SYM(malloc)(sizeof(BGEN_PITEM)*cap, udata);
-        if (!items2) {
-            return BGEN_NOMEM;
+// Split the tree at index. The items before index go to left and the rest
+// go to right, either of which may end up empty. The node is consumed.
+// Returns false when out of memory, in which case all is freed.
+static bool BGEN_SYM(split_at)(BGEN_NODE *node, size_t index,
+    BGEN_NODE **left, BGEN_NODE **right, BGEN_SPARE *spare, void *udata)
+{
+    *left = 0;
+    *right = 0;
+    if (index == 0) {
+        *right = node;
+        return true;
+    }
+    if (index == BGEN_SYM(count0)(node)) {
+        *left = node;
+        return true;
+    }
+    if (!BGEN_SYM(cow)(&node, udata)) {
+        BGEN_SYM(node_free)(node, udata);
+        return false;
+    }
+    if (node->isleaf) {
+        BGEN_NODE *rnode = BGEN_SYM(take_node)(1, spare, udata);
+        if (!rnode) {
+            BGEN_SYM(node_free)(node, udata);
+            return false;
         }
-        for (size_t i = 0; i < queue->len; i++) {
-            items2[i] = queue->items[i];
+        rnode->height = 1;
+        rnode->len = node->len-(int)index;
+        for (int i = 0; i < rnode->len; i++) {
+            rnode->items[i] = node->items[(int)index+i];
         }
-        BGEN_SYM(free)(queue->items, sizeof(BGEN_PITEM)*queue->cap, udata);
-        queue->items = items2;
-        queue->cap = cap;
+        node->len = (int)index;
+        *left = node;
+        *right = rnode;
+        return true;
     }
-    queue->items[queue->len++] = item;
-    size_t i = queue->len - 1;
-    while (i != 0) {
-        size_t parent = (i - 1) / 2;
-        if (!(BGEN_SYM(pcompare)(queue, parent, i, udata) > 0)) {
-            break;
+    // Break the branch into the nodes to the left of the child that holds
+    // index, the child itself, and the nodes to the right. Each side is
+    // kept with the item that separates it from the child.
+    bool found;
+    int i = BGEN_SYM(node_find_index)(node, &index, &found);
+    BGEN_NODE *child = node->children[i];
+    BGEN_NODE *lnode = 0;
+    BGEN_NODE *rnode = 0;
+    BGEN_ITEM litem = { 0 };
+    BGEN_ITEM ritem = { 0 };
+    bool hasl = i > 0;
+    bool hasr = i < node->len;
+    if (hasr) {
+        ritem = node->items[i];
+        if (i+1 == node->len) {
+            rnode = node->children[i+1];
+        } else {
+            rnode = BGEN_SYM(take_node)(0, spare, udata);
+            if (!rnode) {
+                BGEN_SYM(node_free)(node, udata);
+                return false;
+            }
+            rnode->height = node->height;
+            rnode->len = node->len-i-1;
+            for (int j = 0; j < rnode->len; j++) {
+                rnode->items[j] = node->items[i+1+j];
+            }
+            for (int j = 0; j <= rnode->len; j++) {
+                rnode->children[j] = node->children[i+1+j];
+            }
+            BGEN_SYM(branch_calc)(rnode, udata);
         }
-        BGEN_SYM(pswap)(queue, parent, i);
-        i = parent;
     }
-    return 0;
-}
-
-static BGEN_PITEM BGEN_SYM(ppop)(BGEN_PQUEUE *queue, void *udata) {
-    BGEN_PITEM item = BGEN_SYM(pswap_remove)(queue, 0);
-    size_t i = 0;
-    while (1) {
-        size_t smallest = i;
-        size_t left = i * 2 + 1;
-        size_t right = i * 2 + 2;
-        if (left < queue->len && BGEN_SYM(pcompare)(queue, left, smallest, 
-            udata) <= 0)
-        {
-            smallest = left;
-        }
-        if (right < queue->len && BGEN_SYM(pcompare)(queue, right, smallest, 
-            udata) <= 0)
-        {
-            smallest = right;
+    if (hasl) {
+        litem = node->items[i-1];
+    }
+    if (i > 1) {
+        node->len = i-1;
+#ifdef BGEN_SPATIAL
+        node->rects[node->len] = BGEN_SYM(rect_calc)(node, node->len, udata);
+#endif
+        lnode = node;
+    } else {
+        lnode = hasl ? node->children[0] : 0;
+        BGEN_SYM(free)(node, BGEN_NODE_SIZE(node), udata);
+    }
+    BGEN_NODE *lchild, *rchild;
+    if (!BGEN_SYM(split_at)(child, index, &lchild, &rchild, spare, udata)) {
+        goto fail;
+    }
+    if (hasl) {
+        if (!BGEN_SYM(join3)(&lnode, litem, &lchild, spare, udata)) {
+            BGEN_SYM(clear)(&lchild, udata);
+            BGEN_SYM(clear)(&rchild, udata);
+            goto fail;
         }
-        if (smallest == i) {
-            break;
+        hasl = false;
+    } else {
+        lnode = lchild;
+    }
+    if (hasr) {
+        if (!BGEN_SYM(join3)(&rchild, ritem, &rnode, spare, udata)) {
+            BGEN_SYM(clear)(&rchild, udata);
+            goto fail;
         }
-        BGEN_SYM(pswap)(queue, smallest, i);
-        i = smallest;
     }
-    return item;
+    *left = lnode;
+    *right = rchild;
+    return true;
+fail:
+    BGEN_SYM(clear)(&lnode, udata);
+    BGEN_SYM(clear)(&rnode, udata);
+    if (hasl) {
+        BGEN_SYM(item_free)(litem, udata);
+    }
+    if (hasr) {
+        BGEN_SYM(item_free)(ritem, udata);
+    }
+    return false;
 }
 
-static int BGEN_SYM(ppush_item)(BGEN_PQUEUE *queue, BGEN_ITEM item, 
-    BGEN_RTYPE dist, void *udata)
+#ifndef BGEN_COW
+// The most leaves and branches that split_at may take from the spare nodes
+// for a tree of the given height. Below the top, each level splits off one
+// branch and joins a pair of trees on each side. A join takes no more nodes
+// than the difference in height between the branch and the tree that comes
+// up from below, which afterwards is at most one level shorter than the
+// branch. So the joins on each side take no more than twice the height, and
+// only the first of them can reach down to split a leaf.
+static void BGEN_SYM(split_spares)(int height, size_t *nleaves,
+    size_t *nbranches)
 {
-    queue->index++;
-    BGEN_PITEM pitem = { .dist = dist, .index = UINT64_MAX };
-    pitem.u.item = item;
-    return BGEN_SYM(ppush0)(queue, pitem, udata);
+    *nleaves += 3;
+    *nbranches += (size_t)height*5;
 }
 
-static int BGEN_SYM(ppush_node)(BGEN_PQUEUE *queue, BGEN_NODE *node, 
-    BGEN_RTYPE dist, void *udata)
+// The most leaves and branches that join3 may take from the spare nodes for
+// two trees of the given heights.
+static void BGEN_SYM(join_spares)(int lheight, int rheight, size_t *nleaves,
+    size_t *nbranches)
 {
-    queue->index++;
-    BGEN_PITEM pitem = { .dist = dist, .index = queue->index };
-    pitem.u.node = node;
-    return BGEN_SYM(ppush0)(queue, pitem, udata);
+    *nleaves += 1;
+    *nbranches += (size_t)(lheight > rheight ? lheight : rheight) + 2;
 }
-
-#endif
-
-// stack node used by an iterator
-BGEN_SNODE {
-    BGEN_NODE *node; // the node
-    int index;       // index of current item in node, used by iter_item()
-};
-
-#define BGEN_SCAN       0
-#define BGEN_SCANDESC   1
-#define BGEN_INTERSECTS 2
-#define BGEN_NEARBY     3
-
-BGEN_ITER {
-    BGEN_NODE **root;         // root node
-    void *udata;              // user data
-    int kind;                 // kind of iterator
-    bool mut;                 // this is a mutable iterator
-    bool valid;               // iterator is valid
-    short status;             // last status code. Zero for no errors
-    union {
-#ifdef BGEN_SPATIAL
-        struct {
-            // nearby target and distance callback
-            void *ntarget; 
-            BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], 
-                BGEN_RTYPE max[BGEN_DIMS], void *target, void *udata);
-            BGEN_PQUEUE queue; // priority queue
-            BGEN_ITEM nitem; // current nearby item
-        } n;
-#endif
-        struct  {
-#ifdef BGEN_SPATIAL
-            BGEN_RECT itarget; // intersects target
 #endif
-            short nstack; // number of path nodes (depth)
-            BGEN_SNODE stack[BGEN_MAXHEIGHT]; // traversed path nodes
-        } s;
-    } u;
-};
 
-static void BGEN_SYM(iter_init)(BGEN_NODE **root, BGEN_ITER **iter, void *udata)
-{
-    *iter = BGEN_SYM(malloc)(sizeof(BGEN_ITER), udata);
-    if (*iter) {
-        (*iter)->root = root;
-        (*iter)->udata = udata;
-        (*iter)->mut = false;
-        (*iter)->valid = false;
-        (*iter)->kind = 0;
+// Copy the items of the tree to items, in order, and return their number.
+static size_t BGEN_SYM(node_gather)(BGEN_NODE *node, BGEN_ITEM *items) {
+    size_t n = 0;
+    for (int i = 0; i <= node->len; i++) {
+        if (!node->isleaf) {
+            n += BGEN_SYM(node_gather)(node->children[i], items+n);
+        }
+        if (i < node->len) {
+            items[n++] = node->items[i];
+        }
     }
+    return n;
 }
+#endif
 
-static void BGEN_SYM(iter_init_mut)(BGEN_NODE **root, BGEN_ITER **iter, 
-    void *udata)
+// Insert an array of items at index, all at once. The items are built into a
+// new subtree that is joined to the two halves of the tree.
+// On NOMEM or OVERFLOW the tree is left unchanged and the items are still
+// owned by the caller.
+static int BGEN_SYM(insert_run_at)(BGEN_NODE **root, size_t index,
+    BGEN_ITEM *items, size_t n, void *udata)
 {
-    BGEN_SYM(iter_init)(root, iter, udata);
-    if (*iter) {
-        (*iter)->mut = 1;
+#ifndef BGEN_COUNTED
+    (void)root, (void)index, (void)items, (void)n, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    size_t count = BGEN_SYM(count)(root, udata);
+    if (index > count) {
+        return BGEN_NOTFOUND;
     }
-}
-
-static void BGEN_SYM(iter_reset)(BGEN_ITER *iter, int kind) {
-    iter->valid = true;
-    iter->status = 0;
-#ifdef BGEN_SPATIAL
-    if (iter->kind == BGEN_NEARBY && kind != BGEN_NEARBY) {
-        // switching from NEARBY to SCAN
-        BGEN_SYM(pclear)(&iter->u.n.queue, iter->udata);
-    } else if (iter->kind != BGEN_NEARBY && kind == BGEN_NEARBY) {
-        // switching from SCAN to NEARBY
-        BGEN_SYM(pqueue_init)(&iter->u.n.queue);
+    if (n == 0) {
+        return BGEN_INSERTED;
+    }
+#ifdef BGEN_COUNTCHECK
+    if (n > (size_t)(BGEN_COUNTTYPE)-1 - 1 - count) {
+        return BGEN_OVERFLOW;
     }
 #endif
-    iter->u.s.nstack = 0;
-    iter->kind = kind;
-}
-
-static void BGEN_SYM(iter_release)(BGEN_ITER *iter) {
-    if (iter) {
-#ifdef BGEN_SPATIAL
-        if (iter->kind == BGEN_NEARBY) {
-            BGEN_SYM(pclear)(&iter->u.n.queue, iter->udata);
+#ifndef BGEN_NOORDER
+    // The items must be in order and fit between their new neighbors.
+    for (size_t i = 1; i < n; i++) {
+        if (!BGEN_SYM(inorder)(items[i-1], items[i], udata)) {
+            return BGEN_OUTOFORDER;
         }
-#endif
-        BGEN_SYM(free)(iter, sizeof(BGEN_ITER), iter->udata);
     }
-}
-
-static bool BGEN_SYM(iter_valid)(BGEN_ITER *iter) {
-    return iter && iter->valid;
-}
-
-static int BGEN_SYM(iter_status)(BGEN_ITER *iter) {
-    return !iter ? BGEN_NOMEM : iter->status;
-}
-
-#ifdef BGEN_SPATIAL
-static bool BGEN_SYM(iter_skip_item)(BGEN_ITER *iter, BGEN_SNODE *snode) {
-    if (iter->kind == BGEN_INTERSECTS) {
-        BGEN_RECT rect = BGEN_SYM(item_rect)(
-            snode->node->items[snode->index], iter->udata);
-        if (!BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
-            return true;
+    BGEN_ITEM item;
+    if (index > 0) {
+        BGEN_SYM(get_at)(root, index-1, &item, udata);
+        if (!BGEN_SYM(inorder)(item, items[0], udata)) {
+            return BGEN_OUTOFORDER;
         }
     }
-    return false;
-}
-static bool BGEN_SYM(iter_skip_node)(BGEN_ITER *iter, BGEN_SNODE *snode) {
-    if (iter->kind == BGEN_INTERSECTS) {
-        BGEN_RECT rect = snode->node->rects[snode->index];
-        if (!BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
-            return true;
+    if (index < count) {
+        BGEN_SYM(get_at)(root, index, &item, udata);
+        if (!BGEN_SYM(inorder)(items[n-1], item, udata)) {
+            return BGEN_OUTOFORDER;
         }
     }
-    return false;
-}
 #endif
-
-BGEN_NOINLINE
-static void BGEN_SYM(iter_next_asc)(BGEN_ITER *iter) {
-    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
-    while (1) {
-        snode = &iter->u.s.stack[iter->u.s.nstack-1];
-        snode->index++;
-        if (snode->node->isleaf && snode->index < snode->node->len) {
-        next_item:
+#ifndef BGEN_COW
+    if (n <= BGEN_MAXITEMS) {
+        // A run that fits in a node is cheaper to insert one item at a time
+        // than to set aside the spare nodes for, and can be taken back.
+        for (size_t i = 0; i < n; i++) {
+            int ret = BGEN_SYM(insert0)(root, BGEN_INSAT, index+i, items[i],
+                0, udata);
+            if (ret != BGEN_INSERTED) {
+                while (i > 0) {
+                    BGEN_SYM(delete_at)(root, index, 0, udata);
+                    i--;
+                }
+                return ret;
+            }
+        }
+        return BGEN_INSERTED;
+    }
+#endif
+    // The first and last items are used to join the run to each side.
+    BGEN_NODE *run = 0;
+    if (n > 2) {
+        run = BGEN_SYM(build)(items+1, n-2, udata);
+        if (!run) {
+            return BGEN_NOMEM;
+        }
+    }
+    BGEN_NODE *node = 0;
+    BGEN_NODE *left = 0;
+    BGEN_NODE *right = 0;
+    BGEN_SPARE *spare = 0;
+#ifdef BGEN_COW
+    // Work on a clone. The original is only released once all is done.
+    BGEN_SYM(clone)(root, &node, udata);
+#else
+    // Without BGEN_COW the split and the joins change the nodes of the tree
+    // in place, so every node that they may need is allocated before the
+    // tree is touched.
+    BGEN_SPARE spare0;
+    int height = *root ? (*root)->height : 0;
+    int rheight = run ? run->height : 0;
+    int maxheight = height > rheight ? height : rheight;
+    size_t nleaves = 0;
+    size_t nbranches = 0;
+    BGEN_SYM(split_spares)(height, &nleaves, &nbranches);
+    BGEN_SYM(join_spares)(height, rheight, &nleaves, &nbranches);
+    BGEN_SYM(join_spares)(maxheight+1, height, &nleaves, &nbranches);
+    if (!BGEN_SYM(spare_alloc)(&spare0, nleaves, nbranches, udata)) {
+        if (run) {
+            BGEN_SYM(node_free_except)(run, 0, n, udata);
+        }
+        return BGEN_NOMEM;
+    }
+    spare = &spare0;
+    node = *root;
+#endif
+    if (node && !BGEN_SYM(split_at)(node, index, &left, &right, spare, udata)){
+        goto fail;
+    }
+    if (n > 1) {
+        if (!BGEN_SYM(join3)(&left, items[0], &run, spare, udata)) {
+            goto fail;
+        }
+    }
+    if (!BGEN_SYM(join3)(&left, items[n-1], &right, spare, udata)) {
+        if (n > 1) {
+            BGEN_SYM(node_free_except)(left, index, index+n-1, udata);
+            left = 0;
+        }
+        goto fail;
+    }
+#ifdef BGEN_COW
+    BGEN_SYM(clear)(root, udata);
+#else
+    BGEN_SYM(spare_free)(spare, udata);
+#endif
+    *root = left;
+    return BGEN_INSERTED;
+fail:
+    if (run) {
+        BGEN_SYM(node_free_except)(run, 0, n, udata);
+    }
+    BGEN_SYM(clear)(&left, udata);
+    BGEN_SYM(clear)(&right, udata);
+#ifndef BGEN_COW
+    // Not reached, as the spare nodes are enough for all.
+    BGEN_SYM(spare_free)(spare, udata);
+    *root = 0;
+#endif
+    return BGEN_NOMEM;
+#endif
+}
+
+// Delete n items starting at index, all at once. The run is split from the
+// tree and the two remaining sides are joined.
+// The deleted items are copied to items_out, when provided, and otherwise
+// they are freed using BGEN_ITEMFREE.
+static int BGEN_SYM(delete_run_at)(BGEN_NODE **root, size_t index, size_t n,
+    BGEN_ITEM *items_out, void *udata)
+{
+#ifndef BGEN_COUNTED
+    (void)root, (void)index, (void)n, (void)items_out, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    size_t count = BGEN_SYM(count)(root, udata);
+    if (index > count || n > count-index) {
+        return BGEN_NOTFOUND;
+    }
+    if (n == 0) {
+        return BGEN_DELETED;
+    }
+#ifndef BGEN_COW
+    if (n <= BGEN_MAXITEMS) {
+        // A run that fits in a node is cheaper to delete one item at a time,
+        // which never needs memory without BGEN_COW.
+        for (size_t i = 0; i < n; i++) {
+            BGEN_ITEM item;
+            BGEN_SYM(delete_at)(root, index, &item, udata);
+            if (items_out) {
+                items_out[i] = item;
+            } else {
+                BGEN_SYM(item_free)(item, udata);
+            }
+        }
+        return BGEN_DELETED;
+    }
+#endif
+    BGEN_NODE *node = 0;
+    BGEN_NODE *left = 0;
+    BGEN_NODE *mid = 0;
+    BGEN_NODE *right = 0;
+    BGEN_SPARE *spare = 0;
+#ifdef BGEN_COW
+    // Work on a clone. The original is only released once all is done.
+    BGEN_SYM(clone)(root, &node, udata);
+#else
+    // Without BGEN_COW the splits and the join change the nodes of the tree
+    // in place, so every node that they may need is allocated before the
+    // tree is touched.
+    BGEN_SPARE spare0;
+    int height = (*root)->height;
+    size_t nleaves = 0;
+    size_t nbranches = 0;
+    BGEN_SYM(split_spares)(height, &nleaves, &nbranches);
+    BGEN_SYM(split_spares)(height, &nleaves, &nbranches);
+    BGEN_SYM(join_spares)(height, height, &nleaves, &nbranches);
+    if (!BGEN_SYM(spare_alloc)(&spare0, nleaves, nbranches, udata)) {
+        return BGEN_NOMEM;
+    }
+    spare = &spare0;
+    node = *root;
+#endif
+    if (!BGEN_SYM(split_at)(node, index, &left, &node, spare, udata)) {
+        goto fail;
+    }
+    if (!BGEN_SYM(split_at)(node, n, &mid, &right, spare, udata)) {
+        goto fail;
+    }
+    if (left && right) {
+        BGEN_ITEM item;
+        if (BGEN_SYM(pop_back)(&left, &item, udata) != BGEN_DELETED) {
+            goto fail;
+        }
+        if (!BGEN_SYM(join3)(&left, item, &right, spare, udata)) {
+            BGEN_SYM(item_free)(item, udata);
+            goto fail;
+        }
+    } else if (!left) {
+        left = right;
+        right = 0;
+    }
+    if (items_out) {
+        BGEN_SYM(node_gather)(mid, items_out);
+#ifdef BGEN_COW
+        // The nodes of the run may still be shared with the original, so the
+        // caller gets copies.
+        for (size_t i = 0; i < n; i++) {
+            if (!BGEN_SYM(item_copy)(items_out[i], &items_out[i], udata)) {
+                while (i > 0) {
+                    i--;
+                    BGEN_SYM(item_free)(items_out[i], udata);
+                }
+                goto fail;
+            }
+        }
+        BGEN_SYM(clear)(&mid, udata);
+#else
+        BGEN_SYM(node_free_except)(mid, 0, n, udata);
+#endif
+    } else {
+        BGEN_SYM(clear)(&mid, udata);
+    }
+#ifdef BGEN_COW
+    BGEN_SYM(clear)(root, udata);
+#else
+    BGEN_SYM(spare_free)(spare, udata);
+#endif
+    *root = left;
+    return BGEN_DELETED;
+fail:
+    BGEN_SYM(clear)(&left, udata);
+    BGEN_SYM(clear)(&mid, udata);
+    BGEN_SYM(clear)(&right, udata);
+#ifndef BGEN_COW
+    // Not reached, as the spare nodes are enough for all.
+    BGEN_SYM(spare_free)(spare, udata);
+    *root = 0;
+#endif
+    return BGEN_NOMEM;
+#endif
+}
+
+#if defined(BGEN_MULTI)
+// Returns the number of items in the node that are less than or equal to key.
+static size_t BGEN_SYM(node_rank_upper)(BGEN_NODE *node, BGEN_ITEM key,
+    void *udata)
+{
+    size_t rank = 0;
+    while (1) {
+        int i = BGEN_SYM(search_upper)(node, key, udata);
+        if (node->isleaf) {
+            return rank + (size_t)i;
+        }
+        rank += BGEN_SYM(count_before)(node, i);
+        node = node->children[i];
+    }
+}
+#endif
+
+// Returns the index of the first item that is equal to key and the index 
+// that follows the last item that is equal to key.
+// Returns FOUND or NOTFOUND
+static int BGEN_SYM(equal_range)(BGEN_NODE **root, BGEN_ITEM key,
+    size_t *start_out, size_t *end_out, void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)key, (void)start_out, (void)end_out, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    int found = 0;
+    size_t start = 0;
+    size_t end = 0;
+    if (*root) {
+        start = BGEN_SYM(node_rank)(*root, key, &found, 0, udata);
+        end = start;
+        if (found) {
+#ifdef BGEN_MULTI
+            end = BGEN_SYM(node_rank_upper)(*root, key, udata);
+#else
+            end++;
+#endif
+        }
+    }
+    if (start_out) {
+        *start_out = start;
+    }
+    if (end_out) {
+        *end_out = end;
+    }
+    return found ? BGEN_FOUND : BGEN_NOTFOUND;
+#endif
+}
+
+#if !defined(BGEN_COUNTED) && !defined(BGEN_NOORDER)
+// Returns the number of items in the node that are equal to key.
+static size_t BGEN_SYM(node_count_equal)(BGEN_NODE *node, BGEN_ITEM key,
+    void *udata, int depth)
+{
+    int found;
+    int i = BGEN_SYM(search)(node, key, udata, &found, depth);
+    size_t count = 0;
+    while (1) {
+        if (!node->isleaf) {
+            count += BGEN_SYM(node_count_equal)(node->children[i], key, udata,
+                depth+1);
+        }
+        if (i == node->len || BGEN_SYM(compare)(key, node->items[i], udata)) {
+            return count;
+        }
+        count++;
+        i++;
+    }
+}
+#endif
+
+// Returns the number of items that are equal to key. 
+// This operation is O(log n) for counted B-trees, otherwise the equal items
+// are visited one by one.
+static size_t BGEN_SYM(count_equal)(BGEN_NODE **root, BGEN_ITEM key,
+    void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)key, (void)udata;
+    return 0;
+#elif defined(BGEN_COUNTED)
+    size_t start, end;
+    BGEN_SYM(equal_range)(root, key, &start, &end, udata);
+    return end - start;
+#else
+    return *root ? BGEN_SYM(node_count_equal)(*root, key, udata, 0) : 0;
+#endif
+}
+
+// Deletes the first item that is equal to key.
+// Returns DELETED, NOTFOUND, or NOMEM
+static int BGEN_SYM(delete_one)(BGEN_NODE **root, BGEN_ITEM key, 
+    BGEN_ITEM *olditem, void *udata)
+{
+    return BGEN_SYM(delete)(root, key, olditem, udata);
+}
+
+// Deletes all items that are equal to key. The deleted items are freed.
+// Returns DELETED, NOTFOUND, or NOMEM
+static int BGEN_SYM(delete_all)(BGEN_NODE **root, BGEN_ITEM key, void *udata) {
+#ifdef BGEN_NOORDER
+    (void)root, (void)key, (void)udata;
+    return BGEN_UNSUPPORTED;
+#elif defined(BGEN_COUNTED)
+    // Delete the entire run at once.
+    size_t start, end;
+    if (BGEN_SYM(equal_range)(root, key, &start, &end, udata) != BGEN_FOUND) {
+        return BGEN_NOTFOUND;
+    }
+    return BGEN_SYM(delete_run_at)(root, start, end-start, 0, udata);
+#else
+    // Delete one at a time. On NOMEM the items that were already deleted
+    // are not restored.
+    int ret = BGEN_NOTFOUND;
+    while (1) {
+        BGEN_ITEM item;
+        int ret2 = BGEN_SYM(delete)(root, key, &item, udata);
+        if (ret2 != BGEN_DELETED) {
+            return ret2 == BGEN_NOTFOUND ? ret : ret2;
+        }
+        BGEN_SYM(item_free)(item, udata);
+        ret = BGEN_DELETED;
+    }
+#endif
+}
+
+#ifdef BGEN_SPATIAL
+
+// The nearby scanner is a kNN operation that uses a heap-based priority queue.
+
+#define BGEN_PQUEUE struct BGEN_SYM(pqueue)
+#define BGEN_PITEM struct BGEN_SYM(pitem)
+#define BGEN_DSIZE 8
+
+BGEN_PITEM {
+    BGEN_RTYPE dist;
+    uint64_t index;    // 1+ = node, item = UINT64_MAX
+    union {
+        BGEN_ITEM item;
+        BGEN_NODE *node;
+    } u;
+};
+
+BGEN_PQUEUE {
+    BGEN_PITEM *items;
+    size_t len;
+    size_t cap;
+    uint64_t index; // index counter, this increments with every added node.
+};
+
+static void BGEN_SYM(pqueue_init)(BGEN_PQUEUE *queue) {
+    queue->items = 0;
+    queue->len = 0;
+    queue->cap = 0;
+    queue->index = 0;
+}
+
+static int BGEN_SYM(pcompare)(BGEN_PQUEUE *queue, size_t i, size_t j, 
+    void *udata)
+{
+    int cmp;
+    // Compare distances
+    cmp = queue->items[i].dist < queue->items[j].dist ? -1 : 
+          queue->items[i].dist > queue->items[j].dist;
+    if (cmp != 0) {
+        return cmp;
+    }
+    // Distances are equal, compare the indexes
+    cmp = queue->items[i].index < queue->items[j].index ? -1 : 
+          queue->items[i].index > queue->items[j].index;
+    if (cmp != 0) {
+        return cmp;
+    }
+    // Indexes are equal, must be an item. compare the items
+    BGEN_ASSERT(queue->items[i].index == UINT64_MAX);
+    BGEN_ASSERT(queue->items[j].index == UINT64_MAX);
+    return BGEN_SYM(compare)(queue->items[i].u.item, queue->items[j].u.item,
+        udata);
+}
+
+static void BGEN_SYM(pclear)(BGEN_PQUEUE *queue, void *udata) {
+    if (queue->items) {
+        BGEN_SYM(free)(queue->items, sizeof(BGEN_PITEM)*queue->cap, udata);
+    }
+    BGEN_SYM(pqueue_init)(queue);
+}
+
+static void BGEN_SYM(pswap)(BGEN_PQUEUE *queue, size_t i, size_t j) {
+    BGEN_PITEM tmp  = queue->items[i];
+    queue->items[i] = queue->items[j];
+    queue->items[j] = tmp;
+}
+
+
+static BGEN_PITEM BGEN_SYM(pswap_remove)(BGEN_PQUEUE *queue, size_t i) {
+    BGEN_PITEM item = queue->items[i];
+    queue->items[i] = queue->items[queue->len-1];
+    queue->len--;
+    return item;
+}
+
+
+// Grow the queue storage to hold at least cap items.
+static int BGEN_SYM(preserve)(BGEN_PQUEUE *queue, size_t cap, void *udata) {
+    if (cap <= queue->cap) {
+        return 0;
+    }
+    BGEN_PITEM *items2 = BGEN_SYM(malloc)(sizeof(BGEN_PITEM)*cap, udata);
+    if (!items2) {
+        return BGEN_NOMEM;
+    }
+    for (size_t i = 0; i < queue->len; i++) {
+        items2[i] = queue->items[i];
+    }
+    if (queue->items) {
+        BGEN_SYM(free)(queue->items, sizeof(BGEN_PITEM)*queue->cap, udata);
+    }
+    queue->items = items2;
+    queue->cap = cap;
+    return 0;
+}
+
+static int BGEN_SYM(ppush0)(BGEN_PQUEUE *queue, BGEN_PITEM item, void *udata) {
+    if (queue->len == queue->cap) {
+        size_t cap = queue->cap == 0 ? 8 : queue->cap*2;
+        if (BGEN_SYM(preserve)(queue, cap, udata)) {
+            return BGEN_NOMEM;
+        }
+    }
+    queue->items[queue->len++] = item;
+    size_t i = queue->len - 1;
+    while (i != 0) {
+        size_t parent = (i - 1) / 2;
+        if (!(BGEN_SYM(pcompare)(queue, parent, i, udata) > 0)) {
+            break;
+        }
+        BGEN_SYM(pswap)(queue, parent, i);
+        i = parent;
+    }
+    return 0;
+}
+
+static BGEN_PITEM BGEN_SYM(ppop)(BGEN_PQUEUE *queue, void *udata) {
+    BGEN_PITEM item = BGEN_SYM(pswap_remove)(queue, 0);
+    size_t i = 0;
+    while (1) {
+        size_t smallest = i;
+        size_t left = i * 2 + 1;
+        size_t right = i * 2 + 2;
+        if (left < queue->len && BGEN_SYM(pcompare)(queue, left, smallest, 
+            udata) <= 0)
+        {
+            smallest = left;
+        }
+        if (right < queue->len && BGEN_SYM(pcompare)(queue, right, smallest, 
+            udata) <= 0)
+        {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        BGEN_SYM(pswap)(queue, smallest, i);
+        i = smallest;
+    }
+    return item;
+}
+
+static int BGEN_SYM(ppush_item)(BGEN_PQUEUE *queue, BGEN_ITEM item, 
+    BGEN_RTYPE dist, void *udata)
+{
+    queue->index++;
+    BGEN_PITEM pitem = { .dist = dist, .index = UINT64_MAX };
+    pitem.u.item = item;
+    return BGEN_SYM(ppush0)(queue, pitem, udata);
+}
+
+static int BGEN_SYM(ppush_node)(BGEN_PQUEUE *queue, BGEN_NODE *node, 
+    BGEN_RTYPE dist, void *udata)
+{
+    queue->index++;
+    BGEN_PITEM pitem = { .dist = dist, .index = queue->index };
+    pitem.u.node = node;
+    return BGEN_SYM(ppush0)(queue, pitem, udata);
+}
+
+#endif
+
+// stack node used by an iterator
+BGEN_SNODE {
+    BGEN_NODE *node; // the node
+    int index;       // index of current item in node, used by iter_item()
+};
+
+#define BGEN_SCAN       0
+#define BGEN_SCANDESC   1
+#define BGEN_INTERSECTS 2
+#define BGEN_NEARBY     3
+
+BGEN_ITER {
+    BGEN_NODE **root;         // root node
+    void *udata;              // user data
+    int kind;                 // kind of iterator
+    bool mut;                 // this is a mutable iterator
+    bool valid;               // iterator is valid
+    bool inplace;             // caller owns the iterator memory
+    bool stable;              // stable cursor, survives changes to the tree
+    bool haskey;              // key holds the current item of stable cursor
+    short status;             // last status code. Zero for no errors
+    BGEN_ITEM key;            // current item of a stable cursor
+    union {
+#ifdef BGEN_SPATIAL
+        struct {
+            // nearby target and distance callback
+            void *ntarget; 
+            BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], 
+                BGEN_RTYPE max[BGEN_DIMS], void *target, void *udata);
+            BGEN_ITEM nitem; // current nearby item
+            BGEN_RTYPE maxdist; // maximum distance, when bounded
+            bool bounded; // skip everything farther than maxdist
+        } n;
+#endif
+        struct  {
+#ifdef BGEN_SPATIAL
+            BGEN_RECT itarget; // intersects target
+#endif
+            short nstack; // number of path nodes (depth)
+            BGEN_SNODE stack[BGEN_MAXHEIGHT]; // traversed path nodes
+        } s;
+    } u;
+#ifdef BGEN_SPATIAL
+    // The nearby priority queue lives outside of the union so that its
+    // storage is retained across nearby calls and iterator kinds. It's only
+    // freed by iter_release.
+    BGEN_PQUEUE queue;
+#endif
+};
+
+static void BGEN_SYM(iter_init0)(BGEN_NODE **root, BGEN_ITER *iter, 
+    void *udata, bool inplace)
+{
+    iter->root = root;
+    iter->udata = udata;
+    iter->mut = false;
+    iter->valid = false;
+    iter->inplace = inplace;
+    iter->stable = false;
+    iter->haskey = false;
+    iter->kind = 0;
+#ifdef BGEN_SPATIAL
+    BGEN_SYM(pqueue_init)(&iter->queue);
+#endif
+}
+
+static void BGEN_SYM(iter_init)(BGEN_NODE **root, BGEN_ITER **iter, void *udata)
+{
+    *iter = BGEN_SYM(malloc)(sizeof(BGEN_ITER), udata);
+    if (*iter) {
+        BGEN_SYM(iter_init0)(root, *iter, udata, false);
+    }
+}
+
+// Returns the number of bytes needed for an iterator.
+static size_t BGEN_SYM(iter_size)(void) {
+    return sizeof(BGEN_ITER);
+}
+
+// Initialize an iterator using caller owned memory, such as the stack, that
+// is at least iter_size bytes and suitably aligned for any type.
+// No memory is allocated, and iter_release will not free the memory.
+static BGEN_ITER *BGEN_SYM(iter_init_inplace)(BGEN_NODE **root, void *mem,
+    void *udata)
+{
+    BGEN_ITER *iter = (BGEN_ITER*)mem;
+    if (iter) {
+        BGEN_SYM(iter_init0)(root, iter, udata, true);
+    }
+    return iter;
+}
+
+static void BGEN_SYM(iter_init_mut)(BGEN_NODE **root, BGEN_ITER **iter, 
+    void *udata)
+{
+    BGEN_SYM(iter_init)(root, iter, udata);
+    if (*iter) {
+        (*iter)->mut = 1;
+    }
+}
+
+static BGEN_ITER *BGEN_SYM(iter_init_inplace_mut)(BGEN_NODE **root, 
+    void *mem, void *udata)
+{
+    BGEN_ITER *iter = BGEN_SYM(iter_init_inplace)(root, mem, udata);
+    if (iter) {
+        iter->mut = 1;
+    }
+    return iter;
+}
+
+static void BGEN_SYM(iter_reset)(BGEN_ITER *iter, int kind) {
+    iter->valid = true;
+    iter->status = 0;
+#ifdef BGEN_SPATIAL
+    // Empty the queue but keep its storage for the next nearby call.
+    iter->queue.len = 0;
+    iter->queue.index = 0;
+#endif
+    iter->u.s.nstack = 0;
+    iter->kind = kind;
+    iter->haskey = false;
+}
+
+static void BGEN_SYM(iter_release)(BGEN_ITER *iter) {
+    if (iter) {
+#ifdef BGEN_SPATIAL
+        BGEN_SYM(pclear)(&iter->queue, iter->udata);
+#endif
+        if (!iter->inplace) {
+            BGEN_SYM(free)(iter, sizeof(BGEN_ITER), iter->udata);
+        }
+    }
+}
+
+// Release an iterator that lives on the stack of an internal operation,
+// which is never freed.
+static void BGEN_SYM(iter_release_local)(BGEN_ITER *iter) {
+#ifdef BGEN_SPATIAL
+    BGEN_SYM(pclear)(&iter->queue, iter->udata);
+#else
+    (void)iter;
+#endif
+}
+
+// Pre-size the iterator's nearby priority queue to hold at least cap
+// entries. The storage is retained until iter_release.
+// Returns BGEN_NOMEM when out of memory.
+static int BGEN_SYM(iter_reserve)(BGEN_ITER *iter, size_t cap) {
+    if (!iter) {
+        return BGEN_NOMEM;
+    }
+#ifdef BGEN_SPATIAL
+    return BGEN_SYM(preserve)(&iter->queue, cap, iter->udata);
+#else
+    (void)cap;
+    return 0;
+#endif
+}
+
+static bool BGEN_SYM(iter_valid)(BGEN_ITER *iter) {
+    return iter && iter->valid;
+}
+
+static int BGEN_SYM(iter_status)(BGEN_ITER *iter) {
+    return !iter ? BGEN_NOMEM : iter->status;
+}
+
+#ifdef BGEN_SPATIAL
+static bool BGEN_SYM(iter_skip_item)(BGEN_ITER *iter, BGEN_SNODE *snode) {
+    if (iter->kind == BGEN_INTERSECTS) {
+        BGEN_RECT rect = BGEN_SYM(item_rect)(
+            snode->node->items[snode->index], iter->udata);
+        if (!BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
+            return true;
+        }
+    }
+    return false;
+}
+static bool BGEN_SYM(iter_skip_node)(BGEN_ITER *iter, BGEN_SNODE *snode) {
+    if (iter->kind == BGEN_INTERSECTS) {
+        BGEN_RECT rect = snode->node->rects[snode->index];
+        if (!BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+BGEN_NOINLINE
+static void BGEN_SYM(iter_next_asc)(BGEN_ITER *iter) {
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    while (1) {
+        snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        snode->index++;
+        if (snode->node->isleaf && snode->index < snode->node->len) {
+        next_item:
+#ifdef BGEN_SPATIAL
+            if (BGEN_SYM(iter_skip_item)(iter, snode)) {
+                continue;
+            }
+#endif
+            // Iterator now points to the next item
+            return;
+        }
+        if (snode->node->isleaf || snode->index == snode->node->len+1) {
+            // pop the stack
+            while (iter->u.s.nstack > 1) {
+                iter->u.s.nstack--;
+                snode = &iter->u.s.stack[iter->u.s.nstack-1];
+                if (snode->index < snode->node->len) {
+                    goto next_item;
+                }
+            }
+            // end of iterator
+            iter->valid = false;
+            return;
+        }
+#ifdef BGEN_SPATIAL
+        if (BGEN_SYM(iter_skip_node)(iter, snode)) {
+            continue;
+        }
+#endif
+        if (iter->mut && !BGEN_SYM(cow)(&snode->node->children[snode->index], 
+            iter->udata))
+        {
+            iter->status = BGEN_NOMEM;
+            iter->valid = false;
+            return;
+        }
+        if (snode->node->height == 2 && snode->index < snode->node->len) {
+            BGEN_SYM(prefetch_leaf)(snode->node->children[snode->index+1]);
+        }
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ 
+            snode->node->children[snode->index], -1 };
+    }
+}
+
+// Move iterator cursor to the previous item.
+BGEN_NOINLINE
+static void BGEN_SYM(iter_next_desc)(BGEN_ITER *iter) {
+    BGEN_SNODE *snode;
+    while (1) {
+        snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        snode->index--;
+        if (snode->node->isleaf && snode->index > -1) {
+            // Iterator now points to the next item
+            return;
+        }
+        if (snode->node->isleaf) {
+            // pop stack
+            while (iter->u.s.nstack > 1) {
+                iter->u.s.nstack--;
+                snode = &iter->u.s.stack[iter->u.s.nstack-1];
+                snode->index--;
+                if (snode->index > -1) {
+                    // Iterator now points to the next item
+                    return;
+                }
+            }
+            // end of iterator
+            iter->valid = false;
+            return;
+        }
+        snode->index++;
+        if (iter->mut && !BGEN_SYM(cow)(&snode->node->children[snode->index], 
+            iter->udata))
+        {
+            iter->status = BGEN_NOMEM;
+            iter->valid = false;
+            return;
+        }
+        if (snode->node->height == 2 && snode->index > 0) {
+            BGEN_SYM(prefetch_leaf)(snode->node->children[snode->index-1]);
+        }
+        BGEN_NODE *node = snode->node->children[snode->index];
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, node->len };
+        snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    }
+}
+
 #ifdef BGEN_SPATIAL
-            if (BGEN_SYM(iter_skip_item)(iter, snode)) {
+
+// Add the items and children of node to the queue. When maxdist is provided
+// then anything farther than maxdist is never enqueued.
+static int BGEN_SYM(nearby_addnodecontents)(BGEN_PQUEUE *queue, 
+    BGEN_NODE *node, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE *maxdist, void *udata, bool mut)
+{
+    BGEN_ASSERT(!mut || !BGEN_SYM(shared)(node));
+    for (int i = 0; i < node->len; i++) {
+        BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], udata);
+        BGEN_RTYPE d = dist(rect.min, rect.max, target, udata);
+        if (maxdist && d > *maxdist) {
+            continue;
+        }
+        int status = BGEN_SYM(ppush_item)(queue, node->items[i], d, udata);
+        if (status) {
+            return status;
+        }
+    }
+    if (!node->isleaf) {
+        for (int i = 0; i <= node->len; i++) {
+            BGEN_RTYPE d = dist(node->rects[i].min, node->rects[i].max, target,
+                udata);
+            if (maxdist && d > *maxdist) {
                 continue;
             }
-#endif
-            // Iterator now points to the next item
+            if (mut && !BGEN_SYM(cow)(&node->children[i], udata)) {
+                return BGEN_NOMEM;
+            }
+            int status = BGEN_SYM(ppush_node)(queue, node->children[i], d,
+                udata);
+            if (status) {
+                return status;
+            }
+        }
+    }
+    return 0;
+}
+
+BGEN_NOINLINE
+static void BGEN_SYM(iter_next_nearby)(BGEN_ITER *iter) {
+    // Begin popping queue items.
+    while (iter->queue.len > 0) {
+        BGEN_PITEM pitem = BGEN_SYM(ppop)(&iter->queue, iter->udata);
+        if (pitem.index == UINT64_MAX) {
+            // Queue item is a b-tree item. Return to user.
+            iter->u.n.nitem = pitem.u.item;
+            return;
+        } else {
+            // Queue item is a node. Add the contents of node and continue 
+            // popping queue items.
+            int status = BGEN_SYM(nearby_addnodecontents)(&iter->queue, 
+                pitem.u.node, iter->u.n.ntarget, iter->u.n.dist, 
+                iter->u.n.bounded ? &iter->u.n.maxdist : 0, iter->udata,
+                iter->mut);
+            if (status) {
+                iter->valid = false;
+                iter->status = status;
+                return;
+            }
+        }
+    }
+    iter->valid = false;
+}
+
+#endif
+
+// Move iterator cursor to the next item, without the stable cursor checks.
+// REQUIRED: iter_valid()
+BGEN_INLINE
+static void BGEN_SYM(iter_next0)(BGEN_ITER *iter) {
+    BGEN_ASSERT(BGEN_SYM(iter_valid)(iter));
+#ifdef BGEN_SPATIAL
+    if (iter->kind == BGEN_INTERSECTS) {
+        BGEN_SYM(iter_next_asc)(iter);
+    } else if (iter->kind == BGEN_NEARBY) {
+        BGEN_SYM(iter_next_nearby)(iter);
+    } else
+#endif
+    if (iter->kind == BGEN_SCAN) {
+        // Fastpath for forward scanning iterators iter_seek and iter_scan,
+        // where the next item is in a leaf. Fallback to the function call.
+        BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        if (snode->node->isleaf && snode->index+1 < snode->node->len) {
+            snode->index++;
+        } else {
+            BGEN_SYM(iter_next_asc)(iter);
+        }
+    } else if (iter->kind == BGEN_SCANDESC) {
+        BGEN_SYM(iter_next_desc)(iter);
+    }
+}
+
+// Keep a copy of the current item for a stable cursor, which is used to find
+// its place again after the tree changes.
+static void BGEN_SYM(iter_keep)(BGEN_ITER *iter) {
+    if (iter->stable && iter->valid && 
+        (iter->kind == BGEN_SCAN || iter->kind == BGEN_SCANDESC))
+    {
+        BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        iter->key = snode->node->items[snode->index];
+        iter->haskey = true;
+    }
+}
+
+// Moves iterator to first item and resets the status
+static void BGEN_SYM(iter_scan)(BGEN_ITER *iter) {
+    if (!iter) {
+        return;
+    }
+    BGEN_SYM(iter_reset)(iter, BGEN_SCAN);
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    BGEN_NODE *node = *iter->root;
+    while (1) {
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
+        if (node->isleaf) {
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (iter->mut && !BGEN_SYM(cow)(&node->children[0], iter->udata)) {
+            iter->status = BGEN_NOMEM;
+            iter->valid = false;
+            return;
+        }
+        node = node->children[0];
+    }
+}
+
+// Moves iterator to last item and resets the status
+static void BGEN_SYM(iter_scan_desc)(BGEN_ITER *iter) {
+    if (!iter) {
+        return;
+    }
+    BGEN_SYM(iter_reset)(iter, BGEN_SCANDESC);
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    BGEN_NODE *node = *iter->root;
+    while (1) {
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, node->len };
+        if (node->isleaf) {
+            iter->u.s.stack[iter->u.s.nstack-1].index--;
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (iter->mut && !BGEN_SYM(cow)(&node->children[node->len],
+            iter->udata))
+        {
+            iter->status = BGEN_NOMEM;
+            iter->valid = false;
+            return;
+        }
+        node = node->children[node->len];
+    }
+}
+
+#ifdef BGEN_SPATIAL
+// Finds the first intersecting item and fills the stack along the way.
+static bool BGEN_SYM(iter_intersects_first)(BGEN_ITER *iter, BGEN_NODE *node) {
+    int depth = iter->u.s.nstack;
+    iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
+    if (node->isleaf) {
+        for (int i = 0; i < node->len; i++) {
+            BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], iter->udata);
+            if (BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
+                iter->u.s.stack[depth].index = i;
+                return true;
+            }
+        }
+    } else {
+        for (int i = 0; i <= node->len; i++) {
+            if (BGEN_SYM(rect_intersects)(iter->u.s.itarget, node->rects[i])) {
+                if (BGEN_SYM(iter_intersects_first)(iter, node->children[i])) {
+                    iter->u.s.stack[depth].index = i;
+                    return true;
+                }
+                if (i < node->len) {
+                    BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], 
+                        iter->udata);
+                    if (BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
+                        iter->u.s.stack[depth].index = i;
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    iter->u.s.nstack--;
+    return false;
+}
+#endif
+
+// Seek to the first item that is greater than or equal to key. When desc is
+// true, equal items are passed over as if they were less than key.
+static void BGEN_SYM(iter_seek0)(BGEN_ITER *iter, BGEN_ITEM key, bool desc) {
+    if (!iter) {
+        return;
+    }
+#ifdef BGEN_NOORDER
+    (void)iter, (void)key, (void)desc;
+    iter->valid = false;
+    iter->status = BGEN_UNSUPPORTED;
+#else
+    BGEN_SYM(iter_reset)(iter, BGEN_SCAN);
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    int depth = 0;
+    BGEN_NODE *node = *iter->root;
+    while (1) {
+        int found;
+        int i = desc ?
+            BGEN_SYM(search_desc)(node, key, iter->udata, &found, depth) :
+            BGEN_SYM(search)(node, key, iter->udata, &found, depth);
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, i };
+        if (found) {
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (node->isleaf) {
+            iter->u.s.stack[iter->u.s.nstack-1].index--;
+            BGEN_SYM(iter_next0)(iter);
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
+            iter->status = BGEN_NOMEM;
+            iter->valid = false;
+            return;
+        }
+        node = node->children[i];
+        depth++;
+    }
+#endif
+}
+
+static void BGEN_SYM(iter_seek)(BGEN_ITER *iter, BGEN_ITEM key) {
+    BGEN_SYM(iter_seek0)(iter, key, false);
+}
+
+static void BGEN_SYM(iter_seek_at)(BGEN_ITER *iter, size_t index) {
+    if (!iter) {
+        return;
+    }
+    BGEN_SYM(iter_reset)(iter, BGEN_SCAN);
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    BGEN_NODE *node = *iter->root;
+    while (1) {
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
+        if (node->isleaf) {
+            if (index >= (size_t)node->len) {
+                iter->u.s.stack[iter->u.s.nstack-1].index = node->len;
+            } else {
+                iter->u.s.stack[iter->u.s.nstack-1].index = index;
+            }
+            iter->u.s.stack[iter->u.s.nstack-1].index--;
+            BGEN_SYM(iter_next0)(iter);
+            BGEN_SYM(iter_keep)(iter);
             return;
         }
-        if (snode->node->isleaf || snode->index == snode->node->len+1) {
-            // pop the stack
-            while (iter->u.s.nstack > 1) {
-                iter->u.s.nstack--;
-                snode = &iter->u.s.stack[iter->u.s.nstack-1];
-                if (snode->index < snode->node->len) {
-                    goto next_item;
-                }
+        bool found;
+        int i = BGEN_SYM(node_find_index)(node, &index, &found);
+        iter->u.s.stack[iter->u.s.nstack-1].index = i;
+        if (found) {
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
+            iter->status = BGEN_NOMEM;
+            iter->valid = false;
+            return;
+        }
+        node = node->children[i];
+    }
+}
+
+static void BGEN_SYM(iter_seek_at_desc)(BGEN_ITER *iter, size_t index) {
+    if (!iter) {
+        return;
+    }
+    BGEN_SYM(iter_reset)(iter, BGEN_SCANDESC);
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    BGEN_NODE *node = *iter->root;
+    while (1) {
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
+        if (node->isleaf) {
+            if (index >= (size_t)node->len) {
+                iter->u.s.stack[iter->u.s.nstack-1].index = node->len-1;
+            } else {
+                iter->u.s.stack[iter->u.s.nstack-1].index = index;
             }
-            // end of iterator
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        bool found;
+        int i = BGEN_SYM(node_find_index)(node, &index, &found);
+        iter->u.s.stack[iter->u.s.nstack-1].index = i;
+        if (found) {
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
+            iter->status = BGEN_NOMEM;
             iter->valid = false;
             return;
         }
+        node = node->children[i];
+    }
+}
+
+static void BGEN_SYM(iter_item0)(BGEN_ITER *iter, BGEN_ITEM *item) {
 #ifdef BGEN_SPATIAL
-        if (BGEN_SYM(iter_skip_node)(iter, snode)) {
-            continue;
+    if (iter->kind == BGEN_NEARBY) {
+        *item = iter->u.n.nitem;
+        return;
+    }
+#endif
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    *item = snode->node->items[snode->index];
+}
+
+static void BGEN_SYM(iter_seek_desc)(BGEN_ITER *iter, BGEN_ITEM key) {
+    if (!iter) {
+        return;
+    }
+#ifdef BGEN_NOORDER
+    (void)iter, (void)key;
+    iter->valid = false;
+    iter->status = BGEN_UNSUPPORTED;
+#else
+    BGEN_SYM(iter_seek0)(iter, key, true);
+    if (!BGEN_SYM(iter_valid)(iter)) {
+        if (BGEN_SYM(iter_status)(iter) == 0) {
+            BGEN_SYM(iter_scan_desc)(iter);
+        }
+    } else {
+        BGEN_ITEM item;
+        BGEN_SYM(iter_item0)(iter, &item);
+        if (BGEN_SYM(compare)(item, key, iter->udata) > 0) {
+            BGEN_SYM(iter_next_desc)(iter);
+        }
+    }
+    iter->kind = BGEN_SCANDESC;
+    BGEN_SYM(iter_keep)(iter);
+#endif
+}
+
+// Find the place of a stable cursor again by following its path from the
+// root. When the kept item moved within its leaf, or was deleted from it, then
+// the leaf is searched. Returns 0 when the cursor is on the kept item, 1 when
+// the kept item is gone and the cursor is already on the next item, or -1 when
+// the path is no longer intact.
+static int BGEN_SYM(iter_resume)(BGEN_ITER *iter) {
+    BGEN_NODE *node = *iter->root;
+    int depth = iter->u.s.nstack-1;
+    for (int i = 0; i <= depth; i++) {
+        BGEN_SNODE *snode = &iter->u.s.stack[i];
+        if (snode->node != node) {
+            return -1;
+        }
+#ifdef BGEN_COW
+        if (iter->mut && BGEN_SYM(shared)(node)) {
+            return -1;
         }
 #endif
-        if (iter->mut && !BGEN_SYM(cow)(&snode->node->children[snode->index], 
-            iter->udata))
-        {
+        if (i == depth) {
+            break;
+        }
+        if (node->isleaf || snode->index > node->len) {
+            return -1;
+        }
+        node = node->children[snode->index];
+    }
+    BGEN_SNODE *snode = &iter->u.s.stack[depth];
+    if (snode->index < node->len && BGEN_SYM(compare)(node->items[snode->index],
+        iter->key, iter->udata) == 0)
+    {
+        return 0;
+    }
+    if (!node->isleaf) {
+        return -1;
+    }
+    int found;
+    int i = BGEN_SYM(search)(node, iter->key, iter->udata, &found, depth);
+    if (found) {
+        snode->index = i;
+        return 0;
+    }
+    if (i == 0 || i == node->len) {
+        // The next item may be outside of the leaf.
+        return -1;
+    }
+    snode->index = iter->kind == BGEN_SCANDESC ? i-1 : i;
+    return 1;
+}
+
+// Put a stable cursor back in its place after the tree was changed. The
+// cursor is either on its kept item, or on the next item when the kept item
+// is gone, if any. Returns true when the cursor is on the kept item.
+BGEN_NOINLINE
+static bool BGEN_SYM(iter_settle)(BGEN_ITER *iter) {
+    if (!iter->haskey || !iter->valid) {
+        return iter->valid;
+    }
+    int ret = BGEN_SYM(iter_resume)(iter);
+    if (ret == 0) {
+        return true;
+    }
+    if (ret == 1) {
+        BGEN_SYM(iter_keep)(iter);
+        return false;
+    }
+    BGEN_ITEM key = iter->key;
+    if (iter->kind == BGEN_SCANDESC) {
+        BGEN_SYM(iter_seek_desc)(iter, key);
+    } else {
+        BGEN_SYM(iter_seek)(iter, key);
+    }
+    if (!iter->valid) {
+        return false;
+    }
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    return BGEN_SYM(compare)(snode->node->items[snode->index], key,
+        iter->udata) == 0;
+}
+
+// Move the iterator by delta items from the current item, where a positive
+// delta is the direction of the iteration. The stack is only popped until
+// reaching the node that holds the new position, so short moves only touch
+// the nodes near the leaves.
+static void BGEN_SYM(iter_advance)(BGEN_ITER *iter, ptrdiff_t delta) {
+    if (iter && iter->stable) {
+        BGEN_SYM(iter_settle)(iter);
+    }
+    if (!iter || !iter->valid) {
+        return;
+    }
+    if (iter->kind != BGEN_SCAN && iter->kind != BGEN_SCANDESC) {
+        iter->status = BGEN_UNSUPPORTED;
+        iter->valid = false;
+        return;
+    }
+    bool back = (delta < 0) != (iter->kind == BGEN_SCANDESC);
+    size_t dist = delta < 0 ? (size_t)0-(size_t)delta : (size_t)delta;
+    // Position of the current item in the top node.
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    size_t pos = (size_t)snode->index;
+    if (!snode->node->isleaf) {
+        pos = BGEN_SYM(count_before)(snode->node, snode->index) +
+            BGEN_SYM(node_count)(snode->node, snode->index);
+    }
+    // Climb until the node holds the new position.
+    while (back ? dist > pos : 
+        dist >= BGEN_SYM(count0)(snode->node) - pos)
+    {
+        if (iter->u.s.nstack == 1) {
+            iter->valid = false;
+            return;
+        }
+        iter->u.s.nstack--;
+        snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        pos += BGEN_SYM(count_before)(snode->node, snode->index);
+    }
+    size_t index = back ? pos-dist : pos+dist;
+    BGEN_NODE *node = snode->node;
+    iter->u.s.nstack--;
+    while (1) {
+        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
+        if (node->isleaf) {
+            iter->u.s.stack[iter->u.s.nstack-1].index = (int)index;
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        bool found;
+        int i = BGEN_SYM(node_find_index)(node, &index, &found);
+        iter->u.s.stack[iter->u.s.nstack-1].index = i;
+        if (found) {
+            BGEN_SYM(iter_keep)(iter);
+            return;
+        }
+        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
             iter->status = BGEN_NOMEM;
             iter->valid = false;
             return;
         }
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ 
-            snode->node->children[snode->index], -1 };
+        node = node->children[i];
+    }
+}
+
+static void BGEN_SYM(iter_intersects)(BGEN_ITER *iter, BGEN_RTYPE min[], 
+    BGEN_RTYPE max[])
+{
+    if (!iter) {
+        return;
+    }
+BGEN_SYM(iter_reset)(iter, BGEN_INTERSECTS);
+#ifndef BGEN_SPATIAL
+    (void)iter, (void)min, (void)max;
+    iter->valid = false;
+#else
+    for (int i = 0; i < BGEN_DIMS; i++) {
+        iter->u.s.itarget.min[i] = min[i];
+        iter->u.s.itarget.max[i] = max[i];
+    }
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    iter->valid = BGEN_SYM(iter_intersects_first)(iter, *iter->root);
+#endif
+}
+
+
+static void BGEN_SYM(iter_nearby0)(BGEN_ITER *iter, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+    void *target, void *udata), BGEN_RTYPE *maxdist)
+{
+    if (!iter) {
+        return;
+    }
+    BGEN_SYM(iter_reset)(iter, BGEN_NEARBY);
+#ifndef BGEN_SPATIAL
+    (void)iter, (void)target, (void)dist, (void)maxdist;
+    iter->valid = false;
+#else
+    iter->u.n.ntarget = target;
+    iter->u.n.dist = dist;
+    iter->u.n.bounded = maxdist != 0;
+    iter->u.n.maxdist = maxdist ? *maxdist : 0;
+    if (!*iter->root) {
+        iter->valid = false;
+        return;
+    }
+    
+    // Start out by adding the contents of the root node.
+    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+        iter->status = BGEN_NOMEM;
+        iter->valid = false;
+        return;
+    }
+    iter->status = BGEN_SYM(nearby_addnodecontents)(&iter->queue, 
+        *iter->root, target, iter->u.n.dist, maxdist, iter->udata, iter->mut);
+    if (iter->status) {
+        iter->valid = false;
+        return;
+    }
+    // At this point there must be at least one item in the queue, unless
+    // everything is beyond maxdist.
+    BGEN_ASSERT(maxdist || iter->queue.len > 0);
+    // Call next to get the first nearby item.
+    BGEN_SYM(iter_next_nearby)(iter);
+#endif
+}
+
+static void BGEN_SYM(iter_nearby)(BGEN_ITER *iter, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+    void *target, void *udata))
+{
+    BGEN_SYM(iter_nearby0)(iter, target, dist, 0);
+}
+
+// Same as iter_nearby but items and nodes that are farther than maxdist are
+// never added to the queue.
+static void BGEN_SYM(iter_nearby_within)(BGEN_ITER *iter, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+    void *target, void *udata), BGEN_RTYPE maxdist)
+{
+    BGEN_SYM(iter_nearby0)(iter, target, dist, &maxdist);
+}
+
+// Get the current iterator item.
+// REQUIRES: iter_valid() and item != NULL
+static void BGEN_SYM(iter_item)(BGEN_ITER *iter, BGEN_ITEM *item) {
+    if (iter->stable) {
+        BGEN_SYM(iter_settle)(iter);
+        if (!BGEN_SYM(iter_valid)(iter)) {
+            return;
+        }
     }
+    BGEN_SYM(iter_item0)(iter, item);
 }
 
-// Move iterator cursor to the previous item.
-BGEN_NOINLINE
-static void BGEN_SYM(iter_next_desc)(BGEN_ITER *iter) {
-    BGEN_SNODE *snode;
-    while (1) {
-        snode = &iter->u.s.stack[iter->u.s.nstack-1];
-        snode->index--;
-        if (snode->node->isleaf && snode->index > -1) {
-            // Iterator now points to the next item
-            return;
+// Copy up to max items into items_out, starting with the current item, and
+// move the iterator past them. For scans and seeks the items are copied in
+// runs straight out of the leaves, and hopping over to a neighboring leaf of
+// the same parent does not need to climb the stack.
+// Returns the number of items copied, which is less than max only once the
+// iterator is no longer valid.
+static size_t BGEN_SYM(iter_next_batch)(BGEN_ITER *iter, BGEN_ITEM *items_out,
+    size_t max)
+{
+    if (iter && iter->stable) {
+        BGEN_SYM(iter_settle)(iter);
+    }
+    size_t n = 0;
+    while (n < max && BGEN_SYM(iter_valid)(iter)) {
+        if (iter->kind != BGEN_SCAN && iter->kind != BGEN_SCANDESC) {
+            // Other kinds of iterators are read one item at a time.
+            BGEN_SYM(iter_item0)(iter, &items_out[n++]);
+            BGEN_SYM(iter_next0)(iter);
+            continue;
         }
-        if (snode->node->isleaf) {
-            // pop stack
-            while (iter->u.s.nstack > 1) {
-                iter->u.s.nstack--;
-                snode = &iter->u.s.stack[iter->u.s.nstack-1];
-                snode->index--;
-                if (snode->index > -1) {
-                    // Iterator now points to the next item
-                    return;
-                }
+        bool desc = iter->kind == BGEN_SCANDESC;
+        BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        BGEN_NODE *node = snode->node;
+        if (!node->isleaf) {
+            items_out[n++] = node->items[snode->index];
+            BGEN_SYM(iter_next0)(iter);
+            continue;
+        }
+        int i = snode->index;
+        int run = desc ? i+1 : node->len-i;
+        bool partial = (size_t)run > max-n;
+        if (partial) {
+            // The iterator stays in this leaf.
+            run = (int)(max-n);
+            snode->index = desc ? i-run : i+run;
+        } else {
+            snode->index = desc ? 0 : node->len-1;
+        }
+        if (desc) {
+            for (int j = 0; j < run; j++) {
+                items_out[n+j] = node->items[i-j];
+            }
+        } else {
+            for (int j = 0; j < run; j++) {
+                items_out[n+j] = node->items[i+j];
             }
-            // end of iterator
-            iter->valid = false;
-            return;
         }
-        snode->index++;
-        if (iter->mut && !BGEN_SYM(cow)(&snode->node->children[snode->index], 
-            iter->udata))
-        {
-            iter->status = BGEN_NOMEM;
-            iter->valid = false;
-            return;
+        n += run;
+        if (partial) {
+            continue;
         }
-        BGEN_NODE *node = snode->node->children[snode->index];
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, node->len };
-        snode = &iter->u.s.stack[iter->u.s.nstack-1];
+        if (n < max && iter->u.s.nstack > 1) {
+            // The leaf is done. When the parent has leaf children then take 
+            // the parent's next item and go right to the neighboring leaf.
+            BGEN_SNODE *parent = &iter->u.s.stack[iter->u.s.nstack-2];
+            BGEN_NODE *pnode = parent->node;
+            int pi = parent->index;
+            if (pnode->height == 2 && (desc ? pi > 0 : pi < pnode->len)) {
+                int ci = desc ? pi-1 : pi+1;
+                if (iter->mut && !BGEN_SYM(cow)(&pnode->children[ci], 
+                    iter->udata))
+                {
+                    iter->status = BGEN_NOMEM;
+                    iter->valid = false;
+                    break;
+                }
+                if (desc ? ci > 0 : ci < pnode->len) {
+                    BGEN_SYM(prefetch_leaf)(pnode->children[desc?ci-1:ci+1]);
+                }
+                items_out[n++] = pnode->items[desc ? pi-1 : pi];
+                parent->index = ci;
+                node = pnode->children[ci];
+                *snode = (BGEN_SNODE){ node, desc ? node->len-1 : 0 };
+                continue;
+            }
+        }
+        BGEN_SYM(iter_next0)(iter);
     }
+    BGEN_SYM(iter_keep)(iter);
+    return n;
 }
 
-#ifdef BGEN_SPATIAL
-
-static int BGEN_SYM(nearby_addnodecontents)(BGEN_PQUEUE *queue, 
-    BGEN_NODE *node, void *target,
-    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
-    void *target, void *udata), void *udata, bool mut)
+// Get the rest of the current leaf as a span of items that points directly
+// into the node, and move the iterator past them. Returns the number of items 
+// in the span, or zero when the iterator is not valid. The span is always in 
+// tree order, thus for a descending iterator the current item is the last item
+// of the span, and the items are read backwards. A current item in a branch 
+// is returned as a span of one.
+// The items are read-only and are only valid until the next time the tree is
+// modified.
+// Only scans and seeks are supported, otherwise the iterator is invalidated
+// with the BGEN_UNSUPPORTED status.
+static int BGEN_SYM(iter_next_span)(BGEN_ITER *iter,
+    const BGEN_SYM(item_t) **items)
 {
-    BGEN_ASSERT(!mut || !BGEN_SYM(shared)(node));
-    for (int i = 0; i < node->len; i++) {
-        BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], udata);
-        BGEN_RTYPE d = dist(rect.min, rect.max, target, udata);
-        int status = BGEN_SYM(ppush_item)(queue, node->items[i], d, udata);
-        if (status) {
-            return status;
-        }
+    if (iter && iter->stable) {
+        BGEN_SYM(iter_settle)(iter);
     }
-    if (!node->isleaf) {
-        for (int i = 0; i <= node->len; i++) {
-            BGEN_RTYPE d = dist(node->rects[i].min, node->rects[i].max, target,
-                udata);
-            if (mut && !BGEN_SYM(cow)(&node->children[i], udata)) {
-                return BGEN_NOMEM;
-            }
-            int status = BGEN_SYM(ppush_node)(queue, node->children[i], d,
-                udata);
-            if (status) {
-                return status;
-            }
+    if (!BGEN_SYM(iter_valid)(iter)) {
+        return 0;
+    }
+    if (iter->kind != BGEN_SCAN && iter->kind != BGEN_SCANDESC) {
+        iter->status = BGEN_UNSUPPORTED;
+        iter->valid = false;
+        return 0;
+    }
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    BGEN_NODE *node = snode->node;
+    int i = snode->index;
+    int count = 1;
+    if (node->isleaf) {
+        if (iter->kind == BGEN_SCANDESC) {
+            count = i+1;
+            i = 0;
+            snode->index = 0;
+        } else {
+            count = node->len-i;
+            snode->index = node->len-1;
         }
     }
-    return 0;
+    *items = &node->items[i];
+    BGEN_SYM(iter_next0)(iter);
+    BGEN_SYM(iter_keep)(iter);
+    return count;
 }
 
+// Move a stable cursor to the next item. When the tree was changed and the
+// cursor cannot find its place from its own path, then it seeks back to the
+// kept item first. If that item is gone, then the cursor is already on the 
+// next item.
 BGEN_NOINLINE
-static void BGEN_SYM(iter_next_nearby)(BGEN_ITER *iter) {
-    // Begin popping queue items.
-    while (iter->u.n.queue.len > 0) {
-        BGEN_PITEM pitem = BGEN_SYM(ppop)(&iter->u.n.queue, iter->udata);
-        if (pitem.index == UINT64_MAX) {
-            // Queue item is a b-tree item. Return to user.
-            iter->u.n.nitem = pitem.u.item;
-            return;
-        } else {
-            // Queue item is a node. Add the contents of node and continue 
-            // popping queue items.
-            int status = BGEN_SYM(nearby_addnodecontents)(&iter->u.n.queue, 
-                pitem.u.node, iter->u.n.ntarget, iter->u.n.dist, iter->udata,
-                    iter->mut);
-            if (status) {
-                iter->valid = false;
-                iter->status = status;
-                return;
-            }
-        }
+static void BGEN_SYM(iter_next_stable)(BGEN_ITER *iter) {
+    if (!BGEN_SYM(iter_settle)(iter)) {
+        return;
     }
-    iter->valid = false;
+    BGEN_SYM(iter_next0)(iter);
+    BGEN_SYM(iter_keep)(iter);
 }
 
-#endif
-
 // Move iterator cursor to the next item.
 // REQUIRED: iter_valid()
 BGEN_INLINE
 static void BGEN_SYM(iter_next)(BGEN_ITER *iter) {
-    BGEN_ASSERT(BGEN_SYM(iter_valid)(iter));
-#ifdef BGEN_SPATIAL
-    if (iter->kind == BGEN_INTERSECTS) {
-        BGEN_SYM(iter_next_asc)(iter);
-    } else if (iter->kind == BGEN_NEARBY) {
-        BGEN_SYM(iter_next_nearby)(iter);
-    } else
-#endif
-    if (iter->kind == BGEN_SCAN) {
-        // Fastpath for forward scanning iterators iter_seek and iter_scan,
-        // where the next item is in a leaf. Fallback to the function call.
-        BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
-        if (snode->node->isleaf && snode->index+1 < snode->node->len) {
-            snode->index++;
-        } else {
-            BGEN_SYM(iter_next_asc)(iter);
-        }
-    } else if (iter->kind == BGEN_SCANDESC) {
-        BGEN_SYM(iter_next_desc)(iter);
+    if (iter->stable) {
+        BGEN_SYM(iter_next_stable)(iter);
+    } else {
+        BGEN_SYM(iter_next0)(iter);
     }
 }
 
-// Moves iterator to first item and resets the status
-static void BGEN_SYM(iter_scan)(BGEN_ITER *iter) {
+// Make the iterator a stable cursor, or back to a normal iterator. A stable
+// cursor keeps a copy of its current item, so that the tree may be changed
+// while iterating without needing to seek again. Only scans and seeks are
+// stable. Every call that reads the stack of a stable cursor settles it
+// first, since the nodes on the stack may have been freed by the change.
+// With BGEN_MULTI the kept item cannot be told apart from its equals, so a
+// cursor could skip some of them or visit them twice, and is not supported.
+static void BGEN_SYM(iter_set_stable)(BGEN_ITER *iter, bool stable) {
     if (!iter) {
         return;
     }
-    BGEN_SYM(iter_reset)(iter, BGEN_SCAN);
-    if (!*iter->root) {
+#if defined(BGEN_NOORDER) || defined(BGEN_MULTI)
+    if (stable) {
         iter->valid = false;
-        return;
+        iter->status = BGEN_UNSUPPORTED;
     }
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
-        iter->status = BGEN_NOMEM;
-        iter->valid = false;
-        return;
+#else
+    iter->stable = stable;
+    iter->haskey = false;
+    BGEN_SYM(iter_keep)(iter);
+#endif
+}
+
+// Copy-on-write the nodes on the path of a mutable iterator, in case that 
+// some became shared since the iterator moved, such as by a clone.
+static bool BGEN_SYM(iter_cow_path)(BGEN_ITER *iter) {
+    if (!BGEN_SYM(cow)(iter->root, iter->udata)) {
+        return false;
     }
     BGEN_NODE *node = *iter->root;
-    while (1) {
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
-        if (node->isleaf) {
-            return;
+    for (int i = 0; i < iter->u.s.nstack; i++) {
+        BGEN_SNODE *snode = &iter->u.s.stack[i];
+        snode->node = node;
+        if (i == iter->u.s.nstack-1) {
+            break;
         }
-        if (iter->mut && !BGEN_SYM(cow)(&node->children[0], iter->udata)) {
-            iter->status = BGEN_NOMEM;
-            iter->valid = false;
-            return;
+        if (!BGEN_SYM(cow)(&node->children[snode->index], iter->udata)) {
+            return false;
         }
-        node = node->children[0];
+        node = node->children[snode->index];
     }
+    return true;
 }
 
-// Moves iterator to last item and resets the status
-static void BGEN_SYM(iter_scan_desc)(BGEN_ITER *iter) {
-    if (!iter) {
-        return;
+// Checks for the changing of the iterator at the cursor.
+static int BGEN_SYM(iter_check_mut)(BGEN_ITER *iter) {
+    if (iter && iter->stable) {
+        BGEN_SYM(iter_settle)(iter);
     }
-    BGEN_SYM(iter_reset)(iter, BGEN_SCANDESC);
-    if (!*iter->root) {
-        iter->valid = false;
-        return;
+    if (!BGEN_SYM(iter_valid)(iter)) {
+        return BGEN_NOTFOUND;
     }
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
+    if (!iter->mut || (iter->kind != BGEN_SCAN && 
+        iter->kind != BGEN_SCANDESC))
+    {
+        return BGEN_UNSUPPORTED;
+    }
+    if (!BGEN_SYM(iter_cow_path)(iter)) {
         iter->status = BGEN_NOMEM;
         iter->valid = false;
-        return;
+        return BGEN_NOMEM;
     }
-    BGEN_NODE *node = *iter->root;
-    while (1) {
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, node->len };
-        if (node->isleaf) {
-            iter->u.s.stack[iter->u.s.nstack-1].index--;
-            return;
+    return 0;
+}
+
+#ifndef BGEN_NOORDER
+// Returns true if the item can take the place of the current item without
+// breaking the order of the tree.
+static bool BGEN_SYM(iter_fits)(BGEN_ITER *iter, BGEN_ITEM item) {
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    BGEN_NODE *node = snode->node;
+    int i = snode->index;
+    BGEN_ITEM *prev = 0;
+    BGEN_ITEM *next = 0;
+    if (node->isleaf) {
+        prev = i > 0 ? &node->items[i-1] : 0;
+        next = i < node->len-1 ? &node->items[i+1] : 0;
+        // The neighbors outside of the leaf are in the parents.
+        for (int j = iter->u.s.nstack-2; j >= 0 && (!prev || !next); j--) {
+            BGEN_SNODE *parent = &iter->u.s.stack[j];
+            if (!prev && parent->index > 0) {
+                prev = &parent->node->items[parent->index-1];
+            }
+            if (!next && parent->index < parent->node->len) {
+                next = &parent->node->items[parent->index];
+            }
         }
-        if (iter->mut && !BGEN_SYM(cow)(&node->children[node->len],
-            iter->udata))
-        {
-            iter->status = BGEN_NOMEM;
-            iter->valid = false;
-            return;
+    } else {
+        BGEN_NODE *child = node->children[i];
+        while (!child->isleaf) {
+            child = child->children[child->len];
         }
-        node = node->children[node->len];
+        prev = &child->items[child->len-1];
+        child = node->children[i+1];
+        while (!child->isleaf) {
+            child = child->children[0];
+        }
+        next = &child->items[0];
     }
+    return (!prev || BGEN_SYM(inorder)(*prev, item, iter->udata)) &&
+           (!next || BGEN_SYM(inorder)(item, *next, iter->udata));
 }
+#endif
 
+// Recalculate the rectangles and augmented summaries on the path of the
+// iterator after the items at its cursor changed.
+static void BGEN_SYM(iter_recalc)(BGEN_ITER *iter) {
+#if defined(BGEN_SPATIAL) || defined(BGEN_AUGMENT)
+    for (int j = iter->u.s.nstack-2; j >= 0; j--) {
+        BGEN_NODE *parent = iter->u.s.stack[j].node;
+        int k = iter->u.s.stack[j].index;
 #ifdef BGEN_SPATIAL
-// Finds the first intersecting item and fills the stack along the way.
-static bool BGEN_SYM(iter_intersects_first)(BGEN_ITER *iter, BGEN_NODE *node) {
-    int depth = iter->u.s.nstack;
-    iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
-    if (node->isleaf) {
-        for (int i = 0; i < node->len; i++) {
-            BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], iter->udata);
-            if (BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
-                iter->u.s.stack[depth].index = i;
-                return true;
-            }
+        parent->rects[k] = BGEN_SYM(rect_calc)(parent, k, iter->udata);
+#endif
+#ifdef BGEN_AUGMENT
+        BGEN_SYM(aug_calc)(parent, k, iter->udata);
+#endif
+    }
+#else
+    (void)iter;
+#endif
+}
+
+// Replace the current item of a mutable iterator. The cursor stays on the
+// new item. Only the nodes on the path of the iterator are visited.
+static int BGEN_SYM(iter_replace)(BGEN_ITER *iter, BGEN_ITEM item,
+    BGEN_ITEM *olditem)
+{
+    int ret = BGEN_SYM(iter_check_mut)(iter);
+    if (ret) {
+        return ret;
+    }
+#ifndef BGEN_NOORDER
+    if (!BGEN_SYM(iter_fits)(iter, item)) {
+        return BGEN_OUTOFORDER;
+    }
+#endif
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    BGEN_NODE *node = snode->node;
+    int i = snode->index;
+    if (olditem) {
+        *olditem = node->items[i];
+    }
+    node->items[i] = item;
+#ifdef BGEN_SPATIAL
+    if (!node->isleaf) {
+        // Must also update the owning rectangle
+        node->rects[i] = BGEN_SYM(rect_calc)(node, i, iter->udata);
+    }
+#endif
+    BGEN_SYM(iter_recalc)(iter);
+    BGEN_SYM(iter_keep)(iter);
+    return BGEN_REPLACED;
+}
+
+// Returns the index of the current item, using the counts on the path.
+static size_t BGEN_SYM(iter_index)(BGEN_ITER *iter) {
+    size_t index = 0;
+    for (int i = 0; i < iter->u.s.nstack-1; i++) {
+        BGEN_SNODE *snode = &iter->u.s.stack[i];
+        index += BGEN_SYM(count_before)(snode->node, snode->index);
+    }
+    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
+    if (snode->node->isleaf) {
+        return index + (size_t)snode->index;
+    }
+    return index + BGEN_SYM(count_before)(snode->node, snode->index) +
+        BGEN_SYM(node_count)(snode->node, snode->index);
+}
+
+#if defined(BGEN_MULTI) && !defined(BGEN_COUNTED) && !defined(BGEN_NOORDER)
+// Returns the number of items that are equal to the current item, and that
+// come before it in the order of the iteration.
+static size_t BGEN_SYM(iter_equal_before)(BGEN_ITER *iter) {
+    BGEN_ITER back = *iter;
+    back.mut = false;
+    BGEN_ITEM item, other;
+    BGEN_SYM(iter_item0)(iter, &item);
+    size_t n = 0;
+    while (1) {
+        if (iter->kind == BGEN_SCANDESC) {
+            BGEN_SYM(iter_next_asc)(&back);
+        } else {
+            BGEN_SYM(iter_next_desc)(&back);
         }
-    } else {
-        for (int i = 0; i <= node->len; i++) {
-            if (BGEN_SYM(rect_intersects)(iter->u.s.itarget, node->rects[i])) {
-                if (BGEN_SYM(iter_intersects_first)(iter, node->children[i])) {
-                    iter->u.s.stack[depth].index = i;
-                    return true;
-                }
-                if (i < node->len) {
-                    BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], 
-                        iter->udata);
-                    if (BGEN_SYM(rect_intersects)(iter->u.s.itarget, rect)) {
-                        iter->u.s.stack[depth].index = i;
-                        return true;
-                    }
-                }
+        if (!back.valid) {
+            return n;
+        }
+        BGEN_SYM(iter_item0)(&back, &other);
+        if (BGEN_SYM(compare)(other, item, iter->udata) != 0) {
+            return n;
+        }
+        n++;
+    }
+}
+#endif
+
+// Delete the current item of a mutable iterator, and move the cursor to the
+// next item. The item is deleted using the path of the iterator, just like a
+// normal delete would, including the rebalancing of the nodes on the way back
+// up. When no rebalancing was needed, which is the common case, the path is
+// still intact and the cursor moves right along. Otherwise the cursor seeks to
+// the next item. With BGEN_MULTI and without BGEN_COUNTED, that seek lands on
+// the first of the items that are equal to the deleted one, so the ones that
+// were already visited are stepped over, which costs O(equal items).
+static int BGEN_SYM(iter_delete)(BGEN_ITER *iter, BGEN_ITEM *olditem) {
+    int ret = BGEN_SYM(iter_check_mut)(iter);
+    if (ret) {
+        return ret;
+    }
+    bool desc = iter->kind == BGEN_SCANDESC;
+    BGEN_SNODE *stack = iter->u.s.stack;
+    int top = iter->u.s.nstack-1;
+#ifdef BGEN_COUNTED
+    size_t index = BGEN_SYM(iter_index)(iter);
+#endif
+    BGEN_NODE *node = stack[top].node;
+    int i = stack[top].index;
+    BGEN_ITEM item = node->items[i];
+    // Extend the path down to the max item of the left subtree, which takes
+    // the place of an item that is in a branch.
+    int depth = top;
+    while (!node->isleaf) {
+        int j = depth == top ? i : node->len;
+        if (!BGEN_SYM(cow)(&node->children[j], iter->udata)) {
+            goto nomem;
+        }
+        stack[depth].index = j;
+        node = node->children[j];
+        stack[++depth] = (BGEN_SNODE){ node, node->len-1 };
+    }
+    // Make sure that the siblings that may be used in the rebalancing are
+    // cow'd before changing anything.
+    for (int j = 0; j < depth; j++) {
+        BGEN_NODE *parent = stack[j].node;
+        int k = stack[j].index;
+        if (parent->children[k]->len == BGEN_MINITEMS) {
+            k = k == parent->len ? k-1 : k+1;
+            if (!BGEN_SYM(cow)(&parent->children[k], iter->udata)) {
+                goto nomem;
             }
         }
     }
-    iter->u.s.nstack--;
-    return false;
-}
+#if defined(BGEN_MULTI) && !defined(BGEN_COUNTED) && !defined(BGEN_NOORDER)
+    // The delete rebalances when the leaf has too few items to spare one.
+    size_t nequal = 0;
+    if (depth > 0 && node->len == BGEN_MINITEMS) {
+        nequal = BGEN_SYM(iter_equal_before)(iter);
+    }
 #endif
-
-static void BGEN_SYM(iter_seek)(BGEN_ITER *iter, BGEN_ITEM key) {
-    if (!iter) {
-        return;
+    if (depth > top) {
+        stack[top].node->items[i] = node->items[node->len-1];
+        BGEN_SYM(shift_left)(node, node->len-1, 1, false);
+    } else {
+        BGEN_SYM(shift_left)(node, i, 1, false);
+    }
+#ifdef BGEN_SPATIAL
+    BGEN_RECT rect = BGEN_SYM(item_rect)(item, iter->udata);
+#endif
+    bool rebalanced = false;
+    for (int j = depth-1; j >= 0; j--) {
+        BGEN_NODE *parent = stack[j].node;
+        int k = stack[j].index;
+#ifdef BGEN_COUNTED
+        BGEN_SYM(count_decr)(parent, k);
+#endif
+#ifdef BGEN_SPATIAL
+        if (j >= top || BGEN_SYM(rect_onedge)(rect, parent->rects[k])) {
+            parent->rects[k] = BGEN_SYM(rect_calc)(parent, k, iter->udata);
+        }
+#endif
+        if (parent->children[k]->len < BGEN_MINITEMS) {
+            BGEN_SYM(rebalance)(parent, k, iter->udata);
+            rebalanced = true;
+        } else {
+#ifdef BGEN_AUGMENT
+            BGEN_SYM(aug_calc)(parent, k, iter->udata);
+#endif
+        }
+    }
+    if ((*iter->root)->len == 0) {
+        BGEN_NODE *old_root = *iter->root;
+        *iter->root = old_root->isleaf ? 0 : old_root->children[0];
+        BGEN_SYM(free)(old_root, BGEN_NODE_SIZE(old_root), iter->udata);
+        rebalanced = true;
+    }
+    if (olditem) {
+        *olditem = item;
     }
-#ifdef BGEN_NOORDER
-    (void)iter, (void)key;
-    iter->valid = false;
-    iter->status = BGEN_UNSUPPORTED;
-#else
-    BGEN_SYM(iter_reset)(iter, BGEN_SCAN);
     if (!*iter->root) {
         iter->valid = false;
-        return;
+        return BGEN_DELETED;
+    }
+    if (!rebalanced) {
+        iter->u.s.nstack = top+1;
+        stack[top].index = i;
+        if (depth > top) {
+            // The item before now takes the place of the deleted item.
+            if (!desc) {
+                BGEN_SYM(iter_next0)(iter);
+            }
+        } else if (desc || i == node->len) {
+            // The next item is the one before, or the one after the leaf.
+            stack[top].index = desc ? i : i-1;
+            BGEN_SYM(iter_next0)(iter);
+        }
+        BGEN_SYM(iter_keep)(iter);
+        return BGEN_DELETED;
     }
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
-        iter->status = BGEN_NOMEM;
+#ifdef BGEN_COUNTED
+    if (!desc) {
+        BGEN_SYM(iter_seek_at)(iter, index);
+    } else if (index > 0) {
+        BGEN_SYM(iter_seek_at_desc)(iter, index-1);
+    } else {
         iter->valid = false;
-        return;
     }
-    int depth = 0;
-    BGEN_NODE *node = *iter->root;
-    while (1) {
-        int found;
-        int i = BGEN_SYM(search)(node, key, iter->udata, &found, depth);
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, i };
-        if (found) {
-            return;
+#elif !defined(BGEN_NOORDER)
+    if (desc) {
+        BGEN_SYM(iter_seek_desc)(iter, item);
+    } else {
+        BGEN_SYM(iter_seek)(iter, item);
+    }
+#ifdef BGEN_MULTI
+    while (nequal > 0 && iter->valid) {
+        BGEN_SYM(iter_next0)(iter);
+        nequal--;
+    }
+#endif
+#else
+    iter->valid = false;
+#endif
+    return BGEN_DELETED;
+nomem:
+    // Nothing was changed, other than copying some shared nodes.
+    iter->u.s.nstack = top+1;
+    stack[top].index = i;
+    return BGEN_NOMEM;
+}
+
+// Delete every item that does not satisfy pred in a single pass. The items
+// are deleted at the cursor of a mutable iterator, and freed using 
+// BGEN_ITEMFREE.
+static int BGEN_SYM(retain_if)(BGEN_NODE **root, bool(*pred)(BGEN_ITEM item,
+    void *udata), void *udata)
+{
+    BGEN_ITER iter;
+    BGEN_SYM(iter_init0)(root, &iter, udata, true);
+    iter.mut = true;
+    BGEN_SYM(iter_scan)(&iter);
+    int ret = BGEN_NOTFOUND;
+    while (iter.valid) {
+        BGEN_SNODE *snode = &iter.u.s.stack[iter.u.s.nstack-1];
+        if (pred(snode->node->items[snode->index], udata)) {
+            BGEN_SYM(iter_next0)(&iter);
+            continue;
         }
-        if (node->isleaf) {
-            iter->u.s.stack[iter->u.s.nstack-1].index--;
-            BGEN_SYM(iter_next)(iter);
-            return;
+        BGEN_ITEM item;
+        int ret2 = BGEN_SYM(iter_delete)(&iter, &item);
+        if (ret2 != BGEN_DELETED) {
+            BGEN_SYM(iter_release_local)(&iter);
+            return ret2;
         }
-        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
-            iter->status = BGEN_NOMEM;
-            iter->valid = false;
-            return;
+        BGEN_SYM(item_free)(item, udata);
+        ret = BGEN_DELETED;
+    }
+    BGEN_SYM(iter_release_local)(&iter);
+    return iter.status ? iter.status : ret;
+}
+
+// Copy the shared nodes that deleting the item at the cursor may change,
+// which are the nodes on its path, down to the leaf of the item before it
+// when it is in a branch, and their siblings. Inserting other items
+// afterwards only splits nodes, which keeps them unshared, thus the delete
+// cannot run out of memory.
+static bool BGEN_SYM(iter_cow_delete)(BGEN_ITER *iter) {
+#ifdef BGEN_COW
+    BGEN_SNODE *stack = iter->u.s.stack;
+    int top = iter->u.s.nstack-1;
+    BGEN_NODE *node = stack[0].node;
+    int i = stack[0].index;
+    for (int d = 0; !node->isleaf; d++) {
+        for (int j = i > 0 ? i-1 : i; j <= i+1 && j <= node->len; j++) {
+            if (!BGEN_SYM(cow)(&node->children[j], iter->udata)) {
+                return false;
+            }
         }
         node = node->children[i];
-        depth++;
+        if (d < top) {
+            stack[d+1].node = node;
+            i = stack[d+1].index;
+        } else {
+            i = node->len;
+        }
     }
+#else
+    (void)iter;
 #endif
+    return true;
 }
 
-static void BGEN_SYM(iter_seek_at)(BGEN_ITER *iter, size_t index) {
-    if (!iter) {
-        return;
-    }
-    BGEN_SYM(iter_reset)(iter, BGEN_SCAN);
-    if (!*iter->root) {
-        iter->valid = false;
-        return;
+#ifndef BGEN_NOORDER
+// Returns true if the item can take any place in the leaf at the cursor
+// without breaking the order of the tree. The bounds of the leaf are the
+// nearest items in its parents.
+static bool BGEN_SYM(iter_fits_leaf)(BGEN_ITER *iter, BGEN_ITEM item) {
+    BGEN_ITEM *lo = 0;
+    BGEN_ITEM *hi = 0;
+    for (int j = iter->u.s.nstack-2; j >= 0 && (!lo || !hi); j--) {
+        BGEN_SNODE *parent = &iter->u.s.stack[j];
+        if (!lo && parent->index > 0) {
+            lo = &parent->node->items[parent->index-1];
+        }
+        if (!hi && parent->index < parent->node->len) {
+            hi = &parent->node->items[parent->index];
+        }
+    }
+    return (!lo || BGEN_SYM(inorder)(*lo, item, iter->udata)) &&
+           (!hi || BGEN_SYM(less)(item, *hi, iter->udata));
+}
+#endif
+
+#ifndef BGEN_MULTI
+static void BGEN_SYM(update_fn)(BGEN_ITEM *item, bool exists, void *udata) {
+    (void)item, (void)exists, (void)udata;
+}
+#endif
+
+// Replace the item that is equal to key with a new item that may belong
+// somewhere else, such as an item with a new priority. The old item is found
+// using a mutable iterator. When the new item still belongs in the same leaf,
+// which is the leaf-local shortcut, the items in between are shifted over
+// and the new item takes its place, without changing the shape of the tree.
+// Otherwise the new item is inserted, and then the old item is deleted.
+// Without BGEN_MULTI, the delete uses the path of the iterator when the
+// insert left it intact, and the new item must not be equal to any other
+// item. With BGEN_MULTI, the old item is the first of its equals, which it
+// still is after the insert, so a normal delete finds exactly that item.
+// The key itself is the handle to the item. There are no handles that follow
+// an item around, because items move between nodes on every split, merge,
+// and rotation, and tracking them would cost all other operations.
+// returns REPLACED, NOTFOUND, OUTOFORDER, NOMEM, OVERFLOW, or UNSUPPORTED
+static int BGEN_SYM(update)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM item,
+    BGEN_ITEM *olditem, void *udata)
+{
+#ifdef BGEN_NOORDER
+    (void)root, (void)key, (void)item, (void)olditem, (void)udata;
+    return BGEN_UNSUPPORTED;
+#else
+    BGEN_ITER iter;
+    BGEN_SYM(iter_init0)(root, &iter, udata, true);
+    iter.mut = true;
+    BGEN_SYM(iter_seek)(&iter, key);
+    int ret = iter.status ? iter.status : BGEN_NOTFOUND;
+    if (!iter.valid) {
+        BGEN_SYM(iter_release_local)(&iter);
+        return ret;
     }
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
-        iter->status = BGEN_NOMEM;
-        iter->valid = false;
-        return;
+    BGEN_SNODE *snode = &iter.u.s.stack[iter.u.s.nstack-1];
+    BGEN_NODE *node = snode->node;
+    int i = snode->index;
+    if (BGEN_SYM(less)(key, node->items[i], udata)) {
+        BGEN_SYM(iter_release_local)(&iter);
+        return BGEN_NOTFOUND;
     }
-    BGEN_NODE *node = *iter->root;
-    while (1) {
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
-        if (node->isleaf) {
-            if (index >= (size_t)node->len) {
-                iter->u.s.stack[iter->u.s.nstack-1].index = node->len;
-            } else {
-                iter->u.s.stack[iter->u.s.nstack-1].index = index;
-            }
-            iter->u.s.stack[iter->u.s.nstack-1].index--;
-            BGEN_SYM(iter_next)(iter);
-            return;
+    if (node->isleaf && BGEN_SYM(iter_fits_leaf)(&iter, item)) {
+        // Find the new place in the leaf, which is after its equals.
+        int j = i;
+        while (j > 0 && BGEN_SYM(less)(item, node->items[j-1], udata)) {
+            j--;
         }
-        int i = 0;
-        bool found = false;
-        for (; i < node->len; i++) {
-            size_t count = BGEN_SYM(node_count)(node, i);
-            if (index <= count) {
-                found = index == count;
-                break;
+        if (j == i) {
+            while (j < node->len-1 &&
+                !BGEN_SYM(less)(item, node->items[j+1], udata))
+            {
+                j++;
             }
-            index -= count + 1;
         }
-        iter->u.s.stack[iter->u.s.nstack-1].index = i;
-        if (found) {
-            return;
+        // The item that ends up before the new item must still be in order,
+        // which is not the case when they are equal without BGEN_MULTI.
+        BGEN_ITEM *prev = j > i ? &node->items[j] :
+            j > 0 ? &node->items[j-1] : 0;
+        if (prev && !BGEN_SYM(inorder)(*prev, item, udata)) {
+            BGEN_SYM(iter_release_local)(&iter);
+            return BGEN_OUTOFORDER;
         }
-        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
-            iter->status = BGEN_NOMEM;
-            iter->valid = false;
-            return;
+        if (olditem) {
+            *olditem = node->items[i];
         }
-        node = node->children[i];
+        for (; i > j; i--) {
+            node->items[i] = node->items[i-1];
+        }
+        for (; i < j; i++) {
+            node->items[i] = node->items[i+1];
+        }
+        node->items[j] = item;
+        BGEN_SYM(iter_recalc)(&iter);
+        BGEN_SYM(iter_release_local)(&iter);
+        return BGEN_REPLACED;
     }
-}
-
-static void BGEN_SYM(iter_seek_at_desc)(BGEN_ITER *iter, size_t index) {
-    if (!iter) {
-        return;
+#ifndef BGEN_MULTI
+    // An item in a branch can still be replaced in place. Not so with
+    // BGEN_MULTI, where the new item must go after its equals.
+    if (!node->isleaf && BGEN_SYM(iter_fits)(&iter, item)) {
+        ret = BGEN_SYM(iter_replace)(&iter, item, olditem);
+        BGEN_SYM(iter_release_local)(&iter);
+        return ret;
     }
-    BGEN_SYM(iter_reset)(iter, BGEN_SCANDESC);
-    if (!*iter->root) {
-        iter->valid = false;
-        return;
+#endif
+    if (!BGEN_SYM(iter_cow_delete)(&iter)) {
+        BGEN_SYM(iter_release_local)(&iter);
+        return BGEN_NOMEM;
     }
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
-        iter->status = BGEN_NOMEM;
-        iter->valid = false;
-        return;
+#ifdef BGEN_MULTI
+    ret = BGEN_SYM(insert)(root, item, 0, udata);
+#else
+    // An upsert that does not change an existing item inserts the new item
+    // only when no other item is equal to it.
+    iter.key = node->items[i];
+    ret = BGEN_SYM(upsert)(root, item, BGEN_SYM(update_fn), udata);
+    if (ret == BGEN_FOUND) {
+        ret = BGEN_OUTOFORDER;
     }
-    BGEN_NODE *node = *iter->root;
-    while (1) {
-        iter->u.s.stack[iter->u.s.nstack++] = (BGEN_SNODE){ node, 0 };
+#endif
+    if (ret != BGEN_INSERTED) {
+        BGEN_SYM(iter_release_local)(&iter);
+        return ret;
+    }
+    BGEN_ITEM old;
+#ifdef BGEN_MULTI
+    int ret2 = BGEN_SYM(delete)(root, key, &old, udata);
+#else
+    // The path is no longer intact when the insert split some of its nodes.
+    int ret2 = BGEN_SYM(iter_resume)(&iter) == 0 ?
+        BGEN_SYM(iter_delete)(&iter, &old) :
+        BGEN_SYM(delete)(root, key, &old, udata);
+#endif
+    BGEN_ASSERT(ret2 == BGEN_DELETED);
+    (void)ret2;
+    BGEN_SYM(iter_release_local)(&iter);
+    if (olditem) {
+        *olditem = old;
+    }
+    return BGEN_REPLACED;
+#endif
+}
+
+// Tree header
+
+// A tree header owns a root, along with the metadata that the rest of the API
+// has no place to keep. That is the item count, a modification counter, a
+// path hint, and the paths from the root to the first and last leaves.
+//
+// The nodes on a cached path are never shared, so the edge operations change
+// them in place without a descent from the root. A path is dropped when an
+// operation that goes by way of the root no longer leaves it leading from the
+// root to an edge leaf, such as after a split or a merge, and by tree_root,
+// which hands out the root to the rest of the API. It's rebuilt by the next
+// edge operation. Since the root that was handed out may be kept and used
+// again later, such a tree checks its paths before every use, and counts its
+// items on every call to tree_count.
+BGEN_TREE {
+    BGEN_NODE *root;                        // root node
+    size_t count;                           // number of items
+    size_t version;                         // modification counter
+    size_t hits;                            // edge operations using a path
+    size_t misses;                          // edge operations that descended
+    bool lent;                              // root was handed out
+    short nedge[2];                         // length of cached paths
+    BGEN_NODE *edge[2][BGEN_MAXHEIGHT];     // first and last leaf paths
+#ifdef BGEN_PATHHINT
+    uint8_t hint[BGEN_MAXHEIGHT];           // path hint of this tree
+#endif
+};
+
+static void BGEN_SYM(tree_init)(BGEN_TREE **tree, void *udata) {
+    *tree = BGEN_SYM(malloc)(sizeof(BGEN_TREE), udata);
+    if (*tree) {
+        **tree = (BGEN_TREE){ 0 };
+    }
+}
+
+static void BGEN_SYM(tree_drop)(BGEN_TREE *tree) {
+    tree->nedge[0] = 0;
+    tree->nedge[1] = 0;
+}
+
+// Drop the cached path to the first (back=0) or last (back=1) leaf when it
+// was changed by an operation on the root. Each node of the path is compared
+// to the child of the node above it, starting at the root, so only the nodes
+// of the tree are read, never the freed ones. A path with a node that became
+// shared, such as by a clone, is dropped too.
+static void BGEN_SYM(tree_keep_edge)(BGEN_TREE *tree, int back) {
+    int n = tree->nedge[back];
+    BGEN_NODE *node = tree->root;
+    int i = 0;
+    while (i < n && node == tree->edge[back][i] && !BGEN_SYM(shared)(node)) {
+        i++;
         if (node->isleaf) {
-            if (index >= (size_t)node->len) {
-                iter->u.s.stack[iter->u.s.nstack-1].index = node->len-1;
-            } else {
-                iter->u.s.stack[iter->u.s.nstack-1].index = index;
-            }
-            return;
-        }
-        int i = 0;
-        bool found = false;
-        for (; i < node->len; i++) {
-            size_t count = BGEN_SYM(node_count)(node, i);
-            if (index <= count) {
-                found = index == count;
-                break;
+            if (i == n) {
+                return;
             }
-            index -= count + 1;
-        }
-        iter->u.s.stack[iter->u.s.nstack-1].index = i;
-        if (found) {
-            return;
-        }
-        if (iter->mut && !BGEN_SYM(cow)(&node->children[i], iter->udata)) {
-            iter->status = BGEN_NOMEM;
-            iter->valid = false;
-            return;
+            break;
         }
-        node = node->children[i];
+        node = node->children[back ? node->len : 0];
     }
+    tree->nedge[back] = 0;
 }
 
-static void BGEN_SYM(iter_intersects)(BGEN_ITER *iter, BGEN_RTYPE min[], 
-    BGEN_RTYPE max[])
-{
-    if (!iter) {
-        return;
+static void BGEN_SYM(tree_keep)(BGEN_TREE *tree) {
+    BGEN_SYM(tree_keep_edge)(tree, 0);
+    BGEN_SYM(tree_keep_edge)(tree, 1);
+}
+
+// Free all items and the tree header.
+static void BGEN_SYM(tree_release)(BGEN_TREE *tree, void *udata) {
+    if (tree) {
+        BGEN_SYM(clear)(&tree->root, udata);
+        BGEN_SYM(free)(tree, sizeof(BGEN_TREE), udata);
+    }
+}
+
+// Returns the root for use with the rest of the API. Since the tree may then
+// be changed by way of the root, at any time after, the cached paths are
+// dropped and from now on checked before each use, the count is always
+// recalculated, and the version is bumped.
+static BGEN_NODE **BGEN_SYM(tree_root)(BGEN_TREE *tree) {
+    BGEN_SYM(tree_drop)(tree);
+    tree->lent = true;
+    tree->version++;
+    return &tree->root;
+}
+
+// Start an operation on the tree of a header, using the path hint of the 
+// tree rather than the one shared by the namespace.
+static void BGEN_SYM(tree_begin)(BGEN_TREE *tree) {
+#ifdef BGEN_PATHHINT
+    for (int i = 0; i < BGEN_MAXHEIGHT; i++) {
+        BGEN_SYM(ghint)[i] = tree->hint[i];
     }
-BGEN_SYM(iter_reset)(iter, BGEN_INTERSECTS);
-#ifndef BGEN_SPATIAL
-    (void)iter, (void)min, (void)max;
-    iter->valid = false;
 #else
-    for (int i = 0; i < BGEN_DIMS; i++) {
-        iter->u.s.itarget.min[i] = min[i];
-        iter->u.s.itarget.max[i] = max[i];
+    (void)tree;
+#endif
+}
+
+// Finish an operation on the tree of a header, updating the metadata using 
+// the returned status.
+static int BGEN_SYM(tree_end)(BGEN_TREE *tree, int ret) {
+#ifdef BGEN_PATHHINT
+    for (int i = 0; i < BGEN_MAXHEIGHT; i++) {
+        tree->hint[i] = BGEN_SYM(ghint)[i];
     }
-    if (!*iter->root) {
-        iter->valid = false;
-        return;
+#endif
+    if (ret == BGEN_INSERTED) {
+        tree->count++;
+        tree->version++;
+    } else if (ret == BGEN_DELETED) {
+        tree->count--;
+        tree->version++;
+    } else if (ret == BGEN_REPLACED) {
+        tree->version++;
     }
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
-        iter->status = BGEN_NOMEM;
-        iter->valid = false;
-        return;
+    return ret;
+}
+
+// Returns the number of items. This only counts the items when the root was
+// handed out by tree_root.
+static size_t BGEN_SYM(tree_count)(BGEN_TREE *tree, void *udata) {
+    if (tree->lent) {
+        tree->count = BGEN_SYM(count)(&tree->root, udata);
     }
-    iter->valid = BGEN_SYM(iter_intersects_first)(iter, *iter->root);
-#endif
+    return tree->count;
+}
+
+static size_t BGEN_SYM(tree_height)(BGEN_TREE *tree, void *udata) {
+    return BGEN_SYM(height)(&tree->root, udata);
+}
+
+// Returns the modification counter, which changes whenever the tree may have
+// changed.
+static size_t BGEN_SYM(tree_version)(BGEN_TREE *tree) {
+    return tree->version;
+}
+
+// Returns the number of edge operations that used a cached path, and the 
+// number that had to descend from the root.
+static void BGEN_SYM(tree_stats)(BGEN_TREE *tree, size_t *hits,
+    size_t *misses)
+{
+    if (hits) {
+        *hits = tree->hits;
+    }
+    if (misses) {
+        *misses = tree->misses;
+    }
+}
+
+static int BGEN_SYM(tree_get)(BGEN_TREE *tree, BGEN_ITEM key, 
+    BGEN_ITEM *item_out, void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+    int ret = BGEN_SYM(get)(&tree->root, key, item_out, udata);
+    return BGEN_SYM(tree_end)(tree, ret);
+}
+
+static bool BGEN_SYM(tree_contains)(BGEN_TREE *tree, BGEN_ITEM key,
+    void *udata)
+{
+    return BGEN_SYM(tree_get)(tree, key, 0, udata) == BGEN_FOUND;
+}
+
+static int BGEN_SYM(tree_insert)(BGEN_TREE *tree, BGEN_ITEM item,
+    BGEN_ITEM *item_out, void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+    int ret = BGEN_SYM(insert)(&tree->root, item, item_out, udata);
+    BGEN_SYM(tree_keep)(tree);
+    return BGEN_SYM(tree_end)(tree, ret);
+}
+
+static int BGEN_SYM(tree_delete)(BGEN_TREE *tree, BGEN_ITEM key,
+    BGEN_ITEM *item_out, void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+    int ret = BGEN_SYM(delete)(&tree->root, key, item_out, udata);
+    BGEN_SYM(tree_keep)(tree);
+    return BGEN_SYM(tree_end)(tree, ret);
+}
+
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
+// Returns the first (back=0) or last (back=1) leaf, using the cached path. 
+// The path is copy-on-write'd when it needs to be rebuilt.
+// Returns NULL when the tree is empty or out of memory.
+static BGEN_NODE *BGEN_SYM(tree_edge)(BGEN_TREE *tree, int back, void *udata)
+{
+    if (tree->lent) {
+        BGEN_SYM(tree_keep_edge)(tree, back);
+    }
+    int n = tree->nedge[back];
+    if (n == 0) {
+        BGEN_NODE **node = &tree->root;
+        while (*node) {
+            if (!BGEN_SYM(cow)(node, udata)) {
+                return 0;
+            }
+            tree->edge[back][n++] = *node;
+            if ((*node)->isleaf) {
+                break;
+            }
+            node = &(*node)->children[back ? (*node)->len : 0];
+        }
+        if (n == 0) {
+            return 0;
+        }
+        tree->nedge[back] = n;
+    }
+    return tree->edge[back][n-1];
 }
+#endif
 
-
-static void BGEN_SYM(iter_nearby)(BGEN_ITER *iter, void *target,
-    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
-    void *target, void *udata))
+static int BGEN_SYM(tree_front)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata)
 {
-    if (!iter) {
-        return;
+    if (tree->lent) {
+        BGEN_SYM(tree_keep_edge)(tree, 0);
     }
-    BGEN_SYM(iter_reset)(iter, BGEN_NEARBY);
-#ifndef BGEN_SPATIAL
-    (void)iter, (void)target, (void)dist;
-    iter->valid = false;
-#else
-    iter->u.n.ntarget = target;
-    iter->u.n.dist = dist;
-    if (!*iter->root) {
-        iter->valid = false;
-        return;
+    if (tree->nedge[0] > 0) {
+        if (item_out) {
+            *item_out = tree->edge[0][tree->nedge[0]-1]->items[0];
+        }
+        return BGEN_FOUND;
     }
-    
-    // Start out by adding the contents of the root node.
-    if (iter->mut && !BGEN_SYM(cow)(iter->root, iter->udata)) {
-        iter->status = BGEN_NOMEM;
-        iter->valid = false;
-        return;
+    return BGEN_SYM(front)(&tree->root, item_out, udata);
+}
+
+static int BGEN_SYM(tree_back)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata)
+{
+    if (tree->lent) {
+        BGEN_SYM(tree_keep_edge)(tree, 1);
     }
-    iter->status = BGEN_SYM(nearby_addnodecontents)(&iter->u.n.queue, 
-        *iter->root, target, iter->u.n.dist, iter->udata, iter->mut);
-    if (iter->status) {
-        iter->valid = false;
-        return;
+    if (tree->nedge[1] > 0) {
+        BGEN_NODE *leaf = tree->edge[1][tree->nedge[1]-1];
+        if (item_out) {
+            *item_out = leaf->items[leaf->len-1];
+        }
+        return BGEN_FOUND;
     }
-    // At this point there must be at least one item in the queue.
-    BGEN_ASSERT(iter->u.n.queue.len > 0);
-    // Call next to get the first nearby item.
-    BGEN_SYM(iter_next_nearby)(iter);
-#endif
+    return BGEN_SYM(back)(&tree->root, item_out, udata);
 }
 
-// Get the current iterator item.
-// REQUIRES: iter_valid() and item != NULL
-static void BGEN_SYM(iter_item)(BGEN_ITER *iter, BGEN_ITEM *item) {
-#ifdef BGEN_SPATIAL
-    if (iter->kind == BGEN_NEARBY) {
-        *item = iter->u.n.nitem;
-        return;
+static int BGEN_SYM(tree_pop_front)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
+    if (tree->root) {
+        BGEN_NODE *leaf = BGEN_SYM(tree_edge)(tree, 0, udata);
+        if (!leaf) {
+            return BGEN_SYM(tree_end)(tree, BGEN_NOMEM);
+        }
+        int n = tree->nedge[0];
+        if (leaf->len > (n == 1 ? 1 : BGEN_MINITEMS)) {
+            if (item_out) {
+                *item_out = leaf->items[0];
+            }
+            BGEN_SYM(shift_left)(leaf, 0, 1, false);
+#ifdef BGEN_COUNTED
+            for (int i = 0; i < n-1; i++) {
+                BGEN_SYM(count_decr)(tree->edge[0][i], 0);
+            }
+#endif
+            tree->hits++;
+            return BGEN_SYM(tree_end)(tree, BGEN_DELETED);
+        }
     }
 #endif
-    BGEN_SNODE *snode = &iter->u.s.stack[iter->u.s.nstack-1];
-    *item = snode->node->items[snode->index];
+    tree->misses++;
+    int ret = BGEN_SYM(pop_front)(&tree->root, item_out, udata);
+    BGEN_SYM(tree_keep)(tree);
+    return BGEN_SYM(tree_end)(tree, ret);
 }
 
-static void BGEN_SYM(iter_seek_desc)(BGEN_ITER *iter, BGEN_ITEM key) {
-    if (!iter) {
-        return;
+static int BGEN_SYM(tree_pop_back)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
+    if (tree->root) {
+        BGEN_NODE *leaf = BGEN_SYM(tree_edge)(tree, 1, udata);
+        if (!leaf) {
+            return BGEN_SYM(tree_end)(tree, BGEN_NOMEM);
+        }
+        int n = tree->nedge[1];
+        if (leaf->len > (n == 1 ? 1 : BGEN_MINITEMS)) {
+            if (item_out) {
+                *item_out = leaf->items[leaf->len-1];
+            }
+            leaf->len--;
+#ifdef BGEN_COUNTED
+            for (int i = 0; i < n-1; i++) {
+                BGEN_SYM(count_decr)(tree->edge[1][i], tree->edge[1][i]->len);
+            }
+#endif
+            tree->hits++;
+            return BGEN_SYM(tree_end)(tree, BGEN_DELETED);
+        }
     }
-#ifdef BGEN_NOORDER
-    (void)iter, (void)key;
-    iter->valid = false;
-    iter->status = BGEN_UNSUPPORTED;
-#else
-    BGEN_SYM(iter_seek)(iter, key);
-    if (!BGEN_SYM(iter_valid)(iter)) {
-        if (BGEN_SYM(iter_status)(iter) == 0) {
-            BGEN_SYM(iter_scan_desc)(iter);
+#endif
+    tree->misses++;
+    int ret = BGEN_SYM(pop_back)(&tree->root, item_out, udata);
+    BGEN_SYM(tree_keep)(tree);
+    return BGEN_SYM(tree_end)(tree, ret);
+}
+
+static int BGEN_SYM(tree_push_front)(BGEN_TREE *tree, BGEN_ITEM item,
+    void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
+    if (tree->root && !BGEN_SYM(count_full)(&tree->root)) {
+        BGEN_NODE *leaf = BGEN_SYM(tree_edge)(tree, 0, udata);
+        if (!leaf) {
+            return BGEN_SYM(tree_end)(tree, BGEN_NOMEM);
+        }
+        if (leaf->len < BGEN_MAXITEMS) {
+#ifndef BGEN_NOORDER
+            if (!BGEN_SYM(inorder)(item, leaf->items[0], udata)) {
+                return BGEN_SYM(tree_end)(tree, BGEN_OUTOFORDER);
+            }
+#endif
+            BGEN_SYM(shift_right)(leaf, 0, 1);
+            leaf->items[0] = item;
+#ifdef BGEN_COUNTED
+            for (int i = 0; i < tree->nedge[0]-1; i++) {
+                BGEN_SYM(count_incr)(tree->edge[0][i], 0);
+            }
+#endif
+            tree->hits++;
+            return BGEN_SYM(tree_end)(tree, BGEN_INSERTED);
         }
-    } else {
-        BGEN_ITEM item;
-        BGEN_SYM(iter_item)(iter, &item);
-        if (BGEN_SYM(compare)(item, key, iter->udata) > 0) {
-            BGEN_SYM(iter_next_desc)(iter);
+    }
+#endif
+    tree->misses++;
+    int ret = BGEN_SYM(push_front)(&tree->root, item, udata);
+    BGEN_SYM(tree_keep)(tree);
+    return BGEN_SYM(tree_end)(tree, ret);
+}
+
+static int BGEN_SYM(tree_push_back)(BGEN_TREE *tree, BGEN_ITEM item,
+    void *udata)
+{
+    BGEN_SYM(tree_begin)(tree);
+#if !defined(BGEN_SPATIAL) && !defined(BGEN_AUGMENT)
+    if (tree->root && !BGEN_SYM(count_full)(&tree->root)) {
+        BGEN_NODE *leaf = BGEN_SYM(tree_edge)(tree, 1, udata);
+        if (!leaf) {
+            return BGEN_SYM(tree_end)(tree, BGEN_NOMEM);
+        }
+        if (leaf->len < BGEN_MAXITEMS) {
+#ifndef BGEN_NOORDER
+            if (!BGEN_SYM(inorder)(leaf->items[leaf->len-1], item, udata)) {
+                return BGEN_SYM(tree_end)(tree, BGEN_OUTOFORDER);
+            }
+#endif
+            leaf->items[leaf->len++] = item;
+#ifdef BGEN_COUNTED
+            for (int i = 0; i < tree->nedge[1]-1; i++) {
+                BGEN_SYM(count_incr)(tree->edge[1][i], tree->edge[1][i]->len);
+            }
+#endif
+            tree->hits++;
+            return BGEN_SYM(tree_end)(tree, BGEN_INSERTED);
         }
     }
-    iter->kind = BGEN_SCANDESC;
 #endif
+    tree->misses++;
+    int ret = BGEN_SYM(push_back)(&tree->root, item, udata);
+    BGEN_SYM(tree_keep)(tree);
+    return BGEN_SYM(tree_end)(tree, ret);
 }
 
 #ifdef BGEN_SPATIAL
@@ -4446,44 +7790,304 @@ static bool BGEN_SYM(node_intersects_mut)(BGEN_NODE *node, BGEN_RECT target,
             }
         }
     }
-    if (!BGEN_SYM(cow)(&node->children[node->len], udata)) {
-        *status = BGEN_NOMEM;
-        return false;
-    }
-    if (BGEN_SYM(rect_intersects)(target, node->rects[node->len])) {
-        BGEN_NODE *child = node->children[node->len];
-        if (!BGEN_SYM(node_intersects_mut)(child, target, iter, udata, status)){
-            return false;
-        }
-    }
+    if (!BGEN_SYM(cow)(&node->children[node->len], udata)) {
+        *status = BGEN_NOMEM;
+        return false;
+    }
+    if (BGEN_SYM(rect_intersects)(target, node->rects[node->len])) {
+        BGEN_NODE *child = node->children[node->len];
+        if (!BGEN_SYM(node_intersects_mut)(child, target, iter, udata, status)){
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+static int BGEN_SYM(intersects_mut)(BGEN_NODE **root, 
+    BGEN_RTYPE min[], BGEN_RTYPE max[], 
+    bool(*iter)(BGEN_ITEM item, void *udata),
+    void *udata)
+{  
+    (void)root, (void)min, (void)max, (void)iter, (void)udata; 
+    int status = BGEN_FINISHED;
+#ifdef BGEN_SPATIAL
+    if (*root) {
+        BGEN_RECT target;
+        for (int i = 0; i < BGEN_DIMS; i++) {
+            target.min[i] = min[i];
+        }
+        for (int i = 0; i < BGEN_DIMS; i++) {
+            target.max[i] = max[i];
+        }
+        if (!BGEN_SYM(cow)(root, udata)) {
+            return BGEN_NOMEM;
+        }
+        if (!BGEN_SYM(node_intersects_mut)(*root, target, iter, udata, &status))
+        {
+            if (status == BGEN_FINISHED) {
+                status = BGEN_STOPPED;
+            }
+        }
+    }
+#endif
+    return status;
+}
+
+#ifdef BGEN_SPATIAL
+
+// Shared traversal for intersects_many. The "active" array holds the indexes
+// of the queries that intersect the node. Each level of the tree has its own
+// slice of "levels" that is used for filtering the queries of the children.
+static bool BGEN_SYM(node_intersects_many)(BGEN_NODE *node,
+    BGEN_RECT *queries, size_t *active, size_t nactive, size_t *levels, 
+    size_t n, bool(*iter)(size_t index, BGEN_ITEM item, void *udata),
+    void *udata)
+{
+    if (node->isleaf) {
+        for (int i = 0; i < node->len; i++) {
+            BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], udata);
+            for (size_t j = 0; j < nactive; j++) {
+                if (BGEN_SYM(rect_intersects)(queries[active[j]], rect)) {
+                    if (!iter(active[j], node->items[i], udata)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+    size_t *cactive = &levels[(node->height-2)*n];
+    for (int i = 0; i <= node->len; i++) {
+        // Filter the active queries for the child, without branching.
+        size_t ncactive = 0;
+        for (size_t j = 0; j < nactive; j++) {
+            cactive[ncactive] = active[j];
+            ncactive += BGEN_SYM(rect_intersects)(queries[active[j]],
+                node->rects[i]);
+        }
+        if (ncactive == 0) {
+            continue;
+        }
+        if (!BGEN_SYM(node_intersects_many)(node->children[i], queries,
+            cactive, ncactive, levels, n, iter, udata))
+        {
+            return false;
+        }
+        if (i == node->len) {
+            break;
+        }
+        BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], udata);
+        for (size_t j = 0; j < ncactive; j++) {
+            if (BGEN_SYM(rect_intersects)(queries[cactive[j]], rect)) {
+                if (!iter(cactive[j], node->items[i], udata)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+#endif
+
+// Search the tree for items that intersect any of the n query rectangles,
+// using a single traversal. Each match is returned as the query index and
+// the item. For each query, items are returned in the same order as the
+// intersects operation.
+static int BGEN_SYM(intersects_many)(BGEN_NODE **root,
+    BGEN_RTYPE min[][BGEN_DIMS], BGEN_RTYPE max[][BGEN_DIMS], size_t n,
+    bool(*iter)(size_t index, BGEN_ITEM item, void *udata), void *udata)
+{
+    (void)root, (void)min, (void)max, (void)n, (void)iter, (void)udata; 
+    int status = BGEN_FINISHED;
+#ifdef BGEN_SPATIAL
+    if (!*root || n == 0) {
+        return status;
+    }
+    // One allocation holds an active index list for each level of the tree
+    // followed by the query rects.
+    size_t height = (*root)->height;
+    size_t size = sizeof(size_t)*n*height + sizeof(BGEN_RECT)*n;
+    size_t *active = BGEN_SYM(malloc)(size, udata);
+    if (!active) {
+        return BGEN_NOMEM;
+    }
+    size_t *levels = active+n;
+    BGEN_RECT *queries = (BGEN_RECT*)(active+n*height);
+    for (size_t i = 0; i < n; i++) {
+        for (int j = 0; j < BGEN_DIMS; j++) {
+            queries[i].min[j] = min[i][j];
+        }
+        for (int j = 0; j < BGEN_DIMS; j++) {
+            queries[i].max[j] = max[i][j];
+        }
+        active[i] = i;
+    }
+    if (!BGEN_SYM(node_intersects_many)(*root, queries, active, n, levels, n,
+        iter, udata))
+    {
+        status = BGEN_STOPPED;
+    }
+    BGEN_SYM(free)(active, size, udata);
+#endif
+    return status;
+}
+
+#ifdef BGEN_SPATIAL
+
+// The spatial join descends both trees together. For a branch, slot i is
+// child i plus item i, which together are covered by rects[i]. The last slot
+// is only the last child.
+
+static bool BGEN_SYM(join_emit)(BGEN_ITEM a, BGEN_ITEM b, bool swap,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata)
+{
+    return swap ? iter(b, a, udata) : iter(a, b, udata);
+}
+
+static bool BGEN_SYM(join_item_slot)(BGEN_ITEM item, BGEN_RECT rect,
+    BGEN_NODE *node, int i, bool swap,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata);
+
+// Join a single item with all items in the node.
+static bool BGEN_SYM(join_item_node)(BGEN_ITEM item, BGEN_RECT rect,
+    BGEN_NODE *node, bool swap,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata)
+{
+    if (node->isleaf) {
+        for (int i = 0; i < node->len; i++) {
+            BGEN_RECT irect = BGEN_SYM(item_rect)(node->items[i], udata);
+            if (BGEN_SYM(rect_intersects)(rect, irect)) {
+                if (!BGEN_SYM(join_emit)(item, node->items[i], swap, iter, 
+                    udata))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    for (int i = 0; i <= node->len; i++) {
+        if (BGEN_SYM(rect_intersects)(rect, node->rects[i])) {
+            if (!BGEN_SYM(join_item_slot)(item, rect, node, i, swap, iter,
+                udata))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Join a single item with the slot at index i of a branch.
+static bool BGEN_SYM(join_item_slot)(BGEN_ITEM item, BGEN_RECT rect,
+    BGEN_NODE *node, int i, bool swap,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata)
+{
+    if (!BGEN_SYM(join_item_node)(item, rect, node->children[i], swap, iter, 
+        udata))
+    {
+        return false;
+    }
+    if (i < node->len) {
+        BGEN_RECT irect = BGEN_SYM(item_rect)(node->items[i], udata);
+        if (BGEN_SYM(rect_intersects)(rect, irect)) {
+            if (!BGEN_SYM(join_emit)(item, node->items[i], swap, iter, udata))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Join all items in node a with all items in node b.
+static bool BGEN_SYM(join_nodes)(BGEN_NODE *a, BGEN_NODE *b,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata)
+{
+    if (a->isleaf && b->isleaf) {
+        for (int i = 0; i < a->len; i++) {
+            BGEN_RECT arect = BGEN_SYM(item_rect)(a->items[i], udata);
+            for (int j = 0; j < b->len; j++) {
+                BGEN_RECT brect = BGEN_SYM(item_rect)(b->items[j], udata);
+                if (BGEN_SYM(rect_intersects)(arect, brect)) {
+                    if (!iter(a->items[i], b->items[j], udata)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+    if (a->isleaf || b->isleaf) {
+        // One leaf and one branch. Probe the branch with each leaf item.
+        bool swap = !a->isleaf;
+        BGEN_NODE *leaf = swap ? b : a;
+        BGEN_NODE *branch = swap ? a : b;
+        for (int i = 0; i < leaf->len; i++) {
+            BGEN_RECT rect = BGEN_SYM(item_rect)(leaf->items[i], udata);
+            if (!BGEN_SYM(join_item_node)(leaf->items[i], rect, branch, swap,
+                iter, udata))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    // Two branches. Only slot pairs with intersecting rects are visited.
+    for (int i = 0; i <= a->len; i++) {
+        for (int j = 0; j <= b->len; j++) {
+            if (!BGEN_SYM(rect_intersects)(a->rects[i], b->rects[j])) {
+                continue;
+            }
+            // child a[i] with child b[j]
+            if (!BGEN_SYM(join_nodes)(a->children[i], b->children[j], iter, 
+                udata))
+            {
+                return false;
+            }
+            // item a[i] with child b[j] and item b[j]
+            if (i < a->len) {
+                BGEN_RECT rect = BGEN_SYM(item_rect)(a->items[i], udata);
+                if (BGEN_SYM(rect_intersects)(rect, b->rects[j])) {
+                    if (!BGEN_SYM(join_item_slot)(a->items[i], rect, b, j,
+                        false, iter, udata))
+                    {
+                        return false;
+                    }
+                }
+            }
+            // item b[j] with child a[i]
+            if (j < b->len) {
+                BGEN_RECT rect = BGEN_SYM(item_rect)(b->items[j], udata);
+                if (BGEN_SYM(rect_intersects)(rect, a->rects[i])) {
+                    if (!BGEN_SYM(join_item_node)(b->items[j], rect,
+                        a->children[i], true, iter, udata))
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
     return true;
 }
+
 #endif
 
-static int BGEN_SYM(intersects_mut)(BGEN_NODE **root, 
-    BGEN_RTYPE min[], BGEN_RTYPE max[], 
-    bool(*iter)(BGEN_ITEM item, void *udata),
-    void *udata)
-{  
-    (void)root, (void)min, (void)max, (void)iter, (void)udata; 
+// Spatial join of two trees. Every pair of items, one from each tree, that
+// have intersecting rectangles are returned to the iter callback. The order
+// of the pairs is unspecified.
+static int BGEN_SYM(spatial_join)(BGEN_NODE **root, BGEN_NODE **other,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata)
+{
+    (void)root, (void)other, (void)iter, (void)udata; 
     int status = BGEN_FINISHED;
 #ifdef BGEN_SPATIAL
-    if (*root) {
-        BGEN_RECT target;
-        for (int i = 0; i < BGEN_DIMS; i++) {
-            target.min[i] = min[i];
-        }
-        for (int i = 0; i < BGEN_DIMS; i++) {
-            target.max[i] = max[i];
-        }
-        if (!BGEN_SYM(cow)(root, udata)) {
-            return BGEN_NOMEM;
-        }
-        if (!BGEN_SYM(node_intersects_mut)(*root, target, iter, udata, &status))
-        {
-            if (status == BGEN_FINISHED) {
-                status = BGEN_STOPPED;
-            }
+    if (*root && *other) {
+        if (!BGEN_SYM(join_nodes)(*root, *other, iter, udata)) {
+            status = BGEN_STOPPED;
         }
     }
 #endif
@@ -4494,8 +8098,8 @@ static int BGEN_SYM(intersects_mut)(BGEN_NODE **root,
 
 static int BGEN_SYM(nearby0)(BGEN_NODE **root, void *target,
     BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
-    void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata),
-    void *udata, bool mut)
+    void *target, void *udata), BGEN_RTYPE *maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata, bool mut)
 {
     if (!*root) {
         return BGEN_FINISHED;
@@ -4509,12 +8113,13 @@ static int BGEN_SYM(nearby0)(BGEN_NODE **root, void *target,
         goto done;
     }
     status = BGEN_SYM(nearby_addnodecontents)(&queue, *root, target, dist,
-        udata, mut);
+        maxdist, udata, mut);
     if (status) {
         goto done;
     }
-    // At this point there must be at least one item in the queue.
-    BGEN_ASSERT(queue.len > 0);
+    // At this point there must be at least one item in the queue, unless
+    // everything is beyond maxdist.
+    BGEN_ASSERT(maxdist || queue.len > 0);
     // Begin popping queue items.
     while (queue.len > 0) {
         BGEN_PITEM pitem = BGEN_SYM(ppop)(&queue, udata);
@@ -4528,7 +8133,7 @@ static int BGEN_SYM(nearby0)(BGEN_NODE **root, void *target,
             // Queue item is a node. Add the contents of node and continue 
             // popping queue items.
             status = BGEN_SYM(nearby_addnodecontents)(&queue, pitem.u.node,
-                target, dist, udata, mut);
+                target, dist, maxdist, udata, mut);
             if (status) {
                 goto done;
             }
@@ -4544,10 +8149,11 @@ done:
 #else
 static int BGEN_SYM(nearby0)(BGEN_NODE **root, void *target,
     BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
-    void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata),
-    void *udata, bool mut)
+    void *target, void *udata), BGEN_RTYPE *maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata, bool mut)
 {
-    (void)root, (void)target, (void)dist, (void)iter, (void)udata, (void)mut;
+    (void)root, (void)target, (void)dist, (void)maxdist, (void)iter;
+    (void)udata, (void)mut;
     return BGEN_FINISHED;
 }
 #endif
@@ -4557,7 +8163,7 @@ static int BGEN_SYM(nearby)(BGEN_NODE **root, void *target,
     void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata),
     void *udata)
 {
-    return BGEN_SYM(nearby0)(root, target, dist, iter, udata, 0);
+    return BGEN_SYM(nearby0)(root, target, dist, 0, iter, udata, 0);
 }
 
 static int BGEN_SYM(nearby_mut)(BGEN_NODE **root, void *target,
@@ -4565,7 +8171,182 @@ static int BGEN_SYM(nearby_mut)(BGEN_NODE **root, void *target,
     void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata),
     void *udata)
 {
-    return BGEN_SYM(nearby0)(root, target, dist, iter, udata, 1);
+    return BGEN_SYM(nearby0)(root, target, dist, 0, iter, udata, 1);
+}
+
+// Same as nearby but items and nodes that are farther than maxdist are never
+// added to the queue.
+static int BGEN_SYM(nearby_within)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata)
+{
+    return BGEN_SYM(nearby0)(root, target, dist, &maxdist, iter, udata, 0);
+}
+
+static int BGEN_SYM(nearby_within_mut)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata)
+{
+    return BGEN_SYM(nearby0)(root, target, dist, &maxdist, iter, udata, 1);
+}
+
+#ifdef BGEN_SPATIAL
+
+// The nearest_k scanner is a bounded kNN operation that keeps the best k
+// items in a max-heap, which lives in the caller provided items/dists arrays.
+// Nodes that are farther away than the current k-th best item are pruned.
+
+#define BGEN_KNN struct BGEN_SYM(knn)
+
+BGEN_KNN {
+    BGEN_ITEM *items;  // heap items, provided by caller
+    BGEN_RTYPE *dists; // heap distances, provided by caller
+    size_t len;        // number of items in heap
+    size_t k;          // max number of items in heap
+    void *target;
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+        void *target, void *udata);
+    void *udata;
+};
+
+// Returns true if the heap entry at i is farther than the entry at j.
+static bool BGEN_SYM(knn_farther)(BGEN_KNN *knn, size_t i, size_t j) {
+    if (knn->dists[i] < knn->dists[j]) {
+        return false;
+    }
+    if (knn->dists[i] > knn->dists[j]) {
+        return true;
+    }
+    return BGEN_SYM(compare)(knn->items[i], knn->items[j], knn->udata) > 0;
+}
+
+static void BGEN_SYM(knn_swap)(BGEN_KNN *knn, size_t i, size_t j) {
+    BGEN_ITEM item = knn->items[i];
+    knn->items[i] = knn->items[j];
+    knn->items[j] = item;
+    BGEN_RTYPE dist = knn->dists[i];
+    knn->dists[i] = knn->dists[j];
+    knn->dists[j] = dist;
+}
+
+static void BGEN_SYM(knn_sift_down)(BGEN_KNN *knn, size_t i, size_t len) {
+    while (1) {
+        size_t farthest = i;
+        size_t left = i * 2 + 1;
+        size_t right = i * 2 + 2;
+        if (left < len && BGEN_SYM(knn_farther)(knn, left, farthest)) {
+            farthest = left;
+        }
+        if (right < len && BGEN_SYM(knn_farther)(knn, right, farthest)) {
+            farthest = right;
+        }
+        if (farthest == i) {
+            break;
+        }
+        BGEN_SYM(knn_swap)(knn, farthest, i);
+        i = farthest;
+    }
+}
+
+static void BGEN_SYM(knn_push)(BGEN_KNN *knn, BGEN_ITEM item,
+    BGEN_RTYPE dist)
+{
+    if (knn->len < knn->k) {
+        // Heap still has room, sift up.
+        size_t i = knn->len++;
+        knn->items[i] = item;
+        knn->dists[i] = dist;
+        while (i != 0) {
+            size_t parent = (i - 1) / 2;
+            if (!BGEN_SYM(knn_farther)(knn, i, parent)) {
+                break;
+            }
+            BGEN_SYM(knn_swap)(knn, parent, i);
+            i = parent;
+        }
+        return;
+    }
+    // Heap is full. Only replace the farthest item when the new item is
+    // nearer.
+    if (dist > knn->dists[0] || (!(dist < knn->dists[0]) &&
+        BGEN_SYM(compare)(item, knn->items[0], knn->udata) >= 0))
+    {
+        return;
+    }
+    knn->items[0] = item;
+    knn->dists[0] = dist;
+    BGEN_SYM(knn_sift_down)(knn, 0, knn->len);
+}
+
+// Returns true if anything at the provided distance cannot be in the result.
+static bool BGEN_SYM(knn_prune)(BGEN_KNN *knn, BGEN_RTYPE dist) {
+    return knn->len == knn->k && dist > knn->dists[0];
+}
+
+static void BGEN_SYM(knn_node)(BGEN_KNN *knn, BGEN_NODE *node) {
+    for (int i = 0; i < node->len; i++) {
+        BGEN_RECT rect = BGEN_SYM(item_rect)(node->items[i], knn->udata);
+        BGEN_RTYPE dist = knn->dist(rect.min, rect.max, knn->target,
+            knn->udata);
+        BGEN_SYM(knn_push)(knn, node->items[i], dist);
+    }
+    if (node->isleaf) {
+        return;
+    }
+    // Visit the nearest child first, which quickly tightens the bounds, and
+    // then the remaining children in order.
+    BGEN_RTYPE dists[BGEN_MAXITEMS+1];
+    int nearest = 0;
+    dists[0] = knn->dist(node->rects[0].min, node->rects[0].max,
+        knn->target, knn->udata);
+    for (int i = 1; i <= node->len; i++) {
+        dists[i] = knn->dist(node->rects[i].min, node->rects[i].max,
+            knn->target, knn->udata);
+        if (dists[i] < dists[nearest]) {
+            nearest = i;
+        }
+    }
+    if (!BGEN_SYM(knn_prune)(knn, dists[nearest])) {
+        BGEN_SYM(knn_node)(knn, node->children[nearest]);
+    }
+    for (int i = 0; i <= node->len; i++) {
+        if (i != nearest && !BGEN_SYM(knn_prune)(knn, dists[i])) {
+            BGEN_SYM(knn_node)(knn, node->children[i]);
+        }
+    }
+}
+#endif
+
+// Find the k nearest items. The items and dists arrays must have room for
+// k entries. Returns the number of items found, ordered from nearest to
+// farthest.
+static size_t BGEN_SYM(nearest_k)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+    void *target, void *udata), size_t k, BGEN_ITEM items[],
+    BGEN_RTYPE dists[], void *udata)
+{
+#ifndef BGEN_SPATIAL
+    (void)root, (void)target, (void)dist, (void)k, (void)items, (void)dists;
+    (void)udata;
+    return 0;
+#else
+    if (!*root || k == 0) {
+        return 0;
+    }
+    BGEN_KNN knn = {
+        .items = items, .dists = dists, .len = 0, .k = k, .target = target,
+        .dist = dist, .udata = udata,
+    };
+    BGEN_SYM(knn_node)(&knn, *root);
+    // Sort the heap in place, nearest first.
+    for (size_t i = knn.len; i > 1; i--) {
+        BGEN_SYM(knn_swap)(&knn, 0, i-1);
+        BGEN_SYM(knn_sift_down)(&knn, 0, i-1);
+    }
+    return knn.len;
+#endif
 }
 
 #ifdef BGEN_SPATIAL
@@ -4647,17 +8428,30 @@ static inline void BGEN_SYM(all_sym_calls)(void) {
     (void)BGEN_SYM(get_mut_ref);
     (void)BGEN_SYM(get_at_mut);
     (void)BGEN_SYM(insert);
+    (void)BGEN_SYM(upsert);
     (void)BGEN_SYM(get);
     (void)BGEN_SYM(index_of);
+    (void)BGEN_SYM(rank);
+    (void)BGEN_SYM(count_range);
+    (void)BGEN_SYM(quantiles);
+    (void)BGEN_SYM(equal_range);
+    (void)BGEN_SYM(count_equal);
+    (void)BGEN_SYM(delete_one);
+    (void)BGEN_SYM(delete_all);
     (void)BGEN_SYM(contains);
+    (void)BGEN_SYM(insert_adds);
     (void)BGEN_SYM(delete);
     (void)BGEN_SYM(get_at);
     (void)BGEN_SYM(insert_at);
     (void)BGEN_SYM(delete_at);
+    (void)BGEN_SYM(insert_run_at);
+    (void)BGEN_SYM(delete_run_at);
     (void)BGEN_SYM(replace_at);
     (void)BGEN_SYM(count);
     (void)BGEN_SYM(height);
     (void)BGEN_SYM(clear);
+    (void)BGEN_SYM(spare_alloc);
+    (void)BGEN_SYM(spare_free);
     (void)BGEN_SYM(sane);
     (void)BGEN_SYM(front);
     (void)BGEN_SYM(front_mut);
@@ -4671,9 +8465,14 @@ static inline void BGEN_SYM(all_sym_calls)(void) {
     (void)BGEN_SYM(clone);
     (void)BGEN_SYM(compare);
     (void)BGEN_SYM(less);
+    (void)BGEN_SYM(inorder);
     (void)BGEN_SYM(iter_init);
     (void)BGEN_SYM(iter_init_mut);
+    (void)BGEN_SYM(iter_size);
+    (void)BGEN_SYM(iter_init_inplace);
+    (void)BGEN_SYM(iter_init_inplace_mut);
     (void)BGEN_SYM(iter_release);
+    (void)BGEN_SYM(iter_reserve);
     (void)BGEN_SYM(iter_valid);
     (void)BGEN_SYM(iter_status);
     (void)BGEN_SYM(iter_seek);
@@ -4682,13 +8481,30 @@ static inline void BGEN_SYM(all_sym_calls)(void) {
     (void)BGEN_SYM(iter_scan_desc);
     (void)BGEN_SYM(iter_intersects);
     (void)BGEN_SYM(iter_nearby);
+    (void)BGEN_SYM(iter_nearby_within);
     (void)BGEN_SYM(iter_seek_at);
+    (void)BGEN_SYM(iter_advance);
     (void)BGEN_SYM(iter_seek_at_desc);
     (void)BGEN_SYM(iter_next);
+    (void)BGEN_SYM(iter_set_stable);
+    (void)BGEN_SYM(iter_replace);
+    (void)BGEN_SYM(iter_delete);
+    (void)BGEN_SYM(retain_if);
+    (void)BGEN_SYM(update);
+#ifndef BGEN_MULTI
+    (void)BGEN_SYM(update_fn);
+#endif
+    (void)BGEN_SYM(iter_cow_delete);
+    (void)BGEN_SYM(iter_index);
+    (void)BGEN_SYM(iter_next_batch);
+    (void)BGEN_SYM(iter_next_span);
     (void)BGEN_SYM(iter_item);
+    (void)BGEN_SYM(iter_item0);
+    (void)BGEN_SYM(iter_settle);
     (void)BGEN_SYM(intersects);
     (void)BGEN_SYM(scan);
     (void)BGEN_SYM(scan_desc);
+    (void)BGEN_SYM(scan_spans);
     (void)BGEN_SYM(seek);
     (void)BGEN_SYM(seek_at);
     (void)BGEN_SYM(seek_at_desc);
@@ -4698,13 +8514,38 @@ static inline void BGEN_SYM(all_sym_calls)(void) {
     (void)BGEN_SYM(seek_mut);
     (void)BGEN_SYM(seek_desc_mut);
     (void)BGEN_SYM(intersects_mut);
+    (void)BGEN_SYM(intersects_many);
+    (void)BGEN_SYM(spatial_join);
     (void)BGEN_SYM(nearby);
     (void)BGEN_SYM(nearby_mut);
+    (void)BGEN_SYM(nearby_within);
+    (void)BGEN_SYM(nearby_within_mut);
+    (void)BGEN_SYM(nearest_k);
+    (void)BGEN_SYM(augment);
+    (void)BGEN_SYM(augment_find);
+    (void)BGEN_SYM(aggregate_range);
     (void)BGEN_SYM(seek_at_mut);
     (void)BGEN_SYM(seek_at_desc_mut);
     (void)BGEN_SYM(rect);
     (void)BGEN_SYM(scan_rects);
     (void)BGEN_SYM(shared);
+    (void)BGEN_SYM(tree_init);
+    (void)BGEN_SYM(tree_release);
+    (void)BGEN_SYM(tree_root);
+    (void)BGEN_SYM(tree_front);
+    (void)BGEN_SYM(tree_back);
+    (void)BGEN_SYM(tree_pop_front);
+    (void)BGEN_SYM(tree_pop_back);
+    (void)BGEN_SYM(tree_push_front);
+    (void)BGEN_SYM(tree_push_back);
+    (void)BGEN_SYM(tree_get);
+    (void)BGEN_SYM(tree_contains);
+    (void)BGEN_SYM(tree_insert);
+    (void)BGEN_SYM(tree_delete);
+    (void)BGEN_SYM(tree_count);
+    (void)BGEN_SYM(tree_height);
+    (void)BGEN_SYM(tree_version);
+    (void)BGEN_SYM(tree_stats);
 }
 
 static inline void BGEN_SYM(all_api_calls)(void) {
@@ -4726,13 +8567,26 @@ static inline void BGEN_SYM(all_api_calls)(void) {
     (void)BGEN_API(get_mut_ref);
     (void)BGEN_API(get_at_mut);
     (void)BGEN_API(insert);
+    (void)BGEN_API(upsert);
     (void)BGEN_API(get);
     (void)BGEN_API(index_of);    
+    (void)BGEN_API(rank);
+    (void)BGEN_API(count_range);
+    (void)BGEN_API(quantiles);
+    (void)BGEN_API(equal_range);
+    (void)BGEN_API(count_equal);
+    (void)BGEN_API(delete_one);
+    (void)BGEN_API(delete_all);
+    (void)BGEN_API(augment);
+    (void)BGEN_API(augment_find);
+    (void)BGEN_API(aggregate_range);
     (void)BGEN_API(contains);
     (void)BGEN_API(delete);
     (void)BGEN_API(get_at);
     (void)BGEN_API(insert_at);
     (void)BGEN_API(delete_at);
+    (void)BGEN_API(insert_run_at);
+    (void)BGEN_API(delete_run_at);
     (void)BGEN_API(replace_at);
     (void)BGEN_API(count);
     (void)BGEN_API(height);
@@ -4752,7 +8606,11 @@ static inline void BGEN_SYM(all_api_calls)(void) {
     (void)BGEN_API(less);
     (void)BGEN_API(iter_init);
     (void)BGEN_API(iter_init_mut);
+    (void)BGEN_API(iter_size);
+    (void)BGEN_API(iter_init_inplace);
+    (void)BGEN_API(iter_init_inplace_mut);
     (void)BGEN_API(iter_release);
+    (void)BGEN_API(iter_reserve);
     (void)BGEN_API(iter_valid);
     (void)BGEN_API(iter_status);
     (void)BGEN_API(iter_seek);
@@ -4761,12 +8619,22 @@ static inline void BGEN_SYM(all_api_calls)(void) {
     (void)BGEN_API(iter_scan_desc);
     (void)BGEN_API(iter_intersects);
     (void)BGEN_API(iter_nearby);
+    (void)BGEN_API(iter_nearby_within);
     (void)BGEN_API(iter_seek_at);
+    (void)BGEN_API(iter_advance);
     (void)BGEN_API(iter_seek_at_desc);
     (void)BGEN_API(iter_next);
+    (void)BGEN_API(iter_set_stable);
+    (void)BGEN_API(iter_replace);
+    (void)BGEN_API(iter_delete);
+    (void)BGEN_API(retain_if);
+    (void)BGEN_API(update);
+    (void)BGEN_API(iter_next_batch);
+    (void)BGEN_API(iter_next_span);
     (void)BGEN_API(iter_item);
     (void)BGEN_API(scan);
     (void)BGEN_API(scan_desc);
+    (void)BGEN_API(scan_spans);
     (void)BGEN_API(seek);
     (void)BGEN_API(seek_at);
     (void)BGEN_API(seek_at_desc);
@@ -4777,11 +8645,33 @@ static inline void BGEN_SYM(all_api_calls)(void) {
     (void)BGEN_API(seek_mut);
     (void)BGEN_API(seek_desc_mut);
     (void)BGEN_API(intersects_mut);
+    (void)BGEN_API(intersects_many);
+    (void)BGEN_API(spatial_join);
     (void)BGEN_API(nearby);
     (void)BGEN_API(nearby_mut);
+    (void)BGEN_API(nearby_within);
+    (void)BGEN_API(nearby_within_mut);
+    (void)BGEN_API(nearest_k);
     (void)BGEN_API(seek_at_mut);
     (void)BGEN_API(seek_at_desc_mut);
     (void)BGEN_API(rect);
+    (void)BGEN_API(tree_init);
+    (void)BGEN_API(tree_release);
+    (void)BGEN_API(tree_root);
+    (void)BGEN_API(tree_front);
+    (void)BGEN_API(tree_back);
+    (void)BGEN_API(tree_pop_front);
+    (void)BGEN_API(tree_pop_back);
+    (void)BGEN_API(tree_push_front);
+    (void)BGEN_API(tree_push_back);
+    (void)BGEN_API(tree_get);
+    (void)BGEN_API(tree_contains);
+    (void)BGEN_API(tree_insert);
+    (void)BGEN_API(tree_delete);
+    (void)BGEN_API(tree_count);
+    (void)BGEN_API(tree_height);
+    (void)BGEN_API(tree_version);
+    (void)BGEN_API(tree_stats);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -4839,6 +8729,18 @@ void BGEN_API(clear)(BGEN_NODE **root, void *udata) {
     BGEN_SYM(clear)(root, udata);
 }
 
+int BGEN_API(retain_if)(BGEN_NODE **root,
+    bool(*pred)(BGEN_ITEM item, void *udata), void *udata)
+{
+    return BGEN_SYM(retain_if)(root, pred, udata);
+}
+
+int BGEN_API(update)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM item,
+    BGEN_ITEM *item_out, void *udata)
+{
+    return BGEN_SYM(update)(root, key, item, item_out, udata);
+}
+
 bool BGEN_API(sane)(BGEN_NODE **root, void *udata) {
     return BGEN_SYM(sane)(root, udata);
 }
@@ -4857,6 +8759,61 @@ int BGEN_API(index_of)(BGEN_NODE **root, BGEN_ITEM key, size_t *index,
     return BGEN_SYM(index_of)(root, key, index, udata);
 }
 
+int BGEN_API(rank)(BGEN_NODE **root, BGEN_ITEM key, size_t *rank,
+    void *udata)
+{
+    return BGEN_SYM(rank)(root, key, rank, udata);
+}
+
+size_t BGEN_API(count_range)(BGEN_NODE **root, BGEN_ITEM lo, BGEN_ITEM hi,
+    void *udata)
+{
+    return BGEN_SYM(count_range)(root, lo, hi, udata);
+}
+
+int BGEN_API(quantiles)(BGEN_NODE **root, double *ps, size_t n,
+    BGEN_ITEM *items_out, void *udata)
+{
+    return BGEN_SYM(quantiles)(root, ps, n, items_out, udata);
+}
+
+int BGEN_API(equal_range)(BGEN_NODE **root, BGEN_ITEM key, size_t *start,
+    size_t *end, void *udata)
+{
+    return BGEN_SYM(equal_range)(root, key, start, end, udata);
+}
+
+size_t BGEN_API(count_equal)(BGEN_NODE **root, BGEN_ITEM key, void *udata) {
+    return BGEN_SYM(count_equal)(root, key, udata);
+}
+
+int BGEN_API(delete_one)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM *item_out,
+    void *udata)
+{
+    return BGEN_SYM(delete_one)(root, key, item_out, udata);
+}
+
+int BGEN_API(delete_all)(BGEN_NODE **root, BGEN_ITEM key, void *udata) {
+    return BGEN_SYM(delete_all)(root, key, udata);
+}
+
+int BGEN_API(augment)(BGEN_NODE **root, BGEN_AUGTYPE *aug_out, void *udata) {
+    return BGEN_SYM(augment)(root, aug_out, udata);
+}
+
+int BGEN_API(augment_find)(BGEN_NODE **root, 
+    bool(*pred)(BGEN_AUGTYPE aug, void *udata), BGEN_ITEM *item_out, 
+    BGEN_AUGTYPE *aug_out, void *udata)
+{
+    return BGEN_SYM(augment_find)(root, pred, item_out, aug_out, udata);
+}
+
+int BGEN_API(aggregate_range)(BGEN_NODE **root, BGEN_ITEM lo, BGEN_ITEM hi,
+    BGEN_AUGTYPE *aug_out, void *udata)
+{
+    return BGEN_SYM(aggregate_range)(root, lo, hi, aug_out, udata);
+}
+
 int BGEN_API(get)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM *item_out,
     void *udata)
 {
@@ -4891,6 +8848,12 @@ int BGEN_API(delete)(BGEN_NODE **root, BGEN_ITEM key, BGEN_ITEM *olditem,
     return BGEN_SYM(delete)(root, key, olditem, udata);
 }
 
+int BGEN_API(upsert)(BGEN_NODE **root, BGEN_ITEM key,
+    void(*fn)(BGEN_ITEM *item, bool exists, void *udata), void *udata)
+{
+    return BGEN_SYM(upsert)(root, key, fn, udata);
+}
+
 int BGEN_API(front)(BGEN_NODE **root, BGEN_ITEM *item_out, void *udata) {
     return BGEN_SYM(front)(root, item_out, udata);
 }
@@ -4953,6 +8916,18 @@ int BGEN_API(insert_at)(BGEN_NODE **root, size_t index, BGEN_ITEM item,
     return BGEN_SYM(insert_at)(root, index, item, udata);
 }
 
+int BGEN_API(insert_run_at)(BGEN_NODE **root, size_t index, BGEN_ITEM *items,
+    size_t nitems, void *udata)
+{
+    return BGEN_SYM(insert_run_at)(root, index, items, nitems, udata);
+}
+
+int BGEN_API(delete_run_at)(BGEN_NODE **root, size_t index, size_t nitems,
+    BGEN_ITEM *items_out, void *udata)
+{
+    return BGEN_SYM(delete_run_at)(root, index, nitems, items_out, udata);
+}
+
 int BGEN_API(copy)(BGEN_NODE **root, BGEN_NODE **newroot, void *udata) {
     return BGEN_SYM(copy)(root, newroot, udata);
 }
@@ -4977,6 +8952,22 @@ void BGEN_API(iter_init_mut)(BGEN_NODE **root, BGEN_ITER **iter, void *udata) {
     BGEN_SYM(iter_init_mut)(root, iter, udata);
 }
 
+size_t BGEN_API(iter_size)(void) {
+    return BGEN_SYM(iter_size)();
+}
+
+BGEN_ITER *BGEN_API(iter_init_inplace)(BGEN_NODE **root, void *mem, 
+    void *udata)
+{
+    return BGEN_SYM(iter_init_inplace)(root, mem, udata);
+}
+
+BGEN_ITER *BGEN_API(iter_init_inplace_mut)(BGEN_NODE **root, void *mem,
+    void *udata)
+{
+    return BGEN_SYM(iter_init_inplace_mut)(root, mem, udata);
+}
+
 int BGEN_API(iter_status)(BGEN_ITER *iter) {
     return BGEN_SYM(iter_status)(iter);
 }
@@ -4989,6 +8980,10 @@ void BGEN_API(iter_release)(BGEN_ITER *iter) {
     BGEN_SYM(iter_release)(iter);
 }
 
+int BGEN_API(iter_reserve)(BGEN_ITER *iter, size_t cap) {
+    return BGEN_SYM(iter_reserve)(iter, cap);
+}
+
 void BGEN_API(iter_seek)(BGEN_ITER *iter, BGEN_ITEM key) {
     BGEN_SYM(iter_seek)(iter, key);
 }
@@ -4997,6 +8992,10 @@ void BGEN_API(iter_seek_at)(BGEN_ITER *iter, size_t index) {
     BGEN_SYM(iter_seek_at)(iter, index);
 }
 
+void BGEN_API(iter_advance)(BGEN_ITER *iter, ptrdiff_t delta) {
+    BGEN_SYM(iter_advance)(iter, delta);
+}
+
 void BGEN_API(iter_seek_at_desc)(BGEN_ITER *iter, size_t index) {
     BGEN_SYM(iter_seek_at_desc)(iter, index);
 }
@@ -5026,10 +9025,41 @@ void BGEN_API(iter_nearby)(BGEN_ITER *iter, void *target,
     BGEN_SYM(iter_nearby)(iter, target, dist);
 }
 
+void BGEN_API(iter_nearby_within)(BGEN_ITER *iter, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS],
+    void *target, void *udata), BGEN_RTYPE maxdist)
+{
+    BGEN_SYM(iter_nearby_within)(iter, target, dist, maxdist);
+}
+
 void BGEN_API(iter_next)(BGEN_ITER *iter) {
     BGEN_SYM(iter_next)(iter);
 }
 
+void BGEN_API(iter_set_stable)(BGEN_ITER *iter, bool stable) {
+    BGEN_SYM(iter_set_stable)(iter, stable);
+}
+
+int BGEN_API(iter_replace)(BGEN_ITER *iter, BGEN_ITEM item, 
+    BGEN_ITEM *olditem)
+{
+    return BGEN_SYM(iter_replace)(iter, item, olditem);
+}
+
+int BGEN_API(iter_delete)(BGEN_ITER *iter, BGEN_ITEM *olditem) {
+    return BGEN_SYM(iter_delete)(iter, olditem);
+}
+
+size_t BGEN_API(iter_next_batch)(BGEN_ITER *iter, BGEN_ITEM *items_out,
+    size_t max)
+{
+    return BGEN_SYM(iter_next_batch)(iter, items_out, max);
+}
+
+int BGEN_API(iter_next_span)(BGEN_ITER *iter, const BGEN_SYM(item_t) **items) {
+    return BGEN_SYM(iter_next_span)(iter, items);
+}
+
 void BGEN_API(iter_item)(BGEN_ITER *iter, BGEN_ITEM *item) {
     BGEN_SYM(iter_item)(iter, item);
 }
@@ -5046,6 +9076,13 @@ int BGEN_API(scan_desc)(BGEN_NODE **root, bool(*iter)(BGEN_ITEM item,
     return BGEN_SYM(scan_desc)(root, iter, udata);
 }
 
+int BGEN_API(scan_spans)(BGEN_NODE **root,
+    bool(*iter)(const BGEN_SYM(item_t) *items, int count, void *udata),
+    void *udata)
+{
+    return BGEN_SYM(scan_spans)(root, iter, udata);
+}
+
 int BGEN_API(seek)(BGEN_NODE **root, BGEN_ITEM key, bool(*iter)(BGEN_ITEM item,
     void *udata), void *udata)
 {
@@ -5120,6 +9157,19 @@ int BGEN_API(intersects_mut)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
     return BGEN_SYM(intersects_mut)(root, min, max, iter, udata);
 }
 
+int BGEN_API(intersects_many)(BGEN_NODE **root,
+    BGEN_RTYPE min[][BGEN_DIMS], BGEN_RTYPE max[][BGEN_DIMS], size_t n,
+    bool(*iter)(size_t index, BGEN_ITEM item, void *udata), void *udata)
+{
+    return BGEN_SYM(intersects_many)(root, min, max, n, iter, udata);
+}
+
+int BGEN_API(spatial_join)(BGEN_NODE **root, BGEN_NODE **other,
+    bool(*iter)(BGEN_ITEM a, BGEN_ITEM b, void *udata), void *udata)
+{
+    return BGEN_SYM(spatial_join)(root, other, iter, udata);
+}
+
 int BGEN_API(nearby)(BGEN_NODE **root, void *target,
     BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
     void *target, void *udata), bool(*iter)(BGEN_ITEM item, void *udata), 
@@ -5136,6 +9186,31 @@ int BGEN_API(nearby_mut)(BGEN_NODE **root, void *target,
     return BGEN_SYM(nearby_mut)(root, target, dist, iter, udata);
 }
 
+int BGEN_API(nearby_within)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata)
+{
+    return BGEN_SYM(nearby_within)(root, target, dist, maxdist, iter, udata);
+}
+
+int BGEN_API(nearby_within_mut)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), BGEN_RTYPE maxdist,
+    bool(*iter)(BGEN_ITEM item, void *udata), void *udata)
+{
+    return BGEN_SYM(nearby_within_mut)(root, target, dist, maxdist, iter, 
+        udata);
+}
+
+size_t BGEN_API(nearest_k)(BGEN_NODE **root, void *target,
+    BGEN_RTYPE(*dist)(BGEN_RTYPE min[BGEN_DIMS], BGEN_RTYPE max[BGEN_DIMS], 
+    void *target, void *udata), size_t k, BGEN_ITEM items[], 
+    BGEN_RTYPE dists[], void *udata)
+{
+    return BGEN_SYM(nearest_k)(root, target, dist, k, items, dists, udata);
+}
+
 /// Returns the minimum bounding rectangle for a spatial B-tree.
 void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS], 
     BGEN_RTYPE max[BGEN_DIMS], void *udata)
@@ -5143,6 +9218,84 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
     BGEN_SYM(rect)(root, min, max, udata);
 }
 
+void BGEN_API(tree_init)(BGEN_TREE **tree, void *udata) {
+    BGEN_SYM(tree_init)(tree, udata);
+}
+
+void BGEN_API(tree_release)(BGEN_TREE *tree, void *udata) {
+    BGEN_SYM(tree_release)(tree, udata);
+}
+
+BGEN_NODE **BGEN_API(tree_root)(BGEN_TREE *tree) {
+    return BGEN_SYM(tree_root)(tree);
+}
+
+int BGEN_API(tree_front)(BGEN_TREE *tree, BGEN_ITEM *item_out, void *udata) {
+    return BGEN_SYM(tree_front)(tree, item_out, udata);
+}
+
+int BGEN_API(tree_back)(BGEN_TREE *tree, BGEN_ITEM *item_out, void *udata) {
+    return BGEN_SYM(tree_back)(tree, item_out, udata);
+}
+
+int BGEN_API(tree_pop_front)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata)
+{
+    return BGEN_SYM(tree_pop_front)(tree, item_out, udata);
+}
+
+int BGEN_API(tree_pop_back)(BGEN_TREE *tree, BGEN_ITEM *item_out,
+    void *udata)
+{
+    return BGEN_SYM(tree_pop_back)(tree, item_out, udata);
+}
+
+int BGEN_API(tree_push_front)(BGEN_TREE *tree, BGEN_ITEM item, void *udata) {
+    return BGEN_SYM(tree_push_front)(tree, item, udata);
+}
+
+int BGEN_API(tree_push_back)(BGEN_TREE *tree, BGEN_ITEM item, void *udata) {
+    return BGEN_SYM(tree_push_back)(tree, item, udata);
+}
+
+int BGEN_API(tree_get)(BGEN_TREE *tree, BGEN_ITEM key, BGEN_ITEM *item_out,
+    void *udata)
+{
+    return BGEN_SYM(tree_get)(tree, key, item_out, udata);
+}
+
+bool BGEN_API(tree_contains)(BGEN_TREE *tree, BGEN_ITEM key, void *udata) {
+    return BGEN_SYM(tree_contains)(tree, key, udata);
+}
+
+int BGEN_API(tree_insert)(BGEN_TREE *tree, BGEN_ITEM item, 
+    BGEN_ITEM *item_out, void *udata)
+{
+    return BGEN_SYM(tree_insert)(tree, item, item_out, udata);
+}
+
+int BGEN_API(tree_delete)(BGEN_TREE *tree, BGEN_ITEM key, 
+    BGEN_ITEM *item_out, void *udata)
+{
+    return BGEN_SYM(tree_delete)(tree, key, item_out, udata);
+}
+
+size_t BGEN_API(tree_count)(BGEN_TREE *tree, void *udata) {
+    return BGEN_SYM(tree_count)(tree, udata);
+}
+
+size_t BGEN_API(tree_height)(BGEN_TREE *tree, void *udata) {
+    return BGEN_SYM(tree_height)(tree, udata);
+}
+
+size_t BGEN_API(tree_version)(BGEN_TREE *tree) {
+    return BGEN_SYM(tree_version)(tree);
+}
+
+void BGEN_API(tree_stats)(BGEN_TREE *tree, size_t *hits, size_t *misses) {
+    BGEN_SYM(tree_stats)(tree, hits, misses);
+}
+
 #endif // BGEN_HEADER
 
 // undefine everything
@@ -5156,6 +9309,7 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
 #undef BGEN_ASSERT
 #undef BGEN_MINITEMS
 #undef BGEN_NOINLINE
+#undef BGEN_PREFETCH
 #undef BGEN_DIMS
 #undef BGEN_FREE
 #undef BGEN_ITEM
@@ -5171,6 +9325,7 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
 #undef BGEN_MAP
 #undef BGEN_SYM
 #undef BGEN_UNSUPPORTED
+#undef BGEN_OVERFLOW
 #undef BGEN_POPBACK
 #undef BGEN_INSERTED
 #undef BGEN_ITEMCOPY
@@ -5195,6 +9350,7 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
 #undef BGEN_LINEAR
 #undef BGEN_MALLOC
 #undef BGEN_PQUEUE
+#undef BGEN_KNN
 #undef BGEN_BTREE
 #undef BGEN_DELAT
 #undef BGEN_DSIZE
@@ -5217,10 +9373,21 @@ void BGEN_API(rect)(BGEN_NODE **root, BGEN_RTYPE min[BGEN_DIMS],
 #undef BGEN_FANOUT
 #undef BGEN_INLINE
 #undef BGEN_ITER
+#undef BGEN_TREE
 #undef BGEN_LESS
 #undef BGEN_NAME
 #undef BGEN_COMPARE
 #undef BGEN_COUNTED
+#undef BGEN_COUNTTYPE
+#undef BGEN_AUGMENT
+#undef BGEN_AUGTYPE
+#undef BGEN_AUGITEM
+#undef BGEN_AUGCOMBINE
+#undef BGEN_COUNTCHECK
+#undef BGEN_PREFIXCOUNTS
+#undef BGEN_DEQUE
+#undef BGEN_HEADROOM
+#undef BGEN_MULTI
 #undef BGEN_FOUND
 #undef BGEN_INSAT
 #undef BGEN_MAYBELESSEQUAL
@@ -2,7 +2,9 @@
 #include "testutils.h"
 
 
+#ifndef M
 #define M 16
+#endif
 
 int N = 1000000;
 int G = 50;
@@ -10,12 +12,16 @@ int C = 0;        // -1 = worse-case, 0 = average, +1 = best-case
 
 // #define COW
 // #define COUNTED
+// #define PREFIXCOUNTS
+// #define COUNT32
+// #define AUGMENT
 // #define SPATIAL
 // #define NOATOMIC
 // #define BSEARCH
 // #define NOPATHHINT
 // #define PATHHINT
 // #define USECOMPARE
+// #define DEQUE
 
 #define BGEN_NAME      kv
 #define BGEN_TYPE      int
@@ -27,9 +33,21 @@ int C = 0;        // -1 = worse-case, 0 = average, +1 = best-case
 #ifdef COUNTED
 #define BGEN_COUNTED
 #endif
+#ifdef PREFIXCOUNTS
+#define BGEN_PREFIXCOUNTS
+#endif
+#ifdef COUNT32
+#define BGEN_COUNTTYPE uint32_t
+#endif
 #ifdef SPATIAL
 #define BGEN_SPATIAL
 #endif
+#ifdef AUGMENT
+#define BGEN_AUGMENT
+#define BGEN_AUGTYPE    long long
+#define BGEN_AUGITEM    return item;
+#define BGEN_AUGCOMBINE return a + b;
+#endif
 #ifdef NOATOMIC
 #define BGEN_NOATOMIC
 #endif
@@ -42,6 +60,9 @@ int C = 0;        // -1 = worse-case, 0 = average, +1 = best-case
 #ifdef USEPATHHINT
 #define BGEN_PATHHINT
 #endif
+#ifdef DEQUE
+#define BGEN_DEQUE
+#endif
 #define BGEN_FANOUT M
 // #define BGEN_ITEMRECT  { min[0] = item; min[1] = item; max[0] = item; max[1] = item; }
 #ifdef USECOMPARE
@@ -51,12 +72,91 @@ int C = 0;        // -1 = worse-case, 0 = average, +1 = best-case
 #endif
 #include "../bgen.h"
 
+// A priority queue of graph vertices, ordered by their distances.
+struct vdist {
+    int dist;
+    int vertex;
+};
+
+#define BGEN_NAME      pq
+#define BGEN_TYPE      struct vdist
+#define BGEN_MALLOC    return malloc0(size);
+#define BGEN_FREE      free0(ptr);
+#define BGEN_FANOUT    M
+#define BGEN_LESS      { return a.dist < b.dist || \
+                         (a.dist == b.dist && a.vertex < b.vertex); }
+#include "../bgen.h"
+
 static bool iter_scan(int item, void *udata) {
     double *sum = udata;
     (*sum) += item;
     return true;
 }
 
+static bool iter_scan_spans(const int *items, int count, void *udata) {
+    double *sum = udata;
+    for (int i = 0; i < count; i++) {
+        (*sum) += items[i];
+    }
+    return true;
+}
+
+static void upsert_fn(int *item, bool exists, void *udata) {
+    (void)item, (void)exists, (void)udata;
+}
+
+static bool retain_fn(int item, void *udata) {
+    (void)udata;
+    return item%20 != 0;
+}
+
+// Returns the sum of the shortest distances from the first vertex of a grid
+// graph, where the distance of a vertex that is already in the queue is
+// lowered using delete+insert, or using update.
+static long long dijkstra(int side, const int *wright, const int *wdown,
+    int *dist, bool update)
+{
+    for (int v = 0; v < side*side; v++) {
+        dist[v] = -1;
+    }
+    struct pq *queue = 0;
+    dist[0] = 0;
+    assert(pq_insert(&queue, (struct vdist){ 0, 0 }, 0, 0) == pq_INSERTED);
+    long long sum = 0;
+    struct vdist top;
+    while (pq_pop_front(&queue, &top, 0) == pq_DELETED) {
+        int u = top.vertex;
+        sum += top.dist;
+        int x = u%side;
+        int y = u/side;
+        int nbrs[4], weights[4], n = 0;
+        if (x > 0) { nbrs[n] = u-1; weights[n++] = wright[u-1]; }
+        if (x < side-1) { nbrs[n] = u+1; weights[n++] = wright[u]; }
+        if (y > 0) { nbrs[n] = u-side; weights[n++] = wdown[u-side]; }
+        if (y < side-1) { nbrs[n] = u+side; weights[n++] = wdown[u]; }
+        for (int i = 0; i < n; i++) {
+            int v = nbrs[i];
+            struct vdist item = { top.dist+weights[i], v };
+            if (dist[v] == -1) {
+                assert(pq_insert(&queue, item, 0, 0) == pq_INSERTED);
+            } else if (item.dist < dist[v]) {
+                struct vdist key = { dist[v], v };
+                if (update) {
+                    assert(pq_update(&queue, key, item, 0, 0) ==
+                        pq_REPLACED);
+                } else {
+                    assert(pq_delete(&queue, key, 0, 0) == pq_DELETED);
+                    assert(pq_insert(&queue, item, 0, 0) == pq_INSERTED);
+                }
+            } else {
+                continue;
+            }
+            dist[v] = item.dist;
+        }
+    }
+    return sum;
+}
+
 #define reset_tree() { \
     kv_clear(&tree, 0); \
     shuffle(keys, N); \
@@ -195,6 +295,14 @@ int main(void) {
         }
     });
 
+    run_op("upsert(rand)", G, {
+        shuffle(keys, N);
+    },{
+        for (int i = 0; i < N; i++) {
+            assert(kv_upsert(&tree, keys[i], upsert_fn, 0) == kv_FOUND);
+        }
+    });
+
     if (kv_feat_cow()) {
         struct kv *tree2 = 0;
         run_op("reinsert-cow(rand)", G, {
@@ -226,6 +334,12 @@ int main(void) {
 
 
     if (kv_feat_counted()) {
+#ifdef COUNTED
+        // The tree is always fully loaded between operations.
+        printf("%-19s%10.2f bytes/item (%zu byte counts)\n", "memory", 
+            (double)mtotal/(double)N, sizeof(((struct kv*)0)->counts[0]));
+#endif
+
         run_op("get_at(seq)", G, {},{
             for (int i = 0; i < N; i++) {
                 assert(kv_get_at(&tree, i, &val, 0) == kv_FOUND);
@@ -241,6 +355,38 @@ int main(void) {
             }
         });
 
+        run_op("rank(rand)", G, {
+            shuffle(keys, N);
+        }, {
+            for (int i = 0; i < N; i++) {
+                size_t rank;
+                assert(kv_rank(&tree, keys[i]+1, &rank, 0) == kv_NOTFOUND);
+                assert(rank == (size_t)keys[i]/10+1);
+            }
+        });
+
+        run_op("count_range(rand)", G, {
+            shuffle(keys, N);
+        }, {
+            size_t sum = 0;
+            for (int i = 0; i < N; i++) {
+                sum += kv_count_range(&tree, keys[i], keys[i]+1000, 0);
+            }
+            assert(sum > 0);
+        });
+
+        double ps[4];
+        int items[4];
+        ps[0] = 0.5;
+        ps[1] = 0.9;
+        ps[2] = 0.99;
+        ps[3] = 0.999;
+        run_op("quantiles(4)", G, {}, {
+            for (int i = 0; i < N; i++) {
+                assert(kv_quantiles(&tree, ps, 4, items, 0) == kv_FOUND);
+            }
+        });
+
         run_op("delete_at(head)", G, {
             reset_tree();
         }, {
@@ -284,8 +430,45 @@ int main(void) {
             }
         });
         free(delidxs);
+
+        // Runs of 1000 items at a time.
+        run_op("insert_run_at(tail)", G, {
+            kv_clear(&tree, 0);
+            sort(keys, N);
+        }, {
+            for (int i = 0; i < N; i += 1000) {
+                int n = N-i < 1000 ? N-i : 1000;
+                assert(kv_insert_run_at(&tree, i, keys+i, n, 0) == 
+                    kv_INSERTED);
+            }
+        });
+
+        run_op("delete_run_at(rand)", G, {
+            reset_tree();
+        }, {
+            for (int i = 0; i < N; i += 1000) {
+                int n = N-i < 1000 ? N-i : 1000;
+                size_t index = rand()%(N-i-n+1);
+                assert(kv_delete_run_at(&tree, index, n, 0, 0) == kv_DELETED);
+            }
+        });
     }
 
+#ifdef AUGMENT
+    run_op("aggregate_range", G, {
+        shuffle(keys, N);
+    }, {
+        // sum of the 1000 items starting at each key
+        long long sum = 0;
+        for (int i = 0; i < N; i++) {
+            long long agg = 0;
+            kv_aggregate_range(&tree, keys[i], keys[i]+10000, &agg, 0);
+            sum += agg;
+        }
+        assert(sum > 0);
+    });
+#endif
+
     run_op("push_first", G, {
         kv_clear(&tree, 0);
         sort(keys, N);
@@ -320,6 +503,52 @@ int main(void) {
         }
     });
 
+    // A full queue that takes items from the front and adds to the back.
+    run_op("queue", G, {
+        reset_tree();
+    }, {
+        int next = N*10;
+        for (int i = 0; i < N; i++) {
+            assert(kv_pop_front(&tree, 0, 0) == kv_DELETED);
+            assert(kv_push_back(&tree, next, 0) == kv_INSERTED);
+            next += 10;
+        }
+    });
+
+    // The same queue using a tree header, which keeps the paths to the first
+    // and last leaves. The header is filled by itself, since handing out its
+    // root makes it check the paths on every use.
+    struct kv_tree *qt = 0;
+    run_op("queue(header)", G, {
+        kv_tree_release(qt, 0);
+        kv_tree_init(&qt, 0);
+        for (int i = 0; i < N; i++) {
+            assert(kv_tree_push_back(qt, i*10, 0) == kv_INSERTED);
+        }
+    }, {
+        int next = N*10;
+        for (int i = 0; i < N; i++) {
+            assert(kv_tree_pop_front(qt, 0, 0) == kv_DELETED);
+            assert(kv_tree_push_back(qt, next, 0) == kv_INSERTED);
+            next += 10;
+        }
+    });
+    kv_tree_release(qt, 0);
+
+    // Inserts by way of a tree header, which keeps the count up to date
+    // without the need for BGEN_COUNTED.
+    run_op("insert(header)", G, {
+        shuffle(keys, N);
+    }, {
+        struct kv_tree *t;
+        kv_tree_init(&t, 0);
+        for (int i = 0; i < N; i++) {
+            assert(kv_tree_insert(t, keys[i], 0, 0) == kv_INSERTED);
+            assert(kv_tree_count(t, 0) == (size_t)i+1);
+        }
+        kv_tree_release(t, 0);
+    });
+
     run_op("scan", G, {
         reset_tree();
     }, {
@@ -336,6 +565,14 @@ int main(void) {
         assert(asum == bsum);
     });
 
+    run_op("scan_spans", G, {
+        reset_tree();
+    }, {
+        double bsum = 0;
+        kv_scan_spans(&tree, iter_scan_spans, &bsum);
+        assert(asum == bsum);
+    });
+
     run_op("iter_scan", G, {
         reset_tree();
     }, {
@@ -370,5 +607,178 @@ int main(void) {
         assert(asum == bsum);
     });
 
+    run_op("iter_next_batch", G, {
+        reset_tree();
+    }, {
+        double bsum = 0;
+        int items[256];
+        struct kv_iter *iter;
+        kv_iter_init(&tree, &iter, 0);
+        kv_iter_scan(iter);
+        size_t n;
+        while ((n = kv_iter_next_batch(iter, items, 256)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                bsum += items[i];
+            }
+        }
+        kv_iter_release(iter);
+        assert(asum == bsum);
+    });
+
+    run_op("iter_next_span", G, {
+        reset_tree();
+    }, {
+        double bsum = 0;
+        const int *items;
+        struct kv_iter *iter;
+        kv_iter_init(&tree, &iter, 0);
+        kv_iter_scan(iter);
+        int n;
+        while ((n = kv_iter_next_span(iter, &items)) > 0) {
+            for (int i = 0; i < n; i++) {
+                bsum += items[i];
+            }
+        }
+        kv_iter_release(iter);
+        assert(asum == bsum);
+    });
+
+    // Scan and delete every other item as they are read, by seeking back to
+    // the deleted key, and with a stable cursor that finds its own place.
+    run_op("iter_seek(delete)", G, {
+        reset_tree();
+    }, {
+        struct kv_iter *iter;
+        kv_iter_init(&tree, &iter, 0);
+        kv_iter_scan(iter);
+        while (kv_iter_valid(iter)) {
+            kv_iter_item(iter, &val);
+            if (val%20 == 0) {
+                kv_delete(&tree, val, 0, 0);
+                kv_iter_seek(iter, val);
+            } else {
+                kv_iter_next(iter);
+            }
+        }
+        kv_iter_release(iter);
+    });
+
+    run_op("iter_stable(delete)", G, {
+        reset_tree();
+    }, {
+        struct kv_iter *iter;
+        kv_iter_init(&tree, &iter, 0);
+        kv_iter_set_stable(iter, true);
+        kv_iter_scan(iter);
+        while (kv_iter_valid(iter)) {
+            kv_iter_item(iter, &val);
+            if (val%20 == 0) {
+                kv_delete(&tree, val, 0, 0);
+            }
+            kv_iter_next(iter);
+        }
+        kv_iter_release(iter);
+    });
+
+    run_op("iter_delete", G, {
+        reset_tree();
+    }, {
+        struct kv_iter *iter;
+        kv_iter_init_mut(&tree, &iter, 0);
+        kv_iter_scan(iter);
+        while (kv_iter_valid(iter)) {
+            kv_iter_item(iter, &val);
+            if (val%20 == 0) {
+                kv_iter_delete(iter, 0);
+            } else {
+                kv_iter_next(iter);
+            }
+        }
+        kv_iter_release(iter);
+    });
+
+    run_op("retain_if", G, {
+        reset_tree();
+    }, {
+        kv_retain_if(&tree, retain_fn, 0);
+    });
+
+    // Short queries that seek and read three items, with an iterator that is
+    // allocated for each query, and with one that lives on the stack.
+    run_op("iter_seek3(heap)", G, {
+        shuffle(keys, N);
+    }, {
+        for (int i = 0; i < N; i++) {
+            struct kv_iter *iter;
+            kv_iter_init(&tree, &iter, 0);
+            kv_iter_seek(iter, keys[i]);
+            for (int j = 0; j < 3 && kv_iter_valid(iter); j++) {
+                kv_iter_item(iter, &val);
+                kv_iter_next(iter);
+            }
+            kv_iter_release(iter);
+        }
+    });
+
+    run_op("iter_seek3(stack)", G, {
+        shuffle(keys, N);
+    }, {
+        for (int i = 0; i < N; i++) {
+            struct kv_iter mem;
+            struct kv_iter *iter = kv_iter_init_inplace(&tree, &mem, 0);
+            kv_iter_seek(iter, keys[i]);
+            for (int j = 0; j < 3 && kv_iter_valid(iter); j++) {
+                kv_iter_item(iter, &val);
+                kv_iter_next(iter);
+            }
+            kv_iter_release(iter);
+        }
+    });
+
+    // Move every item by a little, which keeps most items in their leaves.
+    run_op("del+ins(near)", G, {
+        reset_tree();
+    }, {
+        for (int i = 0; i < N; i++) {
+            assert(kv_delete(&tree, keys[i], 0, 0) == kv_DELETED);
+            assert(kv_insert(&tree, keys[i]+5, 0, 0) == kv_INSERTED);
+        }
+    });
+
+    run_op("update(near)", G, {
+        reset_tree();
+    }, {
+        for (int i = 0; i < N; i++) {
+            assert(kv_update(&tree, keys[i], keys[i]+5, 0, 0) == kv_REPLACED);
+        }
+    });
+
+    // Shortest paths over a grid graph of about N vertices with random edge
+    // weights, using the btree as the priority queue.
+    int side = 1;
+    while ((side+1)*(side+1) <= N) {
+        side++;
+    }
+    int *wright = malloc(side*side*sizeof(int));
+    int *wdown = malloc(side*side*sizeof(int));
+    int *dist = malloc(side*side*sizeof(int));
+    assert(wright && wdown && dist);
+    for (int i = 0; i < side*side; i++) {
+        wright[i] = 1+rand()%100;
+        wdown[i] = 1+rand()%100;
+    }
+    long long dsum = dijkstra(side, wright, wdown, dist, false);
+
+    run_op("dijkstra(del+ins)", G, {}, {
+        assert(dijkstra(side, wright, wdown, dist, false) == dsum);
+    });
+
+    run_op("dijkstra(update)", G, {}, {
+        assert(dijkstra(side, wright, wdown, dist, true) == dsum);
+    });
+
+    free(dist);
+    free(wdown);
+    free(wright);
     return 0;
 }
@@ -170,6 +170,37 @@ bool iter_many(struct point point, void *udata) {
     return true;
 }
 
+bool iter_many_index(size_t index, struct point point, void *udata) {
+    (void)index;
+    return iter_many(point, udata);
+}
+
+static double box_dist(double min[], double max[], void *target, 
+    void *udata)
+{
+    (void)udata;
+    double *point = target;
+    double dist = 0;
+    for (int i = 0; i < 2; i++) {
+        double d = point[i] < min[i] ? min[i]-point[i] :
+                   point[i] > max[i] ? point[i]-max[i] : 0;
+        dist += d*d;
+    }
+    return dist;
+}
+
+struct nearbyctx {
+    int count;
+    int limit;
+};
+
+bool iter_nearby(struct point point, void *udata) {
+    (void)point;
+    struct nearbyctx *ctx = udata;
+    ctx->count++;
+    return ctx->count < ctx->limit;
+}
+
 int main(void) {
     if (getenv("N")) {
         N = atoi(getenv("N"));
@@ -299,6 +330,51 @@ int main(void) {
     });
     // printf("%d\n", sum);
 
+    static double mins[1000][2];
+    static double maxs[1000][2];
+    sum = 0;
+    run_op("search-1%% (many)", 1000, G, {
+        for (int i = 0; i < 1000; i++) {
+            const double p = 0.01;
+            mins[i][0] = rand_double() * 360.0 - 180.0;
+            mins[i][1] = rand_double() * 180.0 - 90.0;
+            maxs[i][0] = mins[i][0] + 360.0*p;
+            maxs[i][1] = mins[i][1] + 180.0*p;
+        }
+    }, {
+        int res = 0;
+        kv_intersects_many(&tree, mins, maxs, 1000, iter_many_index, &res);
+        sum += res;
+    });
+    // printf("%d\n", sum);
+
+    printf("== nearest neighbors ==\n");
+    sum = 0;
+    run_op("nearby-10", 10000, G, {}, {
+        for (int i = 0; i < 10000; i++) {
+            double point[2];
+            point[0] = rand_double() * 360.0 - 180.0;
+            point[1] = rand_double() * 180.0 - 90.0;
+            struct nearbyctx ctx = { .limit = 10 };
+            kv_nearby(&tree, point, box_dist, iter_nearby, &ctx);
+            sum += ctx.count;
+        }
+    });
+    // printf("%d\n", sum);
+
+    sum = 0;
+    run_op("nearest_k-10", 10000, G, {}, {
+        for (int i = 0; i < 10000; i++) {
+            double point[2];
+            point[0] = rand_double() * 360.0 - 180.0;
+            point[1] = rand_double() * 180.0 - 90.0;
+            struct point items[10];
+            double dists[10];
+            sum += kv_nearest_k(&tree, point, box_dist, 10, items, dists, 0);
+        }
+    });
+    // printf("%d\n", sum);
+
     
 
     ///////////////////////////////////////////////////////////////////////////
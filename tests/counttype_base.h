@@ -0,0 +1,87 @@
+// Tests counted trees that use a small BGEN_COUNTTYPE.
+// The variants are in "test_counttype*.c".
+
+#include <stdint.h>
+#include "testutils.h"
+
+#define BGEN_NAME      kv
+#define BGEN_TYPE      int
+#define BGEN_COW
+#define BGEN_COUNTED
+#ifdef PREFIXCOUNTS
+#define BGEN_PREFIXCOUNTS
+#endif
+#define BGEN_COUNTTYPE uint8_t
+#define BGEN_ASSERT
+#define BGEN_FANOUT    4
+#define BGEN_MALLOC    return malloc0(size);
+#define BGEN_FREE      free0(ptr);
+#define BGEN_LESS      return a < b;
+#include "../bgen.h"
+
+void upsert_fn(int *item, bool exists, void *udata) {
+    (void)item, (void)exists, (void)udata;
+}
+
+// An uint8_t count allows for up to 254 items in the tree.
+#define MAXCOUNT 254
+
+void test_counttype_full(void) {
+    testinit();
+    struct kv *tree = 0;
+    int n = 0;
+    while (1) {
+        int ret = kv_insert(&tree, n*10, 0, 0);
+        if (ret == kv_OVERFLOW) {
+            break;
+        }
+        assert(ret == kv_INSERTED);
+        n++;
+    }
+    assert(n == MAXCOUNT);
+    assert(kv_count(&tree, 0) == MAXCOUNT);
+    assert(kv_sane(&tree, 0));
+    int val;
+    for (int i = 0; i < n; i++) {
+        assert(kv_get_at(&tree, i, &val, 0) == kv_FOUND);
+        assert(val == i*10);
+    }
+    // Adding an item overflows, but existing items can still be replaced.
+    assert(kv_insert(&tree, 5, &val, 0) == kv_OVERFLOW);
+    assert(kv_push_back(&tree, n*10, 0) == kv_OVERFLOW);
+    assert(kv_push_front(&tree, -10, 0) == kv_OVERFLOW);
+    assert(kv_insert_at(&tree, 1, 5, 0) == kv_OVERFLOW);
+    int run[] = { 5 };
+    assert(kv_insert_run_at(&tree, 1, run, 1, 0) == kv_OVERFLOW);
+    assert(kv_upsert(&tree, 5, upsert_fn, 0) == kv_OVERFLOW);
+    assert(kv_count(&tree, 0) == MAXCOUNT);
+    assert(kv_sane(&tree, 0));
+    for (int i = 0; i < n; i++) {
+        val = -1;
+        assert(kv_insert(&tree, i*10, &val, 0) == kv_REPLACED);
+        assert(val == i*10);
+    }
+    assert(kv_upsert(&tree, 10, upsert_fn, 0) == kv_FOUND);
+    assert(kv_replace_at(&tree, 1, 11, 0, 0) == kv_REPLACED);
+    assert(kv_delete_at(&tree, 1, 0, 0) == kv_DELETED);
+    assert(kv_insert_at(&tree, 1, 5, 0) == kv_INSERTED);
+    assert(kv_count(&tree, 0) == MAXCOUNT);
+    assert(kv_sane(&tree, 0));
+    for (int i = 0; i < n; i++) {
+        assert(kv_pop_front(&tree, 0, 0) == kv_DELETED);
+        assert(kv_sane(&tree, 0));
+    }
+    for (int i = 0; i < n; i++) {
+        assert(kv_push_back(&tree, i*10, 0) == kv_INSERTED);
+    }
+    assert(kv_push_back(&tree, n*10, 0) == kv_OVERFLOW);
+    assert(kv_sane(&tree, 0));
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+int main(void) {
+    initrand();
+    test_counttype_full();
+    return 0;
+}
@@ -0,0 +1,408 @@
+// Tests trees with duplicate keys using BGEN_MULTI.
+// The variants are in "test_multi*.c".
+
+#include "testutils.h"
+
+struct pair {
+    int key;
+    int seq;
+};
+
+#define BGEN_NAME      kv
+#define BGEN_TYPE      struct pair
+#define BGEN_MULTI
+#ifdef COW
+#define BGEN_COW
+#endif
+#ifdef COUNTED
+#define BGEN_COUNTED
+#endif
+#ifdef PREFIXCOUNTS
+#define BGEN_PREFIXCOUNTS
+#endif
+#ifdef LINEAR
+#define BGEN_LINEAR
+#else
+#define BGEN_BSEARCH
+#endif
+#define BGEN_ASSERT
+#define BGEN_FANOUT    4
+#define BGEN_MALLOC    return malloc0(size);
+#define BGEN_FREE      free0(ptr);
+#define BGEN_LESS      return a.key < b.key;
+#include "../bgen.h"
+
+#define NITEMS 2000
+#define NKEYS  50
+
+static struct pair ref[NITEMS+2];
+static int nref = 0;
+
+// Returns the index of the first ref item that is greater than or equal to
+// key, or greater than key when upper.
+static int ref_bound(int key, bool upper) {
+    int i = 0;
+    while (i < nref && (ref[i].key < key || (upper && ref[i].key == key))) {
+        i++;
+    }
+    return i;
+}
+
+// Inserts after the existing equals
+static void ref_insert(struct pair item) {
+    int i = ref_bound(item.key, true);
+    memmove(ref+i+1, ref+i, (nref-i)*sizeof(struct pair));
+    ref[i] = item;
+    nref++;
+}
+
+static void ref_delete(int i, int n) {
+    memmove(ref+i, ref+i+n, (nref-i-n)*sizeof(struct pair));
+    nref -= n;
+}
+
+static bool pair_first(struct pair item, void *udata) {
+    *(struct pair*)udata = item;
+    return false;
+}
+
+void test_multi_tree(void) {
+    testinit();
+    struct kv *tree = 0;
+    nref = 0;
+    for (int i = 0; i < NITEMS; i++) {
+        struct pair item = { rand() % NKEYS, i };
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+        ref_insert(item);
+    }
+    assert(kv_sane(&tree, 0));
+    assert(kv_count(&tree, 0) == (size_t)nref);
+    for (int i = 0; i < nref; i++) {
+        struct pair item;
+        assert(kv_get_at(&tree, i, &item, 0) == kv_FOUND);
+        assert(item.key == ref[i].key && item.seq == ref[i].seq);
+    }
+    for (int key = -1; key <= NKEYS; key++) {
+        struct pair pkey = { key, -1 };
+        int lo = ref_bound(key, false);
+        int hi = ref_bound(key, true);
+        size_t start, end, index;
+        int ret = kv_equal_range(&tree, pkey, &start, &end, 0);
+        assert(ret == (lo < hi ? kv_FOUND : kv_NOTFOUND));
+        assert(start == (size_t)lo && end == (size_t)hi);
+        assert(kv_count_equal(&tree, pkey, 0) == (size_t)(hi-lo));
+        ret = kv_rank(&tree, pkey, &index, 0);
+        assert(index == (size_t)lo);
+        if (lo == hi) {
+            assert(ret == kv_NOTFOUND);
+            assert(!kv_contains(&tree, pkey, 0));
+            continue;
+        }
+        assert(ret == kv_FOUND);
+        assert(kv_index_of(&tree, pkey, &index, 0) == kv_FOUND);
+        assert(index == (size_t)lo);
+        struct pair item;
+        assert(kv_get(&tree, pkey, &item, 0) == kv_FOUND);
+        assert(item.seq == ref[lo].seq);
+        assert(kv_seek(&tree, pkey, pair_first, &item) == kv_STOPPED);
+        assert(item.seq == ref[lo].seq);
+        assert(kv_seek_desc(&tree, pkey, pair_first, &item) ==
+            kv_STOPPED);
+        assert(item.seq == ref[hi-1].seq);
+        struct kv_iter *iter;
+        kv_iter_init(&tree, &iter, 0);
+        kv_iter_seek(iter, pkey);
+        for (int i = lo; i < hi; i++) {
+            assert(kv_iter_valid(iter));
+            kv_iter_item(iter, &item);
+            assert(item.seq == ref[i].seq);
+            kv_iter_next(iter);
+        }
+        kv_iter_seek_desc(iter, pkey);
+        for (int i = hi-1; i >= lo; i--) {
+            assert(kv_iter_valid(iter));
+            kv_iter_item(iter, &item);
+            assert(item.seq == ref[i].seq);
+            kv_iter_next(iter);
+        }
+        kv_iter_release(iter);
+    }
+    // equal items may be placed next to each other by index
+    struct pair item = ref[nref-1];
+    item.seq = NITEMS;
+    assert(kv_push_back(&tree, item, 0) == kv_INSERTED);
+    ref[nref++] = item;
+    item = ref[0];
+    item.seq = NITEMS+1;
+    assert(kv_push_front(&tree, item, 0) == kv_INSERTED);
+    memmove(ref+1, ref, nref*sizeof(struct pair));
+    ref[0] = item;
+    nref++;
+    item = ref[nref/2];
+    item.key++;
+    assert(kv_insert_at(&tree, nref/2, item, 0) == kv_OUTOFORDER);
+    assert(kv_sane(&tree, 0));
+    while (nref > 0) {
+        int key = ref[rand()%nref].key;
+        struct pair pkey = { key, -1 };
+        int lo = ref_bound(key, false);
+        int hi = ref_bound(key, true);
+        if (rand()%2 == 0) {
+            assert(kv_delete_one(&tree, pkey, &item, 0) == kv_DELETED);
+            assert(item.key == key && item.seq == ref[lo].seq);
+            ref_delete(lo, 1);
+        } else {
+            assert(kv_delete_all(&tree, pkey, 0) == kv_DELETED);
+            assert(kv_delete_all(&tree, pkey, 0) == kv_NOTFOUND);
+            ref_delete(lo, hi-lo);
+        }
+        assert(kv_count_equal(&tree, pkey, 0) ==
+            (size_t)(ref_bound(key, true)-ref_bound(key, false)));
+        assert(kv_count(&tree, 0) == (size_t)nref);
+        assert(kv_sane(&tree, 0));
+    }
+    for (int i = 0; i < nref; i++) {
+        assert(kv_get_at(&tree, i, &item, 0) == kv_FOUND);
+        assert(item.seq == ref[i].seq);
+    }
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+#ifdef COW
+void test_multi_clone(void) {
+    testinit();
+    struct kv *tree = 0;
+    for (int i = 0; i < NITEMS; i++) {
+        struct pair item = { i % 10, i };
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+    }
+    struct kv *tree2 = 0;
+    assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+    struct pair pkey = { 5, -1 };
+    assert(kv_delete_all(&tree2, pkey, 0) == kv_DELETED);
+    assert(kv_count_equal(&tree2, pkey, 0) == 0);
+    assert(kv_count_equal(&tree, pkey, 0) == NITEMS/10);
+    assert(kv_count(&tree2, 0) == NITEMS-NITEMS/10);
+    assert(kv_sane(&tree, 0));
+    assert(kv_sane(&tree2, 0));
+    kv_clear(&tree, 0);
+    kv_clear(&tree2, 0);
+    checkmem();
+}
+#endif
+
+void test_multi_update(void) {
+    testinit();
+    struct kv *tree = 0;
+    nref = 0;
+    for (int i = 0; i < NITEMS; i++) {
+        struct pair item = { rand() % NKEYS, i };
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+        ref_insert(item);
+    }
+    // The first item of a key is moved to after the equals of its new key.
+    for (int i = 0; i < NITEMS; i++) {
+        int lo = ref_bound(ref[rand()%nref].key, false);
+        struct pair pkey = { ref[lo].key, -1 };
+        struct pair item = { rand() % NKEYS, NITEMS+i };
+        struct pair old;
+        assert(kv_update(&tree, pkey, item, &old, 0) == kv_REPLACED);
+        assert(old.key == ref[lo].key && old.seq == ref[lo].seq);
+        ref_delete(lo, 1);
+        ref_insert(item);
+    }
+    assert(kv_sane(&tree, 0));
+    assert(kv_count(&tree, 0) == (size_t)nref);
+    for (int i = 0; i < nref; i++) {
+        struct pair item;
+        assert(kv_get_at(&tree, i, &item, 0) == kv_FOUND);
+        assert(item.key == ref[i].key && item.seq == ref[i].seq);
+    }
+    struct pair pkey = { NKEYS, -1 };
+    assert(kv_update(&tree, pkey, pkey, 0, 0) == kv_NOTFOUND);
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+// Many equal items per key, along with deletes, make the inserts of update
+// give items to a left sibling, which moves equal items over the old item.
+void test_multi_update_dups(void) {
+    testinit();
+    // A leaf with one item, then the old item (5,1) in the root, and a full
+    // leaf of its equals. The insert of (5,9) gives two items to the left
+    // leaf, which puts (5,3) in the place of the old item.
+    struct kv *tree = 0;
+    {
+        int keys[] = { 0, 5, 5, 5, 5 };
+        for (int i = 0; i < 5; i++) {
+            struct pair item = { keys[i], i };
+            assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+        }
+        assert(kv_height(&tree, 0) == 2);
+        struct pair pkey = { 5, -1 };
+        struct pair item = { 5, 9 };
+        struct pair old;
+        assert(kv_update(&tree, pkey, item, &old, 0) == kv_REPLACED);
+        assert(old.key == 5 && old.seq == 1);
+        int seqs[] = { 0, 2, 3, 4, 9 };
+        for (int i = 0; i < 5; i++) {
+            assert(kv_get_at(&tree, i, &item, 0) == kv_FOUND);
+            assert(item.seq == seqs[i]);
+        }
+        assert(kv_sane(&tree, 0));
+    }
+    kv_clear(&tree, 0);
+    nref = 0;
+    for (int i = 0; i < NITEMS; i++) {
+        struct pair item = { rand() % 4, i };
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+        ref_insert(item);
+    }
+    int seq = NITEMS;
+    for (int i = 0; i < NITEMS*4; i++) {
+        int lo = ref_bound(ref[rand()%nref].key, false);
+        struct pair pkey = { ref[lo].key, -1 };
+        struct pair item = { rand() % 4, seq++ };
+        struct pair old;
+        switch (rand()%4) {
+        case 0:
+            if (nref < NITEMS/2) {
+                break;
+            }
+            assert(kv_delete(&tree, pkey, &old, 0) == kv_DELETED);
+            assert(old.key == ref[lo].key && old.seq == ref[lo].seq);
+            ref_delete(lo, 1);
+            break;
+        case 1:
+            if (nref == NITEMS) {
+                break;
+            }
+            assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+            ref_insert(item);
+            break;
+        default:
+            assert(kv_update(&tree, pkey, item, &old, 0) == kv_REPLACED);
+            assert(old.key == ref[lo].key && old.seq == ref[lo].seq);
+            ref_delete(lo, 1);
+            ref_insert(item);
+        }
+    }
+    assert(kv_sane(&tree, 0));
+    assert(kv_count(&tree, 0) == (size_t)nref);
+    for (int i = 0; i < nref; i++) {
+        struct pair item;
+        assert(kv_get_at(&tree, i, &item, 0) == kv_FOUND);
+        assert(item.key == ref[i].key && item.seq == ref[i].seq);
+    }
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+static int visits[NITEMS];
+
+static bool retain_odd(struct pair item, void *udata) {
+    (void)udata;
+    visits[item.seq]++;
+    return item.seq%2 == 1;
+}
+
+// Deleting at the cursor of a mutable iterator moves it to the next item,
+// even when the delete rebalances and the next item is one of many equals.
+// Each item must be visited exactly once.
+void test_multi_iter_delete(void) {
+    testinit();
+    for (int desc = 0; desc < 2; desc++) {
+        struct kv *tree = 0;
+        for (int i = 0; i < NITEMS; i++) {
+            struct pair item = { i % 5, i };
+            assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+        }
+        memset(visits, 0, sizeof(visits));
+        struct kv_iter *iter;
+        kv_iter_init_mut(&tree, &iter, 0);
+        if (desc) {
+            kv_iter_scan_desc(iter);
+        } else {
+            kv_iter_scan(iter);
+        }
+        int n = 0;
+        while (kv_iter_valid(iter)) {
+            struct pair item;
+            kv_iter_item(iter, &item);
+            visits[item.seq]++;
+            if (n++%2 == 0) {
+                struct pair old;
+                assert(kv_iter_delete(iter, &old) == kv_DELETED);
+                assert(old.seq == item.seq);
+            } else {
+                kv_iter_next(iter);
+            }
+        }
+        assert(kv_iter_status(iter) == 0);
+        kv_iter_release(iter);
+        assert(n == NITEMS);
+        for (int i = 0; i < NITEMS; i++) {
+            assert(visits[i] == 1);
+        }
+        assert(kv_count(&tree, 0) == NITEMS/2);
+        assert(kv_sane(&tree, 0));
+        kv_clear(&tree, 0);
+    }
+    struct kv *tree = 0;
+    for (int i = 0; i < NITEMS; i++) {
+        struct pair item = { i % 5, i };
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+    }
+    memset(visits, 0, sizeof(visits));
+    assert(kv_retain_if(&tree, retain_odd, 0) == kv_DELETED);
+    for (int i = 0; i < NITEMS; i++) {
+        assert(visits[i] == 1);
+    }
+    assert(kv_count(&tree, 0) == NITEMS/2);
+    assert(kv_sane(&tree, 0));
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+// A stable cursor cannot tell its kept item apart from the equal items, which
+// made it skip some and visit others twice, so it is not supported.
+void test_multi_stable(void) {
+    testinit();
+    struct kv *tree = 0;
+    for (int i = 0; i < 10; i++) {
+        struct pair item = { 5, i };
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+    }
+    struct kv_iter *iter;
+    kv_iter_init(&tree, &iter, 0);
+    kv_iter_set_stable(iter, true);
+    assert(!kv_iter_valid(iter));
+    assert(kv_iter_status(iter) == kv_UNSUPPORTED);
+    kv_iter_set_stable(iter, false);
+    int n = 0;
+    kv_iter_scan(iter);
+    for (; kv_iter_valid(iter); kv_iter_next(iter)) {
+        struct pair item;
+        kv_iter_item(iter, &item);
+        assert(item.seq == n);
+        n++;
+    }
+    assert(n == 10);
+    kv_iter_release(iter);
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+int main(void) {
+    initrand();
+    test_multi_tree();
+#ifdef COW
+    test_multi_clone();
+#endif
+    test_multi_update();
+    test_multi_update_dups();
+    test_multi_iter_delete();
+    test_multi_stable();
+    return 0;
+}
@@ -0,0 +1,5 @@
+// The actual work is done in "test_base.h"
+#define TESTNAME "augment"
+#define AUGMENT
+#define LINEAR
+#include "test_base.h"
@@ -97,15 +97,31 @@ void free1(void *ptr) {
 #define BGEN_BTREE
 #define BGEN_NAME kv
 #define BGEN_TYPE int
+#ifndef NOCOW
 #define BGEN_COW
+#endif
 #ifdef COUNTED
 #define BGEN_COUNTED
 #endif
+#ifdef PREFIXCOUNTS
+#define BGEN_PREFIXCOUNTS
+#endif
+#ifdef DEQUE
+#define BGEN_DEQUE
+#endif
 #ifdef SPATIAL
 #define BGEN_SPATIAL
 #define BGEN_ITEMRECT { item_rect(item, min, max); }
 #define BGEN_DIMS     DIMS
 #endif
+#ifdef AUGMENT
+struct aug { long long sum; int max; };
+#define BGEN_AUGMENT
+#define BGEN_AUGTYPE    struct aug
+#define BGEN_AUGITEM    { return (struct aug){ item, item }; }
+#define BGEN_AUGCOMBINE { return (struct aug){ a.sum+b.sum, \
+                          a.max > b.max ? a.max : b.max }; }
+#endif
 #define BGEN_ASSERT
 #define BGEN_FANOUT   16
 #define BGEN_MALLOC   { return malloc1(size); }
@@ -191,6 +207,10 @@ void test_sane(void) {
 
     // Various failures
     struct kv node = { 0 };
+#ifdef DEQUE
+    // The items start within the node slots
+    node.items = node.slots;
+#endif
     tree = &node;
     node.len = 0;
     assert(kv_sane(&tree, 0) == false);
@@ -215,12 +235,16 @@ void test_sane(void) {
     assert(kv_sane(&tree, 0) == false);
 
     // Make a valid tree
-    struct kv cnode0 = { .isleaf=1, .height=1, .len=8, .items = { 
-        10, 20, 30, 40, 50, 60, 70, 80,
-    }, };
-    struct kv cnode1 = { .isleaf=1, .height=1, .len=8, .items = { 
-        100, 110, 120, 130, 140, 150, 160, 170
-    }, };
+    struct kv cnode0 = { .isleaf=1, .height=1, .len=8 };
+    struct kv cnode1 = { .isleaf=1, .height=1, .len=8 };
+#ifdef DEQUE
+    cnode0.items = cnode0.slots;
+    cnode1.items = cnode1.slots;
+#endif
+    for (int i = 0; i < 8; i++) {
+        cnode0.items[i] = 10+i*10;
+        cnode1.items[i] = 100+i*10;
+    }
 
     node.isleaf = 0;
     node.len = 1;
@@ -228,7 +252,10 @@ void test_sane(void) {
     node.items[0] = 90;
     node.children[0] = &cnode0;
     node.children[1] = &cnode1;
-#ifdef COUNTED
+#if defined(PREFIXCOUNTS)
+    node.counts[0] = 9;
+    node.counts[1] = 18;
+#elif defined(COUNTED)
     node.counts[0] = 8;
     node.counts[1] = 8;
 #endif
@@ -244,6 +271,17 @@ void test_sane(void) {
 #endif
     assert(kv_sane(&tree, 0) == true);
 
+#ifdef DEQUE
+    // Only leaves may have head room
+    node.items++;
+    assert(kv_sane(&tree, 0) == false);
+    node.items--;
+    cnode0.items = cnode0.slots+1000;
+    assert(kv_sane(&tree, 0) == false);
+    cnode0.items = cnode0.slots;
+    assert(kv_sane(&tree, 0) == true);
+#endif
+
     // Break stuff
     cnode1.items[0] = 75;
     assert(kv_sane(&tree, 0) == false);
@@ -311,7 +349,11 @@ void test_various(void) {
 
     // check features
 
+#ifdef NOCOW
+    assert(kv_feat_cow() == 0);
+#else
     assert(kv_feat_cow() == 1);
+#endif
     assert(kv_feat_atomics() == 1);
 #ifdef COUNTED
     assert(kv_feat_counted() == 1);
@@ -808,15 +850,501 @@ void test_counted(void) {
         assert(kv_index_of(&tree, keys[i]+1, 0, 0) == kv_NOTFOUND);
     }
 
+#ifndef NOORDER
+    for (int i = 0; i < nkeys; i++) {
+        size_t rank = -1;
+        assert(kv_rank(&tree, keys[i], &rank, 0) == kv_FOUND);
+        assert(rank == (size_t)i);
+        assert(kv_rank(&tree, keys[i]+1, &rank, 0) == kv_NOTFOUND);
+        assert(rank == (size_t)i+1);
+        assert(kv_rank(&tree, keys[i]-1, &rank, 0) == kv_NOTFOUND);
+        assert(rank == (size_t)i);
+    }
+    assert(kv_rank(&tree, keys[nkeys-1]+1, 0, 0) == kv_NOTFOUND);
+    for (int i = 0; i < 10000; i++) {
+        int lo = rand()%(nkeys*10+20)-10;
+        int hi = rand()%(nkeys*10+20)-10;
+        size_t expect = 0;
+        for (int j = 0; j < nkeys; j++) {
+            expect += keys[j] >= lo && keys[j] < hi;
+        }
+        assert(kv_count_range(&tree, lo, hi, 0) == expect);
+    }
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_count_range(&tree, keys[i], keys[i], 0) == 0);
+        assert(kv_count_range(&tree, keys[i], keys[i]+1, 0) == 1);
+        assert(kv_count_range(&tree, keys[0], keys[i], 0) == (size_t)i);
+        assert(kv_count_range(&tree, keys[i], keys[nkeys-1]+1, 0) == 
+            (size_t)(nkeys-i));
+    }
+#endif
+
     kv_clear(&tree, 0);
     assert(kv_index_of(&tree, 0, 0, 0) == kv_NOTFOUND);
+    size_t rank = -1;
+    assert(kv_rank(&tree, 0, &rank, 0) == kv_NOTFOUND);
+    assert(rank == 0);
+    assert(kv_count_range(&tree, 0, 100, 0) == 0);
+
+    checkmem();
+}
+
+#ifdef AUGMENT
+struct augctx {
+    int *items;
+    int count;
+};
+
+static bool aug_collect(int item, void *udata) {
+    struct augctx *ctx = udata;
+    ctx->items[ctx->count++] = item;
+    return true;
+}
+
+static bool aug_reaches(struct aug aug, void *udata) {
+    return aug.sum >= *(long long*)udata;
+}
+
+// Compare the tree summaries with a brute force scan of all items
+static void aug_check(struct kv **root) {
+    int *items = malloc(nkeys*sizeof(int));
+    assert(items);
+    struct augctx ctx = { .items = items };
+    kv_scan(root, aug_collect, &ctx);
+    struct aug aug;
+    if (ctx.count == 0) {
+        assert(kv_augment(root, &aug, 0) == kv_NOTFOUND);
+        assert(kv_aggregate_range(root, 0, 100, &aug, 0) == kv_NOTFOUND);
+        free(items);
+        return;
+    }
+    long long sum = 0;
+    int max = items[0];
+    for (int i = 0; i < ctx.count; i++) {
+        sum += items[i];
+        max = items[i] > max ? items[i] : max;
+    }
+    assert(kv_augment(root, &aug, 0) == kv_FOUND);
+    assert(aug.sum == sum && aug.max == max);
+    for (int i = 0; i < 100; i++) {
+        long long target = rand()%(sum+10);
+        long long psum = 0;
+        int j = 0;
+        for (; j < ctx.count; j++) {
+            psum += items[j];
+            if (psum >= target) {
+                break;
+            }
+        }
+        int item = -1;
+        int ret = kv_augment_find(root, aug_reaches, &item, &aug, &target);
+        if (j == ctx.count) {
+            assert(ret == kv_NOTFOUND);
+        } else {
+            assert(ret == kv_FOUND);
+            assert(item == items[j]);
+            assert(aug.sum == psum);
+        }
+    }
+    for (int i = 0; i < 100; i++) {
+        int lo = rand()%(nkeys*10+20)-10;
+        int hi = rand()%(nkeys*10+20)-10;
+        if (i%10 == 0) {
+            // exact item boundaries
+            lo = items[rand()%ctx.count];
+            hi = items[rand()%ctx.count];
+        }
+        long long rsum = 0;
+        int rmax = -1;
+        int rcount = 0;
+        for (int j = 0; j < ctx.count; j++) {
+            if (items[j] >= lo && items[j] < hi) {
+                rsum += items[j];
+                rmax = items[j] > rmax ? items[j] : rmax;
+                rcount++;
+            }
+        }
+        aug = (struct aug){ -1, -1 };
+        int ret = kv_aggregate_range(root, lo, hi, &aug, 0);
+        if (rcount == 0) {
+            assert(ret == kv_NOTFOUND);
+        } else {
+            assert(ret == kv_FOUND);
+            assert(aug.sum == rsum && aug.max == rmax);
+        }
+    }
+    free(items);
+}
+#endif
+
+void test_augment(void) {
+    testinit();
+#ifndef AUGMENT
+    assert(kv_augment(&tree, 0, 0) == kv_UNSUPPORTED);
+    assert(kv_augment_find(&tree, 0, 0, 0, 0) == kv_UNSUPPORTED);
+    assert(kv_aggregate_range(&tree, 0, 0, 0, 0) == kv_UNSUPPORTED);
+#else
+    aug_check(&tree);
+    tree_fill();
+    assert(kv_sane(&tree, 0));
+    aug_check(&tree);
+    struct kv *tree2 = 0;
+    assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+    shuffle(keys, nkeys);
+    for (int i = 0; i < nkeys/2; i++) {
+        assert(kv_delete(&tree2, keys[i], 0, 0) == kv_DELETED);
+        if (i%50 == 0) {
+            aug_check(&tree2);
+        }
+    }
+    aug_check(&tree);
+    aug_check(&tree2);
+    for (int i = 0; i < nkeys/2; i++) {
+        assert(kv_insert(&tree2, keys[i]+1, 0, 0) == kv_INSERTED);
+        assert(kv_insert(&tree2, keys[nkeys-1-i], 0, 0) == kv_REPLACED);
+    }
+    aug_check(&tree2);
+    for (int i = 0; i < 100; i++) {
+        assert(kv_pop_front(&tree2, 0, 0) == kv_DELETED);
+        assert(kv_pop_back(&tree2, 0, 0) == kv_DELETED);
+    }
+    aug_check(&tree2);
+    assert(kv_push_front(&tree2, -10, 0) == kv_INSERTED);
+    assert(kv_push_back(&tree2, nkeys*10, 0) == kv_INSERTED);
+    aug_check(&tree2);
+    assert(kv_sane(&tree2, 0));
+    kv_clear(&tree2, 0);
+    while (tree) {
+        assert(kv_pop_front(&tree, 0, 0) == kv_DELETED);
+        if (rand()%50 == 0) {
+            aug_check(&tree);
+        }
+    }
+    aug_check(&tree);
+    sort(keys, nkeys);
+#endif
+    checkmem();
+}
+
+#ifdef COUNTED
+// Check that the tree has exactly the keys that are marked as in.
+void run_check(struct kv **root, bool *in) {
+    assert(kv_sane(root, 0));
+    size_t j = 0;
+    for (int i = 0; i < nkeys; i++) {
+        if (in[i]) {
+            val = -1;
+            assert(kv_get_at(root, j, &val, 0) == kv_FOUND);
+            assert(val == keys[i]);
+            j++;
+        }
+    }
+    assert(kv_count(root, 0) == j);
+#ifdef AUGMENT
+    aug_check(root);
+#endif
+}
+#endif
+
+void test_run_at(void) {
+    testinit();
+#ifndef COUNTED
+    assert(kv_insert_run_at(&tree, 0, keys, 1, 0) == kv_UNSUPPORTED);
+    assert(kv_delete_run_at(&tree, 0, 1, 0, 0) == kv_UNSUPPORTED);
+#else
+    sort(keys, nkeys);
+    bool *in = (bool*)calloc(nkeys, sizeof(bool));
+    assert(in);
+    assert(kv_insert_run_at(&tree, 1, keys, 1, 0) == kv_NOTFOUND);
+    assert(kv_insert_run_at(&tree, 0, keys, 0, 0) == kv_INSERTED);
+    assert(kv_delete_run_at(&tree, 0, 1, 0, 0) == kv_NOTFOUND);
+    assert(kv_delete_run_at(&tree, 0, 0, 0, 0) == kv_DELETED);
+    assert(kv_insert_run_at(&tree, 0, keys, nkeys, 0) == kv_INSERTED);
+    for (int i = 0; i < nkeys; i++) {
+        in[i] = true;
+    }
+    run_check(&tree, in);
+#ifndef NOORDER
+    assert(kv_insert_run_at(&tree, 1, (int[]){ 11, 12 }, 2, 0) == 
+        kv_OUTOFORDER);
+    assert(kv_insert_run_at(&tree, 2, (int[]){ 12, 11 }, 2, 0) == 
+        kv_OUTOFORDER);
+    assert(kv_insert_run_at(&tree, 2, (int[]){ 5, 11 }, 2, 0) == 
+        kv_OUTOFORDER);
+    assert(kv_insert_run_at(&tree, 2, (int[]){ 11, 20 }, 2, 0) == 
+        kv_OUTOFORDER);
+#endif
+    assert(kv_delete_run_at(&tree, 1, nkeys, 0, 0) == kv_NOTFOUND);
+    assert(kv_delete_run_at(&tree, 0, nkeys, 0, 0) == kv_DELETED);
+    assert(kv_count(&tree, 0) == 0);
+    for (int i = 0; i < nkeys; i++) {
+        in[i] = false;
+    }
+    // Random runs of keys coming and going, with random allocation failures
+    // that must leave the tree, and its clones, as they were.
+    int *deleted = (int*)malloc(nkeys*sizeof(int));
+    assert(deleted);
+    struct kv *tree2 = 0;
+    for (int ii = 0; ii < 2000; ii++) {
+        if (ii%10 == 0) {
+            kv_clear(&tree2, 0);
+            assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+        }
+        failrandom = rand()%4 == 0 ? 50 : 0;
+        int maxrun = rand()%10 == 0 ? nkeys : 1+rand()%100;
+        size_t count = kv_count(&tree, 0);
+        int ret;
+        if (rand()%2 == 0) {
+            // insert the keys that follow a random missing key
+            int i = rand()%nkeys;
+            while (i < nkeys && in[i]) {
+                i++;
+            }
+            int n = 0;
+            while (i+n < nkeys && !in[i+n] && n < maxrun) {
+                n++;
+            }
+            size_t index = 0;
+            for (int j = 0; j < i; j++) {
+                index += in[j];
+            }
+            ret = kv_insert_run_at(&tree, index, keys+i, n, 0);
+            if (ret == kv_INSERTED) {
+                for (int j = 0; j < n; j++) {
+                    in[i+j] = true;
+                }
+            }
+        } else {
+            size_t index = count == 0 ? 0 : rand()%count;
+            size_t n = rand()%maxrun;
+            if (n > count-index) {
+                n = count-index;
+            }
+            // Half of the time the deleted items are handed back.
+            int *out = rand()%2 == 0 ? deleted : 0;
+            ret = kv_delete_run_at(&tree, index, n, out, 0);
+            if (ret == kv_DELETED) {
+                size_t j = 0;
+                for (int i = 0; i < nkeys; i++) {
+                    if (in[i]) {
+                        if (j >= index && j < index+n) {
+                            assert(!out || out[j-index] == keys[i]);
+                            in[i] = false;
+                        }
+                        j++;
+                    }
+                }
+            }
+        }
+        failrandom = 0;
+        assert(ret == kv_INSERTED || ret == kv_DELETED || ret == kv_NOMEM);
+        run_check(&tree, in);
+        if (tree2) {
+            assert(kv_sane(&tree2, 0));
+        }
+    }
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+    free(deleted);
+    free(in);
+#endif
+    checkmem();
+}
+
+void test_quantiles(void) {
+    testinit();
+    double ps[100];
+    int items[100];
+    assert(kv_quantiles(&tree, ps, 0, items, 0) == kv_NOTFOUND);
+    tree_fill();
+    size_t count = kv_count(&tree, 0);
+    for (int ii = 0; ii < 1000; ii++) {
+        int n = rand()%10 == 0 ? 100 : rand()%8;
+        for (int i = 0; i < n; i++) {
+            switch (rand()%4) {
+            case 0:
+                ps[i] = rand_double()*1.2-0.1;
+                break;
+            case 1:
+                // a repeat
+                ps[i] = i > 0 ? ps[rand()%i] : 0.5;
+                break;
+            default:
+                ps[i] = rand_double();
+            }
+        }
+        failrandom = rand()%10 == 0 ? 2 : 0;
+        int ret = kv_quantiles(&tree, ps, n, items, 0);
+        failrandom = 0;
+        if (ret == kv_NOMEM) {
+            assert(n > 16);
+            continue;
+        }
+        assert(ret == kv_FOUND);
+        for (int i = 0; i < n; i++) {
+            size_t index = ps[i] <= 0 ? 0 : (size_t)(ps[i]*count);
+            index = index < count ? index : count-1;
+            assert(kv_get_at(&tree, index, &val, 0) == kv_FOUND);
+            assert(items[i] == val);
+        }
+    }
+    kv_clear(&tree, 0);
+    sort(keys, nkeys);
+    checkmem();
+}
+
+// The udata is the number of calls for missing and existing items.
+void upsert_fn(int *item, bool exists, void *udata) {
+    (void)item;
+    ((int*)udata)[exists]++;
+}
+
+void test_upsert(void) {
+    testinit();
+    int calls[2] = { 0 };
+#ifdef NOORDER
+    assert(kv_upsert(&tree, keys[0], upsert_fn, calls) == kv_UNSUPPORTED);
+#else
+    shuffle(keys, nkeys);
+    struct kv *tree2 = 0;
+    // Insert all keys, then update all keys, with random allocation failures
+    // that must leave the tree as it was without calling the callback.
+    for (int ii = 0; ii < 2; ii++) {
+        for (int i = 0; i < nkeys; i++) {
+            if (i%10 == 0) {
+                kv_clear(&tree2, 0);
+                assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+            }
+            int ncalls[2] = { calls[0], calls[1] };
+            int ret;
+            failrandom = rand()%4 == 0 ? 2 : 0;
+            while (1) {
+                ret = kv_upsert(&tree, keys[i], upsert_fn, calls);
+                if (ret != kv_NOMEM) {
+                    break;
+                }
+                assert(calls[0] == ncalls[0] && calls[1] == ncalls[1]);
+                assert(kv_sane(&tree, 0));
+                failrandom = 0;
+            }
+            failrandom = 0;
+            assert(ret == (ii == 0 ? kv_INSERTED : kv_FOUND));
+            assert(calls[ii] == ncalls[ii]+1);
+            assert(calls[!ii] == ncalls[!ii]);
+            assert(kv_count(&tree, 0) == (size_t)(ii == 0 ? i+1 : nkeys));
+        }
+        assert(kv_sane(&tree, 0));
+        assert(kv_sane(&tree2, 0));
+    }
+    assert(calls[0] == nkeys && calls[1] == nkeys);
+    // Fill in the gaps between keys
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_upsert(&tree, keys[i]+5, upsert_fn, calls) == kv_INSERTED);
+    }
+    assert(kv_sane(&tree, 0));
+    assert(kv_count(&tree, 0) == (size_t)nkeys*2);
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_contains(&tree, keys[i], 0));
+        assert(kv_contains(&tree, keys[i]+5, 0));
+    }
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+    sort(keys, nkeys);
+#endif
+    checkmem();
+}
 
+void test_update(void) {
+    testinit();
+#ifdef NOORDER
+    assert(kv_update(&tree, 0, 10, 0, 0) == kv_UNSUPPORTED);
+#else
+    assert(kv_update(&tree, 0, 10, 0, 0) == kv_NOTFOUND);
+    tree_fill();
+    assert(kv_update(&tree, 5, 15, 0, 0) == kv_NOTFOUND);
+    // Move random items a little, which mostly stays in the same leaf, or
+    // a lot, with random allocation failures that must leave the tree as it
+    // was. The items in vals are the items in the tree.
+    int *vals = malloc(nkeys*sizeof(int));
+    assert(vals);
+    for (int i = 0; i < nkeys; i++) {
+        vals[i] = i*10;
+    }
+    struct kv *tree2 = 0;
+    for (int i = 0; i < nkeys*4; i++) {
+        if (i%100 == 0) {
+            kv_clear(&tree2, 0);
+            assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+        }
+        int j = rand()%nkeys;
+        int item = rand()%2 == 0 ? vals[j] + (rand()%11-5)*10 :
+            (rand()%(nkeys*4))*10;
+        if (item < 0) {
+            continue;
+        }
+        // Another item that is equal to the new item is left alone.
+        bool exists = item != vals[j] && kv_contains(&tree, item, 0);
+        int ret;
+        failrandom = rand()%4 == 0 ? 2 : 0;
+        while (1) {
+            ret = kv_update(&tree, vals[j], item, &val, 0);
+            if (ret != kv_NOMEM) {
+                break;
+            }
+            assert(kv_contains(&tree, vals[j], 0));
+            assert(kv_count(&tree, 0) == (size_t)nkeys);
+            assert(kv_sane(&tree, 0));
+            failrandom = 0;
+        }
+        failrandom = 0;
+        if (exists) {
+            assert(ret == kv_OUTOFORDER);
+            assert(kv_contains(&tree, vals[j], 0));
+            assert(kv_count(&tree, 0) == (size_t)nkeys);
+            continue;
+        }
+        assert(ret == kv_REPLACED);
+        assert(val == vals[j]);
+        assert(item == vals[j] || !kv_contains(&tree, vals[j], 0));
+        vals[j] = item;
+        assert(kv_contains(&tree, item, 0));
+        assert(kv_count(&tree, 0) == (size_t)nkeys);
+        if (i%100 == 0) {
+            assert(kv_sane(&tree, 0));
+        }
+    }
+    assert(kv_sane(&tree, 0));
+    assert(kv_sane(&tree2, 0));
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_contains(&tree, vals[i], 0));
+    }
+    // An item that is equal to another item in the tree is not moved, both
+    // for a neighbor in the same leaf and for an item far away.
+    sort(vals, nkeys);
+    assert(kv_update(&tree, vals[0], vals[1], &val, 0) == kv_OUTOFORDER);
+    assert(kv_update(&tree, vals[0], vals[nkeys-1], &val, 0) ==
+        kv_OUTOFORDER);
+    assert(kv_contains(&tree, vals[0], 0));
+    assert(kv_contains(&tree, vals[1], 0));
+    assert(kv_count(&tree, 0) == (size_t)nkeys);
+    assert(kv_sane(&tree, 0));
+    free(vals);
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+    sort(keys, nkeys);
+#endif
     checkmem();
 }
 
 void test_copy_or_clone(bool clone) {
     
     tree_fill();
+#ifdef NOCOW
+    // Without BGEN_COW a clone copies all items, the same as a copy.
+    bool lazy = false;
+#else
+    bool lazy = clone;
+#endif
 
     // Copy btree
     copysum = 0;
@@ -824,11 +1352,10 @@ void test_copy_or_clone(bool clone) {
     struct kv *tree2 = 0;
     if (clone) {
         assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
-        assert(copysum == 0);
     } else {
         assert(kv_copy(&tree, &tree2, 0) == kv_COPIED);
-        assert(copysum == asum);
     }
+    assert(copysum == (lazy ? 0 : asum));
     for (int i = 0; i < nkeys; i++) {
         assert(kv_contains(&tree, keys[i], 0));
     }
@@ -844,12 +1371,7 @@ void test_copy_or_clone(bool clone) {
         assert(val == keys[i]);
     }
 
-    if (clone) {
-        // tree_print_dim(&tree);
-        assert(copysum == asum);
-    } else {
-        assert(copysum == 0);
-    }
+    assert(copysum == (lazy ? asum : 0));
 
     // make sure all items still exist in first btree
     for (int i = 0; i < nkeys; i++) {
@@ -1195,8 +1717,6 @@ bool siter_noop(int item, void *udata) {
 
 void test_failures(void) {
     testinit();
-    const int K = 20;
-    const int N = 500;
     // Test insertion errors using a random malloc failures
     failrandom = 2;
     for (int ii = 0; ii < 10; ii++) {
@@ -1267,7 +1787,11 @@ void test_failures(void) {
 
     kv_clear(&tree, 0);
 
-    // test various nomem failures
+#ifndef NOCOW
+    // test various nomem failures, which come from copying the nodes that
+    // are shared with a clone
+    const int K = 20;
+    const int N = 500;
     double start = now();
     while (now() - start < 1) {
         tree_fill();
@@ -1682,6 +2206,7 @@ void test_failures(void) {
         kv_clear(&tree2, 0);
         kv_clear(&tree, 0);
     }
+#endif
     checkmem();
 }
 
@@ -1968,56 +2493,229 @@ void test_intersects(void) {
     checkmem();
 }
 
-struct siter_ctx {
-    int limit;
-    int count;
-    double sum;
-    bool stopped;
+struct mctx {
+    int nqueries;
+    int *counts;  // number of items per query
+    int **items;  // items per query
+    int limit;    // stop after this many total matches
+    int total;
 };
 
-bool siter(int item, void *udata) {
-    struct siter_ctx *ctx = udata;
-    if (ctx->limit == 0) {
-        ctx->stopped = true;
+bool miter(size_t index, int item, void *udata) {
+    struct mctx *ctx = udata;
+    assert(index < (size_t)ctx->nqueries);
+    if (ctx->total == ctx->limit) {
         return false;
     }
-    // printf("%d\n", item);
-    ctx->limit--;
-    ctx->count++;
-    ctx->sum += item;
+    ctx->items[index][ctx->counts[index]++] = item;
+    ctx->total++;
     return true;
-} 
+}
 
+struct actx {
+    int count;
+    int *items;
+};
 
-void slow_scan(bool(*iter)(int item, void *udata), void *udata) {
-    sort(keys, nkeys);
-    for (int i = 0; i < nkeys; i++) {
-        if (!iter(keys[i], udata)) {
-            break;
-        }
-    }
+bool aiter(int item, void *udata) {
+    struct actx *ctx = udata;
+    ctx->items[ctx->count++] = item;
+    return true;
 }
 
-void slow_scan_desc(bool(*iter)(int item, void *udata), void *udata) {
-    sort(keys, nkeys);
-    for (int i = nkeys-1; i >= 0; i--) {
-        if (!iter(keys[i], udata)) {
-            break;
+void test_intersects_many(void) {
+    testinit();
+    double mins[64][DIMS];
+    double maxs[64][DIMS];
+    assert(kv_intersects_many(&tree, mins, maxs, 64, miter, 0) == 
+        kv_FINISHED);
+    tree_fill();
+    struct mctx ctx = { .nqueries = 64 };
+    ctx.counts = malloc(sizeof(int)*64);
+    ctx.items = malloc(sizeof(int*)*64);
+    assert(ctx.counts && ctx.items);
+    for (int i = 0; i < 64; i++) {
+        ctx.items[i] = malloc(sizeof(int)*nkeys);
+        assert(ctx.items[i]);
+    }
+    struct actx actx = { 0 };
+    actx.items = malloc(sizeof(int)*nkeys);
+    assert(actx.items);
+    for (int k = 0; k < 20; k++) {
+        int n = rand()%65;
+        for (int i = 0; i < n; i++) {
+            double a = keys[rand()%nkeys] - rand()%100;
+            double b = a + rand()%(k%2 ? 50 : 1000);
+            for (int j = 0; j < DIMS; j++) {
+                mins[i][j] = a;
+                maxs[i][j] = b;
+            }
+            ctx.counts[i] = 0;
         }
-    }
-}
-
-void slow_seek(int pivot, bool(*iter)(int item, void *udata), void *udata) {
-    sort(keys, nkeys);
-    int i = 0;
-    for (; i < nkeys; i++) {
-        if (pivot <= keys[i]) {
-            break;
+        ctx.total = 0;
+        ctx.limit = -1;
+        assert(kv_intersects_many(&tree, mins, maxs, n, miter, &ctx) == 
+            kv_FINISHED);
+        int total = 0;
+        for (int i = 0; i < n; i++) {
+            // each query must match a single intersects
+            actx.count = 0;
+            assert(kv_intersects(&tree, mins[i], maxs[i], aiter, &actx) == 
+                kv_FINISHED);
+            assert(ctx.counts[i] == actx.count);
+            for (int j = 0; j < actx.count; j++) {
+                assert(ctx.items[i][j] == actx.items[j]);
+            }
+            total += actx.count;
         }
-    }
-    for (; i < nkeys; i++) {
-        if (!iter(keys[i], udata)) {
-            break;
+        if (total > 0) {
+            for (int i = 0; i < n; i++) {
+                ctx.counts[i] = 0;
+            }
+            ctx.total = 0;
+            ctx.limit = rand()%total;
+            assert(kv_intersects_many(&tree, mins, maxs, n, miter, &ctx) == 
+                kv_STOPPED);
+            assert(ctx.total == ctx.limit);
+        }
+    }
+    for (int i = 0; i < 64; i++) {
+        free(ctx.items[i]);
+    }
+    free(ctx.items);
+    free(ctx.counts);
+    free(actx.items);
+    kv_clear(&tree, 0);
+    checkmem();
+}
+
+struct jctx {
+    int count;
+    int limit;
+    uint64_t sum;
+    int b; // current item from the other tree, used by slow join
+};
+
+bool jiter(int a, int b, void *udata) {
+    struct jctx *ctx = udata;
+    if (ctx->count == ctx->limit) {
+        return false;
+    }
+    ctx->count++;
+    ctx->sum += (uint64_t)a*2654435761 ^ (uint64_t)b;
+    return true;
+}
+
+bool jiter_slow(int a, void *udata) {
+    struct jctx *ctx = udata;
+    return jiter(a, ctx->b, ctx);
+}
+
+void slow_spatial_join(struct kv **root, struct kv **other, 
+    struct jctx *ctx)
+{
+    struct kv_iter *iter;
+    kv_iter_init(other, &iter, 0);
+    kv_iter_scan(iter);
+    while (kv_iter_valid(iter)) {
+        kv_iter_item(iter, &ctx->b);
+        double min[DIMS], max[DIMS];
+        item_rect(ctx->b, min, max);
+        kv_intersects(root, min, max, jiter_slow, ctx);
+        kv_iter_next(iter);
+    }
+    kv_iter_release(iter);
+}
+
+void test_spatial_join(void) {
+    testinit();
+    struct kv *tree2 = 0;
+    struct jctx ctx1 = { .limit = -1 };
+    assert(kv_spatial_join(&tree, &tree2, jiter, &ctx1) == kv_FINISHED);
+    assert(ctx1.count == 0);
+    for (int k = 0; k < 10; k++) {
+        tree_fill();
+        // the other tree has a random subset of items, some of them shifted
+        // to non-matching locations.
+        int n = rand()%(nkeys+1);
+        for (int i = 0; i < n; i++) {
+            int item = keys[rand()%nkeys] + (rand()%4 == 0 ? rand()%3 : 0);
+            kv_insert(&tree2, item, 0, 0);
+        }
+        ctx1 = (struct jctx){ .limit = -1 };
+        assert(kv_spatial_join(&tree, &tree2, jiter, &ctx1) == kv_FINISHED);
+        struct jctx ctx2 = { .limit = -1 };
+        slow_spatial_join(&tree, &tree2, &ctx2);
+        assert(ctx1.count == ctx2.count);
+        assert(ctx1.sum == ctx2.sum);
+        // self join
+        ctx1 = (struct jctx){ .limit = -1 };
+        assert(kv_spatial_join(&tree, &tree, jiter, &ctx1) == kv_FINISHED);
+        ctx2 = (struct jctx){ .limit = -1 };
+        slow_spatial_join(&tree, &tree, &ctx2);
+        assert(ctx1.count == ctx2.count);
+        assert(ctx1.sum == ctx2.sum);
+        if (ctx2.count > 0) {
+            ctx1 = (struct jctx){ .limit = rand()%ctx2.count };
+            assert(kv_spatial_join(&tree, &tree, jiter, &ctx1) == kv_STOPPED);
+            assert(ctx1.count == ctx1.limit);
+        }
+        kv_clear(&tree, 0);
+        kv_clear(&tree2, 0);
+    }
+    checkmem();
+}
+
+struct siter_ctx {
+    int limit;
+    int count;
+    double sum;
+    bool stopped;
+};
+
+bool siter(int item, void *udata) {
+    struct siter_ctx *ctx = udata;
+    if (ctx->limit == 0) {
+        ctx->stopped = true;
+        return false;
+    }
+    // printf("%d\n", item);
+    ctx->limit--;
+    ctx->count++;
+    ctx->sum += item;
+    return true;
+} 
+
+
+void slow_scan(bool(*iter)(int item, void *udata), void *udata) {
+    sort(keys, nkeys);
+    for (int i = 0; i < nkeys; i++) {
+        if (!iter(keys[i], udata)) {
+            break;
+        }
+    }
+}
+
+void slow_scan_desc(bool(*iter)(int item, void *udata), void *udata) {
+    sort(keys, nkeys);
+    for (int i = nkeys-1; i >= 0; i--) {
+        if (!iter(keys[i], udata)) {
+            break;
+        }
+    }
+}
+
+void slow_seek(int pivot, bool(*iter)(int item, void *udata), void *udata) {
+    sort(keys, nkeys);
+    int i = 0;
+    for (; i < nkeys; i++) {
+        if (pivot <= keys[i]) {
+            break;
+        }
+    }
+    for (; i < nkeys; i++) {
+        if (!iter(keys[i], udata)) {
+            break;
         }
     }
 }
@@ -2584,123 +3282,994 @@ void test_seek_at_desc(void) {
     checkmem();
 }
 
-
-struct point {
-    double x;
-    double y;
-};
-
-struct nctx {
-    struct point point;
-    int count;
-    int *items;
-    int limit;
-};
-
-double ndist(double min[], double max[], void *target, void *udata) {
-    (void)udata;
-    double *point = target;
-    return box_dist(point, point, min, max);
+void test_iter_advance_opt(bool mut, bool desc) {
+    struct kv_iter *iter;
+    tree_fill_sorted();
+    struct kv *tree2 = 0;
+    assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+    if (mut) {
+        kv_iter_init_mut(&tree, &iter, 0);
+    } else {
+        kv_iter_init(&tree, &iter, 0);
+    }
+    long count = (long)kv_count(&tree, 0);
+    long pos = -1;
+    for (int i = 0; i < 5000; i++) {
+        if (pos == -1) {
+            pos = rand()%count;
+            if (desc) {
+                kv_iter_seek_at_desc(iter, pos);
+            } else {
+                kv_iter_seek_at(iter, pos);
+            }
+        }
+        long delta;
+        switch (rand()%4) {
+        case 0:
+            delta = rand()%3-1;
+            break;
+        case 1:
+            delta = rand()%(count*2+1)-count;
+            break;
+        default:
+            delta = rand()%101-50;
+        }
+        kv_iter_advance(iter, delta);
+        pos += desc ? -delta : delta;
+        if (pos < 0 || pos >= count) {
+            assert(!kv_iter_valid(iter));
+            pos = -1;
+            continue;
+        }
+        assert(kv_iter_valid(iter));
+        kv_iter_item(iter, &val);
+        assert(val == keys[pos]);
+        if (rand()%4 == 0) {
+            kv_iter_next(iter);
+            pos += desc ? -1 : 1;
+            if (pos < 0 || pos >= count) {
+                assert(!kv_iter_valid(iter));
+                pos = -1;
+                continue;
+            }
+            kv_iter_item(iter, &val);
+            assert(val == keys[pos]);
+        }
+    }
+    assert(kv_iter_status(iter) == 0);
+    kv_iter_release(iter);
+    assert(kv_sane(&tree, 0));
+    assert(kv_sane(&tree2, 0));
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
 }
 
-bool niter(int item, void *udata) {
-    struct nctx *ctx = udata;
-    ctx->items[ctx->count++] = item;
-    if (ctx->count == ctx->limit) {
-        return false;
+void test_iter_advance(void) {
+    testinit();
+    test_iter_advance_opt(0, 0);
+    test_iter_advance_opt(0, 1);
+    test_iter_advance_opt(1, 0);
+    test_iter_advance_opt(1, 1);
+#ifdef SPATIAL
+    struct kv_iter *iter;
+    tree_fill_sorted();
+    kv_iter_init(&tree, &iter, 0);
+    double min[DIMS], max[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        min[i] = 0;
+        max[i] = 100;
     }
-    return true;
+    kv_iter_intersects(iter, min, max);
+    assert(kv_iter_valid(iter));
+    kv_iter_advance(iter, 1);
+    assert(!kv_iter_valid(iter));
+    assert(kv_iter_status(iter) == kv_UNSUPPORTED);
+    kv_iter_release(iter);
+    kv_clear(&tree, 0);
+#endif
+    checkmem();
 }
 
-struct nitem {
-    double dist;
-    int item;
-};
-
-int ncompare(const void *a, const void *b) {
-    const struct nitem *na = a;
-    const struct nitem *nb = b;
-    return na->dist < nb->dist ? -1 :
-           na->dist > nb->dist ? 1 :
-           na->item < nb->item ? -1 : 
-           na->item > nb->item;
-}
 
-int slow_nearby(struct kv **root, void *target,
-    double(*dist)(double min[DIMS], double max[DIMS], 
-    void *target, void *udata), bool(*iter)(int item, void *udata), 
-    void *udata, bool mut)
-{
-#ifndef SPATIAL
-    (void)root, (void)target, (void)dist, (void)iter, (void)udata, (void)mut;
-    return kv_FINISHED;
-#else
-    struct nitem *items = malloc(sizeof(struct nitem) * kv_count(root, udata));
-    assert(items);
-    struct kv_iter *iter2;
+void test_iter_next_batch_opt(bool mut, bool desc) {
+    tree_fill();
+    struct kv *tree2 = 0;
+    int items[64];
+    struct kv_iter *iter;
     if (mut) {
-        kv_iter_init_mut(root, &iter2, udata);
+        kv_iter_init_mut(&tree, &iter, 0);
     } else {
-        kv_iter_init(root, &iter2, udata);
-    }
-    kv_iter_scan(iter2);
-    int count = 0;
-    while (kv_iter_valid(iter2)) {
-        kv_iter_item(iter2, &val);
-        double min[DIMS], max[DIMS];
-        item_rect(val, min, max);
-        items[count].dist = dist(min, max, target, udata);
-        items[count].item = val;
-        count++;
-        kv_iter_next(iter2);
+        kv_iter_init(&tree, &iter, 0);
     }
-    assert(kv_iter_status(iter2) == 0);
-    kv_iter_release(iter2);
-    qsort(items, count, sizeof(struct nitem), ncompare);
-    int status = kv_FINISHED;
-    for (int i = 0; i < count; i++) {
-        if (!iter(items[i].item, udata)) {
-            status = kv_STOPPED;
-            break;
+    for (int ii = 0; ii < 100; ii++) {
+        if (mut && ii%10 == 0) {
+            // Share the nodes with a clone to exercise copy-on-write.
+            kv_clear(&tree2, 0);
+            assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+        }
+        size_t index = rand()%(nkeys+1);
+        if (ii == 0) {
+            index = desc ? nkeys-1 : 0;
+        }
+        if (desc) {
+            kv_iter_seek_at_desc(iter, index);
+        } else {
+            kv_iter_seek_at(iter, index);
+        }
+        // Read the rest of the items using random batch sizes.
+        size_t count = desc ?
+            (index < (size_t)nkeys ? index+1 : (size_t)nkeys) : nkeys-index;
+        size_t total = 0;
+        while (1) {
+            size_t max = rand()%10 == 0 ? 64 : rand()%8;
+            size_t n = kv_iter_next_batch(iter, items, max);
+            assert(n <= max);
+            for (size_t i = 0; i < n; i++) {
+                size_t j = desc ? count-1-(total+i) : index+total+i;
+                assert(kv_get_at(&tree, j, &val, 0) == kv_FOUND);
+                assert(items[i] == val);
+            }
+            total += n;
+            if (n < max) {
+                break;
+            }
         }
+        assert(total == count);
+        assert(!kv_iter_valid(iter));
+        assert(kv_iter_next_batch(iter, items, 64) == 0);
     }
-    free(items);
-    return status;
-#endif
+    kv_iter_release(iter);
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
 }
 
-void test_nearby_opt(bool mut) {
-    tree = 0;
-    if (mut) {
-        assert(kv_nearby_mut(&tree, 0, ndist, niter, 0) == kv_FINISHED);
-    } else {
-        assert(kv_nearby(&tree, 0, ndist, niter, 0) == kv_FINISHED);
-    }
-
+void test_iter_next_batch(void) {
+    testinit();
+    test_iter_next_batch_opt(0, 0);
+    test_iter_next_batch_opt(0, 1);
+    test_iter_next_batch_opt(1, 0);
+    test_iter_next_batch_opt(1, 1);
+#ifdef SPATIAL
+    // Other kinds of iterators are read one item at a time.
+    tree_fill_sorted();
     struct kv_iter *iter;
     kv_iter_init(&tree, &iter, 0);
-    kv_iter_nearby(0, 0, ndist); // should not fail
-    kv_iter_nearby(iter, 0, ndist);
-    assert(kv_iter_valid(iter) == false);
+    double min[DIMS], max[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        min[i] = 1000;
+        max[i] = 5000;
+    }
+    int items[16];
+    int count = 0;
+    kv_iter_intersects(iter, min, max);
+    while (1) {
+        size_t n = kv_iter_next_batch(iter, items, 16);
+        for (size_t i = 0; i < n; i++) {
+            assert(items[i] >= 1000 && items[i] <= 5000);
+        }
+        count += n;
+        if (n < 16) {
+            break;
+        }
+    }
+    assert(count == 401);
     kv_iter_release(iter);
-    
+    kv_clear(&tree, 0);
+#endif
+    sort(keys, nkeys);
+    checkmem();
+}
 
-#ifndef SPATIAL
-    return;
-#else
-    int count = ncities;
+struct span_ctx {
+    size_t count;
+    size_t limit;
+};
+
+bool span_iter(const int *items, int count, void *udata) {
+    struct span_ctx *ctx = udata;
+    assert(count > 0);
     for (int i = 0; i < count; i++) {
-        int item = CITIESBASE+i;
-        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+        assert(kv_get_at(&tree, ctx->count+i, &val, 0) == kv_FOUND);
+        assert(items[i] == val);
     }
-    double point[] = { -112.0, 33.0, count/2 };
-
-    struct kv *tree2, *tree3;
-    assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
-    assert(kv_clone(&tree, &tree3, 0) == kv_COPIED);
+    ctx->count += count;
+    return ctx->count < ctx->limit;
+}
 
-    if (mut) {
-        // delete half the items
+void test_iter_next_span_opt(bool mut, bool desc) {
+    tree_fill();
+    struct kv *tree2 = 0;
+    struct kv_iter *iter;
+    if (mut) {
+        kv_iter_init_mut(&tree, &iter, 0);
+    } else {
+        kv_iter_init(&tree, &iter, 0);
+    }
+    for (int ii = 0; ii < 100; ii++) {
+        if (mut && ii%10 == 0) {
+            // Share the nodes with a clone to exercise copy-on-write.
+            kv_clear(&tree2, 0);
+            assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+        }
+        size_t index = rand()%(nkeys+1);
+        if (desc) {
+            kv_iter_seek_at_desc(iter, index);
+        } else {
+            kv_iter_seek_at(iter, index);
+        }
+        size_t count = desc ?
+            (index < (size_t)nkeys ? index+1 : (size_t)nkeys) : nkeys-index;
+        size_t total = 0;
+        const int *items;
+        int n;
+        while ((n = kv_iter_next_span(iter, &items)) > 0) {
+            for (int i = 0; i < n; i++) {
+                size_t j = desc ? count-1-total : index+total;
+                assert(kv_get_at(&tree, j, &val, 0) == kv_FOUND);
+                assert(items[desc ? n-1-i : i] == val);
+                total++;
+            }
+        }
+        assert(total == count);
+        assert(!kv_iter_valid(iter));
+        assert(kv_iter_status(iter) == 0);
+    }
+    kv_iter_release(iter);
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+}
+
+void test_scan_spans(void) {
+    testinit();
+    struct span_ctx ctx = { .limit = nkeys+1 };
+    assert(kv_scan_spans(&tree, span_iter, &ctx) == kv_FINISHED);
+    assert(ctx.count == 0);
+    tree_fill();
+    ctx = (struct span_ctx){ .limit = nkeys+1 };
+    assert(kv_scan_spans(&tree, span_iter, &ctx) == kv_FINISHED);
+    assert(ctx.count == (size_t)nkeys);
+    for (int i = 1; i < 150; i++) {
+        ctx = (struct span_ctx){ .limit = i };
+        assert(kv_scan_spans(&tree, span_iter, &ctx) == kv_STOPPED);
+        assert(ctx.count >= (size_t)i);
+    }
+    kv_clear(&tree, 0);
+    test_iter_next_span_opt(0, 0);
+    test_iter_next_span_opt(0, 1);
+    test_iter_next_span_opt(1, 0);
+    test_iter_next_span_opt(1, 1);
+#ifdef SPATIAL
+    // Other kinds of iterators are not supported.
+    tree_fill();
+    struct kv_iter *iter;
+    kv_iter_init(&tree, &iter, 0);
+    double min[DIMS], max[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        min[i] = 1000;
+        max[i] = 5000;
+    }
+    const int *items;
+    kv_iter_intersects(iter, min, max);
+    assert(kv_iter_valid(iter));
+    assert(kv_iter_next_span(iter, &items) == 0);
+    assert(!kv_iter_valid(iter));
+    assert(kv_iter_status(iter) == kv_UNSUPPORTED);
+    kv_iter_release(iter);
+    kv_clear(&tree, 0);
+#endif
+    sort(keys, nkeys);
+    checkmem();
+}
+
+void test_iter_stable_opt(bool mut, bool desc) {
+    tree_fill();
+    struct kv *tree2 = 0;
+    // 0: not yet visited, 1: deleted before being visited, 2: visited
+    char *state = malloc(nkeys);
+    assert(state);
+    memset(state, 0, nkeys);
+    struct kv_iter *iter;
+    if (mut) {
+        kv_iter_init_mut(&tree, &iter, 0);
+    } else {
+        kv_iter_init(&tree, &iter, 0);
+    }
+    kv_iter_set_stable(iter, true);
+    if (desc) {
+        kv_iter_scan_desc(iter);
+    } else {
+        kv_iter_scan(iter);
+    }
+    int last = 0;
+    bool first = true;
+    while (kv_iter_valid(iter)) {
+        kv_iter_item(iter, &val);
+        assert(first || (desc ? val < last : val > last));
+        first = false;
+        last = val;
+        if (val%10 == 0) {
+            assert(state[val/10] == 0);
+            state[val/10] = 2;
+        }
+        if (mut && rand()%50 == 0) {
+            // Share the nodes with a clone to exercise copy-on-write.
+            kv_clear(&tree2, 0);
+            assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+        }
+        // Change the tree before moving to the next item.
+        int i = rand()%nkeys;
+        switch (rand()%4) {
+        case 0:
+            assert(kv_delete(&tree, val, 0, 0) == kv_DELETED);
+            break;
+        case 1:
+            if (state[i] == 0) {
+                assert(kv_delete(&tree, i*10, 0, 0) == kv_DELETED);
+                state[i] = 1;
+            }
+            break;
+        case 2:
+            assert(kv_insert(&tree, i*10+5, 0, 0) != kv_NOMEM);
+            break;
+        }
+        kv_iter_next(iter);
+    }
+    assert(kv_iter_status(iter) == 0);
+    for (int i = 0; i < nkeys; i++) {
+        assert(state[i] != 0);
+    }
+    kv_iter_release(iter);
+    free(state);
+    assert(kv_sane(&tree, 0));
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+}
+
+// Every call that reads the cursor must first find its place again after the
+// tree was changed, because the nodes on its path may have been freed.
+void test_iter_stable_calls_opt(bool desc) {
+    tree_fill();
+    // 0: in the tree, 1: deleted
+    char *state = malloc(nkeys);
+    assert(state);
+    memset(state, 0, nkeys);
+    struct kv_iter *iter;
+    kv_iter_init(&tree, &iter, 0);
+    kv_iter_set_stable(iter, true);
+    if (desc) {
+        kv_iter_scan_desc(iter);
+    } else {
+        kv_iter_scan(iter);
+    }
+    int batch[8];
+    const int *items;
+    int last = desc ? nkeys*10 : -1;
+    while (kv_iter_valid(iter)) {
+        // Delete the current item or some other items, which may merge the
+        // nodes on the path of the cursor.
+        int n = rand()%8;
+        for (int j = 0; j < n; j++) {
+            int i = rand()%nkeys;
+            if (rand()%2 == 0) {
+                i = (last/10+(desc?-j:j)+nkeys)%nkeys;
+            }
+            if (state[i] == 0) {
+                assert(kv_delete(&tree, i*10, 0, 0) == kv_DELETED);
+                state[i] = 1;
+            }
+        }
+        int count = 0;
+        switch (rand()%4) {
+        case 0:
+            kv_iter_item(iter, &batch[0]);
+            count = kv_iter_valid(iter);
+            if (count) {
+                kv_iter_next(iter);
+            }
+            break;
+        case 1:
+            count = (int)kv_iter_next_batch(iter, batch, rand()%8+1);
+            break;
+        case 2:
+            count = kv_iter_next_span(iter, &items);
+            for (int j = 0; j < count && j < 8; j++) {
+                batch[j] = items[desc ? count-1-j : j];
+            }
+            if (count > 8) {
+                count = 8;
+            }
+            break;
+        case 3:
+            kv_iter_advance(iter, rand()%3);
+            break;
+        }
+        for (int j = 0; j < count; j++) {
+            assert(desc ? batch[j] < last : batch[j] > last);
+            assert(state[batch[j]/10] == 0);
+            last = batch[j];
+        }
+    }
+    assert(kv_iter_status(iter) == 0);
+    kv_iter_release(iter);
+    free(state);
+    assert(kv_sane(&tree, 0));
+    kv_clear(&tree, 0);
+}
+
+void test_iter_stable(void) {
+    testinit();
+    test_iter_stable_opt(0, 0);
+    test_iter_stable_opt(0, 1);
+    test_iter_stable_opt(1, 0);
+    test_iter_stable_opt(1, 1);
+    test_iter_stable_calls_opt(0);
+    test_iter_stable_calls_opt(1);
+    // A stable cursor that is not changed is the same as an iterator.
+    tree_fill();
+    struct kv_iter *iter;
+    kv_iter_init(&tree, &iter, 0);
+    kv_iter_set_stable(iter, true);
+    kv_iter_seek_at(iter, 100);
+    for (int i = 100; i < nkeys; i++) {
+        assert(kv_iter_valid(iter));
+        kv_iter_item(iter, &val);
+        assert(val == i*10);
+        kv_iter_next(iter);
+    }
+    assert(!kv_iter_valid(iter));
+    kv_iter_release(iter);
+    kv_clear(&tree, 0);
+    sort(keys, nkeys);
+    checkmem();
+}
+
+void test_iter_delete_opt(bool desc) {
+    tree_fill();
+    struct kv *tree2 = 0;
+    int *ref = malloc(nkeys*sizeof(int));
+    assert(ref);
+    for (int i = 0; i < nkeys; i++) {
+        ref[i] = i*10;
+    }
+    int n = nkeys;
+    struct kv_iter *iter;
+    kv_iter_init_mut(&tree, &iter, 0);
+    int pos = desc ? n-1 : 0;
+    if (desc) {
+        kv_iter_scan_desc(iter);
+    } else {
+        kv_iter_scan(iter);
+    }
+    int step = 0;
+    while (kv_iter_valid(iter)) {
+        assert(pos >= 0 && pos < n);
+        kv_iter_item(iter, &val);
+        assert(val == ref[pos]);
+        if (rand()%50 == 0) {
+            // Share the nodes with a clone to exercise copy-on-write.
+            kv_clear(&tree2, 0);
+            assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+        }
+        int item;
+        switch (rand()%3) {
+        case 0:
+            assert(kv_iter_delete(iter, &item) == kv_DELETED);
+            assert(item == ref[pos]);
+            memmove(ref+pos, ref+pos+1, (n-pos-1)*sizeof(int));
+            n--;
+            pos -= desc;
+            break;
+        case 1:
+            if (pos > 0) {
+                assert(kv_iter_replace(iter, ref[pos-1], 0) == kv_OUTOFORDER);
+            }
+            if (pos < n-1) {
+                assert(kv_iter_replace(iter, ref[pos+1], 0) == kv_OUTOFORDER);
+            }
+            assert(kv_iter_replace(iter, ref[pos]+1, &item) == kv_REPLACED);
+            assert(item == ref[pos]);
+            ref[pos]++;
+            kv_iter_item(iter, &val);
+            assert(val == ref[pos]);
+            // fallthrough
+        default:
+            kv_iter_next(iter);
+            pos += desc ? -1 : 1;
+        }
+        if (step++%10 == 0) {
+            assert(kv_sane(&tree, 0));
+        }
+    }
+    assert(kv_iter_status(iter) == 0);
+    assert(pos == (desc ? -1 : n));
+    assert(kv_iter_delete(iter, 0) == kv_NOTFOUND);
+    kv_iter_release(iter);
+    assert(kv_sane(&tree, 0));
+    assert(kv_count(&tree, 0) == (size_t)n);
+    for (int i = 0; i < n; i++) {
+        assert(kv_get_at(&tree, i, &val, 0) == kv_FOUND);
+        assert(val == ref[i]);
+    }
+    free(ref);
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+}
+
+bool retain_odd(int item, void *udata) {
+    (void)udata;
+    return (item/10)%2 == 1;
+}
+
+void test_iter_delete(void) {
+    testinit();
+    test_iter_delete_opt(0);
+    test_iter_delete_opt(1);
+    // Delete everything, one item at a time.
+    tree_fill();
+    struct kv_iter *iter;
+    kv_iter_init_mut(&tree, &iter, 0);
+    kv_iter_seek_at(iter, 0);
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_iter_valid(iter));
+        assert(kv_iter_delete(iter, &val) == kv_DELETED);
+        assert(val == i*10);
+    }
+    assert(!kv_iter_valid(iter));
+    assert(kv_count(&tree, 0) == 0);
+    kv_iter_release(iter);
+    // Only mutable iterators may change the tree.
+    tree_fill();
+    kv_iter_init(&tree, &iter, 0);
+    kv_iter_scan(iter);
+    assert(kv_iter_delete(iter, 0) == kv_UNSUPPORTED);
+    assert(kv_iter_replace(iter, 0, 0) == kv_UNSUPPORTED);
+    kv_iter_release(iter);
+    // Filter the tree in a single pass.
+    struct kv *tree2 = 0;
+    assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+    assert(kv_retain_if(&tree, retain_odd, 0) == kv_DELETED);
+    assert(kv_retain_if(&tree, retain_odd, 0) == kv_NOTFOUND);
+    assert(kv_sane(&tree, 0));
+    assert(kv_count(&tree, 0) == (size_t)nkeys/2);
+    for (int i = 0; i < nkeys/2; i++) {
+        assert(kv_get_at(&tree, i, &val, 0) == kv_FOUND);
+        assert(val == (i*2+1)*10);
+    }
+    assert(kv_count(&tree2, 0) == (size_t)nkeys);
+    assert(kv_sane(&tree2, 0));
+    kv_clear(&tree2, 0);
+    kv_clear(&tree, 0);
+    assert(kv_retain_if(&tree, retain_odd, 0) == kv_NOTFOUND);
+    sort(keys, nkeys);
+    checkmem();
+}
+
+struct edges_ctx {
+    int *items;
+    int count;
+    bool ok;
+};
+
+bool edges_iter(int item, void *udata) {
+    struct edges_ctx *ctx = udata;
+    ctx->ok = ctx->ok && item == ctx->items[ctx->count];
+    ctx->count++;
+    return true;
+}
+
+void test_tree_edges(void) {
+    testinit();
+    struct kv_tree *t;
+    kv_tree_init(&t, 0);
+    assert(t);
+    assert(kv_tree_front(t, &val, 0) == kv_NOTFOUND);
+    assert(kv_tree_back(t, &val, 0) == kv_NOTFOUND);
+    assert(kv_tree_pop_front(t, &val, 0) == kv_NOTFOUND);
+    assert(kv_tree_pop_back(t, &val, 0) == kv_NOTFOUND);
+    // The reference is a deque that grows out from the middle.
+    int nops = 20000;
+    int *ref = malloc((nops*2+1)*sizeof(int));
+    assert(ref);
+    int head = nops, tail = nops;
+    int lo = -10, hi = 0;
+    struct kv *tree2 = 0;
+    for (int i = 0; i < nops; i++) {
+        failrandom = i%2000 < 1000 ? 0 : 50;
+        int n = tail-head;
+        int item;
+        int ret;
+        switch (n < nkeys ? rand()%4 : 2+rand()%2) {
+        case 0:
+            ret = kv_tree_push_back(t, hi, 0);
+            if (ret == kv_NOMEM) {
+                break;
+            }
+            assert(ret == kv_INSERTED);
+            ref[tail++] = hi;
+            hi += 10;
+            break;
+        case 1:
+            ret = kv_tree_push_front(t, lo, 0);
+            if (ret == kv_NOMEM) {
+                break;
+            }
+            assert(ret == kv_INSERTED);
+            ref[--head] = lo;
+            lo -= 10;
+            break;
+        case 2:
+            ret = kv_tree_pop_front(t, &item, 0);
+            if (ret == kv_NOMEM) {
+                break;
+            }
+            if (n == 0) {
+                assert(ret == kv_NOTFOUND);
+                break;
+            }
+            assert(ret == kv_DELETED);
+            assert(item == ref[head++]);
+            break;
+        default:
+            ret = kv_tree_pop_back(t, &item, 0);
+            if (ret == kv_NOMEM) {
+                break;
+            }
+            if (n == 0) {
+                assert(ret == kv_NOTFOUND);
+                break;
+            }
+            assert(ret == kv_DELETED);
+            assert(item == ref[--tail]);
+            break;
+        }
+        n = tail-head;
+        failrandom = 0;
+        assert(kv_tree_count(t, 0) == (size_t)n);
+        if (n > 0) {
+            assert(kv_tree_front(t, &item, 0) == kv_FOUND);
+            assert(item == ref[head]);
+            assert(kv_tree_back(t, &item, 0) == kv_FOUND);
+            assert(item == ref[tail-1]);
+            assert(kv_tree_push_front(t, ref[head]+1, 0) == kv_OUTOFORDER);
+            assert(kv_tree_push_back(t, ref[tail-1]-1, 0) == kv_OUTOFORDER);
+        }
+        if (rand()%100 == 0) {
+            // Going by way of the root drops the cached paths, such as to
+            // share the nodes with a clone.
+            kv_clear(&tree2, 0);
+            assert(kv_clone(kv_tree_root(t), &tree2, 0) == kv_COPIED);
+            assert(kv_sane(kv_tree_root(t), 0));
+            assert(kv_count(kv_tree_root(t), 0) == (size_t)n);
+            struct edges_ctx ctx = { .items = ref+head, .ok = true };
+            kv_scan(kv_tree_root(t), edges_iter, &ctx);
+            assert(ctx.ok && ctx.count == n);
+        }
+    }
+    assert(kv_sane(kv_tree_root(t), 0));
+    size_t hits, misses;
+    kv_tree_stats(t, &hits, &misses);
+#if !defined(SPATIAL) && !defined(AUGMENT)
+    assert(hits > misses);
+#else
+    assert(hits == 0);
+#endif
+    kv_tree_stats(t, 0, 0);
+    free(ref);
+    kv_clear(&tree2, 0);
+    kv_tree_release(t, 0);
+    kv_tree_release(0, 0);
+    checkmem();
+}
+
+// The root from kv_tree_root is kept and used along with the edge operations
+// of the header, including clones that share the nodes on the cached paths.
+void test_tree_kept_root(void) {
+    testinit();
+    struct kv_tree *t;
+    kv_tree_init(&t, 0);
+    assert(t);
+    struct kv **root = kv_tree_root(t);
+    int nops = 10000;
+    int *ref = malloc((nops*2+1)*sizeof(int));
+    int *ref2 = malloc((nops*2+1)*sizeof(int));
+    assert(ref && ref2);
+    int head = nops, tail = nops;
+    int lo = -10, hi = 0;
+    struct kv *tree2 = 0;
+    int n2 = 0;
+    for (int i = 0; i < nops; i++) {
+        int n = tail-head;
+        int item;
+        bool viaroot = rand()%2 == 0;
+        switch (n < 1000 ? rand()%4 : 2+rand()%2) {
+        case 0:
+            assert((viaroot ? kv_push_back(root, hi, 0) :
+                kv_tree_push_back(t, hi, 0)) == kv_INSERTED);
+            ref[tail++] = hi;
+            hi += 10;
+            break;
+        case 1:
+#ifdef NOORDER
+            assert((viaroot ? kv_push_front(root, lo, 0) :
+                kv_tree_push_front(t, lo, 0)) == kv_INSERTED);
+#else
+            assert((viaroot ? kv_insert(root, lo, 0, 0) :
+                kv_tree_push_front(t, lo, 0)) == kv_INSERTED);
+#endif
+            ref[--head] = lo;
+            lo -= 10;
+            break;
+        case 2:
+            if (n == 0) {
+                break;
+            }
+#ifdef NOORDER
+            assert((viaroot ? kv_pop_front(root, &item, 0) :
+                kv_tree_pop_front(t, &item, 0)) == kv_DELETED);
+#else
+            assert((viaroot ? kv_delete(root, ref[head], &item, 0) :
+                kv_tree_pop_front(t, &item, 0)) == kv_DELETED);
+#endif
+            assert(item == ref[head++]);
+            break;
+        default:
+            if (n == 0) {
+                break;
+            }
+            assert((viaroot ? kv_pop_back(root, &item, 0) :
+                kv_tree_pop_back(t, &item, 0)) == kv_DELETED);
+            assert(item == ref[--tail]);
+            break;
+        }
+        n = tail-head;
+        assert(kv_tree_count(t, 0) == (size_t)n);
+        if (n > 0) {
+            assert(kv_tree_front(t, &item, 0) == kv_FOUND);
+            assert(item == ref[head]);
+            assert(kv_tree_back(t, &item, 0) == kv_FOUND);
+            assert(item == ref[tail-1]);
+        }
+        if (rand()%100 == 0) {
+            assert(kv_sane(root, 0));
+            struct edges_ctx ctx = { .items = ref+head, .ok = true };
+            kv_scan(root, edges_iter, &ctx);
+            assert(ctx.ok && ctx.count == n);
+            // The clone must not be changed by the edge operations that
+            // follow.
+            assert(kv_sane(&tree2, 0));
+            ctx = (struct edges_ctx){ .items = ref2, .ok = true };
+            kv_scan(&tree2, edges_iter, &ctx);
+            assert(ctx.ok && ctx.count == n2);
+            kv_clear(&tree2, 0);
+            assert(kv_clone(root, &tree2, 0) == kv_COPIED);
+            memcpy(ref2, ref+head, n*sizeof(int));
+            n2 = n;
+        }
+    }
+    assert(kv_sane(root, 0));
+    free(ref);
+    free(ref2);
+    kv_clear(&tree2, 0);
+    kv_tree_release(t, 0);
+    checkmem();
+}
+
+void test_tree_header(void) {
+    testinit();
+    struct kv_tree *t;
+    kv_tree_init(&t, 0);
+    assert(t);
+    assert(kv_tree_count(t, 0) == 0);
+    assert(kv_tree_height(t, 0) == 0);
+    size_t version = kv_tree_version(t);
+    shuffle(keys, nkeys);
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_tree_insert(t, keys[i], 0, 0) == kv_INSERTED);
+        assert(kv_tree_count(t, 0) == (size_t)i+1);
+        assert(kv_tree_version(t) > version);
+        version = kv_tree_version(t);
+        assert(kv_tree_insert(t, keys[i], &val, 0) == kv_REPLACED);
+        assert(val == keys[i]);
+        assert(kv_tree_count(t, 0) == (size_t)i+1);
+        // Keep the edges in use while the tree grows
+        if (i%10 == 0) {
+            assert(kv_tree_front(t, &val, 0) == kv_FOUND);
+            assert(kv_tree_pop_front(t, &val, 0) == kv_DELETED);
+            assert(kv_tree_push_front(t, val, 0) == kv_INSERTED);
+            assert(kv_tree_pop_back(t, &val, 0) == kv_DELETED);
+            assert(kv_tree_push_back(t, val, 0) == kv_INSERTED);
+        }
+    }
+    assert(kv_tree_height(t, 0) == kv_height(kv_tree_root(t), 0));
+    assert(kv_sane(kv_tree_root(t), 0));
+    version = kv_tree_version(t);
+    shuffle(keys, nkeys);
+    for (int i = 0; i < nkeys; i++) {
+        assert(kv_tree_get(t, keys[i], &val, 0) == kv_FOUND);
+        assert(val == keys[i]);
+        assert(kv_tree_contains(t, keys[i], 0));
+        assert(!kv_tree_contains(t, keys[i]+1, 0));
+    }
+    assert(kv_tree_version(t) == version);
+    // Changes by way of the root are counted again. With the keys in order
+    // the front is always keys[i] below.
+    sort(keys, nkeys);
+    assert(kv_delete(kv_tree_root(t), keys[0], 0, 0) == kv_DELETED);
+    assert(kv_tree_version(t) > version);
+    assert(kv_tree_count(t, 0) == (size_t)nkeys-1);
+    for (int i = 1; i < nkeys; i++) {
+        if (i%2 == 0) {
+            assert(kv_tree_delete(t, keys[i], &val, 0) == kv_DELETED);
+            assert(val == keys[i]);
+        } else {
+            assert(kv_tree_pop_front(t, &val, 0) == kv_DELETED);
+            assert(val == keys[i]);
+        }
+        assert(kv_tree_delete(t, keys[0], 0, 0) == kv_NOTFOUND);
+        assert(kv_tree_count(t, 0) == (size_t)(nkeys-1-i));
+        assert(kv_count(kv_tree_root(t), 0) == (size_t)(nkeys-1-i));
+    }
+    assert(kv_tree_height(t, 0) == 0);
+    kv_tree_release(t, 0);
+    checkmem();
+}
+
+void test_iter_inplace(void) {
+    testinit();
+    assert(kv_iter_size() == sizeof(struct kv_iter));
+    tree_fill();
+    for (int mut = 0; mut < 2; mut++) {
+        // The iterator lives on the stack and never allocates while
+        // scanning and seeking an unshared tree.
+        struct kv_iter mem;
+        struct kv_iter *iter = mut ? 
+            kv_iter_init_inplace_mut(&tree, &mem, 0) :
+            kv_iter_init_inplace(&tree, &mem, 0);
+        assert(iter == &mem);
+        size_t nallocs0 = atomic_load(&nallocs);
+        int count = 0;
+        for (kv_iter_scan(iter); kv_iter_valid(iter); kv_iter_next(iter)) {
+            count++;
+        }
+        assert(count == nkeys);
+        for (int i = 0; i < 100; i++) {
+            size_t index = rand()%nkeys;
+            kv_iter_seek_at(iter, index);
+            for (int j = 0; j < 3 && index+j < (size_t)nkeys; j++) {
+                assert(kv_iter_valid(iter));
+                kv_iter_item(iter, &val);
+                int val2;
+                assert(kv_get_at(&tree, index+j, &val2, 0) == kv_FOUND);
+                assert(val == val2);
+                kv_iter_next(iter);
+            }
+        }
+        assert(atomic_load(&nallocs) == nallocs0);
+        // Releasing does not free the caller's memory
+        kv_iter_release(iter);
+    }
+    kv_clear(&tree, 0);
+    sort(keys, nkeys);
+    checkmem();
+}
+
+
+struct point {
+    double x;
+    double y;
+};
+
+struct nctx {
+    struct point point;
+    int count;
+    int *items;
+    int limit;
+};
+
+double ndist(double min[], double max[], void *target, void *udata) {
+    (void)udata;
+    double *point = target;
+    return box_dist(point, point, min, max);
+}
+
+bool niter(int item, void *udata) {
+    struct nctx *ctx = udata;
+    ctx->items[ctx->count++] = item;
+    if (ctx->count == ctx->limit) {
+        return false;
+    }
+    return true;
+}
+
+struct nitem {
+    double dist;
+    int item;
+};
+
+int ncompare(const void *a, const void *b) {
+    const struct nitem *na = a;
+    const struct nitem *nb = b;
+    return na->dist < nb->dist ? -1 :
+           na->dist > nb->dist ? 1 :
+           na->item < nb->item ? -1 : 
+           na->item > nb->item;
+}
+
+int slow_nearby(struct kv **root, void *target,
+    double(*dist)(double min[DIMS], double max[DIMS], 
+    void *target, void *udata), bool(*iter)(int item, void *udata), 
+    void *udata, bool mut)
+{
+#ifndef SPATIAL
+    (void)root, (void)target, (void)dist, (void)iter, (void)udata, (void)mut;
+    return kv_FINISHED;
+#else
+    struct nitem *items = malloc(sizeof(struct nitem) * kv_count(root, udata));
+    assert(items);
+    struct kv_iter *iter2;
+    if (mut) {
+        kv_iter_init_mut(root, &iter2, udata);
+    } else {
+        kv_iter_init(root, &iter2, udata);
+    }
+    kv_iter_scan(iter2);
+    int count = 0;
+    while (kv_iter_valid(iter2)) {
+        kv_iter_item(iter2, &val);
+        double min[DIMS], max[DIMS];
+        item_rect(val, min, max);
+        items[count].dist = dist(min, max, target, udata);
+        items[count].item = val;
+        count++;
+        kv_iter_next(iter2);
+    }
+    assert(kv_iter_status(iter2) == 0);
+    kv_iter_release(iter2);
+    qsort(items, count, sizeof(struct nitem), ncompare);
+    int status = kv_FINISHED;
+    for (int i = 0; i < count; i++) {
+        if (!iter(items[i].item, udata)) {
+            status = kv_STOPPED;
+            break;
+        }
+    }
+    free(items);
+    return status;
+#endif
+}
+
+void test_nearby_opt(bool mut) {
+    tree = 0;
+    if (mut) {
+        assert(kv_nearby_mut(&tree, 0, ndist, niter, 0) == kv_FINISHED);
+    } else {
+        assert(kv_nearby(&tree, 0, ndist, niter, 0) == kv_FINISHED);
+    }
+
+    struct kv_iter *iter;
+    kv_iter_init(&tree, &iter, 0);
+    kv_iter_nearby(0, 0, ndist); // should not fail
+    kv_iter_nearby(iter, 0, ndist);
+    assert(kv_iter_valid(iter) == false);
+    kv_iter_release(iter);
+    
+
+#ifndef SPATIAL
+    return;
+#else
+    int count = ncities;
+    for (int i = 0; i < count; i++) {
+        int item = CITIESBASE+i;
+        assert(kv_insert(&tree, item, 0, 0) == kv_INSERTED);
+    }
+    double point[] = { -112.0, 33.0, count/2 };
+
+    struct kv *tree2, *tree3;
+    assert(kv_clone(&tree, &tree2, 0) == kv_COPIED);
+    assert(kv_clone(&tree, &tree3, 0) == kv_COPIED);
+
+    if (mut) {
+        // delete half the items
         for (int i = 0; i < count; i+=2) {
             int item = CITIESBASE+i;
             assert(kv_delete(&tree, item, 0, 0) == kv_DELETED);
@@ -2792,6 +4361,43 @@ void test_nearby_opt(bool mut) {
 
     assert(ctx3.count == count/2);
 
+    // Reuse one iterator for many nearby calls, interleaved with other
+    // scanners. The queue storage must be retained across calls.
+    if (mut) {
+        kv_iter_init_mut(&tree3, &iter, &ctx3);
+    } else {
+        kv_iter_init(&tree3, &iter, &ctx3);
+    }
+    assert(kv_iter_reserve(iter, 1024) == 0);
+    size_t nallocs0 = atomic_load(&nallocs);
+    for (int i = 0; i < 20; i++) {
+        double point[] = { rand_double()*360-180, rand_double()*180-90, 0 };
+        ctx1.count = 0;
+        ctx1.limit = 1+rand()%100;
+        kv_nearby(&tree2, point, ndist, niter, &ctx1);
+        ctx3.count = 0;
+        ctx3.limit = ctx1.limit;
+        kv_iter_nearby(iter, point, ndist);
+        while (kv_iter_valid(iter)) {
+            kv_iter_item(iter, &val);
+            if (!niter(val, &ctx3)) {
+                break;
+            }
+            kv_iter_next(iter);
+        }
+        assert(kv_iter_status(iter) == 0);
+        assert(ctx3.count == ctx1.count);
+        for (int j = 0; j < ctx1.count; j++) {
+            assert(ctx1.items[j] == ctx3.items[j]);
+        }
+        if (i%2 == 0) {
+            kv_iter_scan(iter);
+            assert(kv_iter_valid(iter));
+        }
+        assert(atomic_load(&nallocs) == nallocs0);
+    }
+    kv_iter_release(iter);
+
     free(ctx1.items);
     free(ctx2.items);
     free(ctx3.items);
@@ -2810,6 +4416,160 @@ void test_nearby(void) {
     checkmem();
 }
 
+int ndist_calls;
+
+double ndist_count(double min[], double max[], void *target, void *udata) {
+    ndist_calls++;
+    return ndist(min, max, target, udata);
+}
+
+void test_nearby_within(void) {
+    testinit();
+    use_static_3d = true;
+    tree = 0;
+    assert(kv_nearby_within(&tree, 0, ndist, 1, niter, 0) == kv_FINISHED);
+    struct kv_iter *iter;
+    kv_iter_init(&tree, &iter, 0);
+    kv_iter_nearby_within(0, 0, ndist, 1); // should not fail
+    kv_iter_nearby_within(iter, 0, ndist, 1);
+    assert(kv_iter_valid(iter) == false);
+    kv_iter_release(iter);
+#ifdef SPATIAL
+    int count = ncities;
+    for (int i = 0; i < count; i++) {
+        assert(kv_insert(&tree, CITIESBASE+i, 0, 0) == kv_INSERTED);
+    }
+    struct nctx ctx1 = { .limit = 10000000 };
+    struct nctx ctx2 = { .limit = 10000000 };
+    ctx1.items = malloc(sizeof(int) * count);
+    ctx2.items = malloc(sizeof(int) * count);
+    assert(ctx1.items && ctx2.items);
+    kv_iter_init(&tree, &iter, &ctx2);
+    double maxdists[] = { -1, 0, 1, 10, 100, 1000, 100000 };
+    for (int i = 0; i < 100; i++) {
+        double point[] = { rand_double()*360-180, rand_double()*180-90, 0 };
+        double maxdist = maxdists[i%(sizeof(maxdists)/sizeof(double))];
+        // expected results are the nearby results up to maxdist
+        ctx1.count = 0;
+        ndist_calls = 0;
+        assert(kv_nearby(&tree, point, ndist_count, niter, &ctx1) == 
+            kv_FINISHED);
+        int ncalls = ndist_calls;
+        int n = 0;
+        while (n < ctx1.count) {
+            double min[DIMS], max[DIMS];
+            item_rect(ctx1.items[n], min, max);
+            if (ndist(min, max, point, 0) > maxdist) {
+                break;
+            }
+            n++;
+        }
+        ctx2.count = 0;
+        ndist_calls = 0;
+        assert(kv_nearby_within(&tree, point, ndist_count, maxdist, niter, 
+            &ctx2) == kv_FINISHED);
+        assert(ndist_calls <= ncalls);
+        assert(ctx2.count == n);
+        for (int j = 0; j < n; j++) {
+            assert(ctx1.items[j] == ctx2.items[j]);
+        }
+        ctx2.count = 0;
+        assert(kv_nearby_within_mut(&tree, point, ndist, maxdist, niter, 
+            &ctx2) == kv_FINISHED);
+        assert(ctx2.count == n);
+        ctx2.count = 0;
+        kv_iter_nearby_within(iter, point, ndist, maxdist);
+        while (kv_iter_valid(iter)) {
+            kv_iter_item(iter, &val);
+            niter(val, &ctx2);
+            kv_iter_next(iter);
+        }
+        assert(kv_iter_status(iter) == 0);
+        assert(ctx2.count == n);
+        for (int j = 0; j < n; j++) {
+            assert(ctx1.items[j] == ctx2.items[j]);
+        }
+        // a following unbounded nearby must not inherit the bounds
+        kv_iter_nearby(iter, point, ndist);
+        ctx2.count = 0;
+        while (kv_iter_valid(iter)) {
+            kv_iter_item(iter, &val);
+            niter(val, &ctx2);
+            kv_iter_next(iter);
+        }
+        assert(ctx2.count == count);
+    }
+    kv_iter_release(iter);
+    free(ctx1.items);
+    free(ctx2.items);
+    kv_clear(&tree, 0);
+#endif
+    use_static_3d = false;
+    checkmem();
+}
+
+void test_nearest_k(void) {
+    testinit();
+    use_static_3d = true;
+    tree = 0;
+    int items[16];
+    double dists[16];
+    assert(kv_nearest_k(&tree, 0, ndist, 16, items, dists, 0) == 0);
+#ifdef SPATIAL
+    int count = ncities;
+    for (int i = 0; i < count; i++) {
+        assert(kv_insert(&tree, CITIESBASE+i, 0, 0) == kv_INSERTED);
+    }
+    double point[] = { -112.0, 33.0, count/2 };
+    struct nctx ctx = { .limit = 10000000 };
+    ctx.items = malloc(sizeof(int) * count);
+    assert(ctx.items);
+    assert(kv_nearby(&tree, point, ndist, niter, &ctx) == kv_FINISHED);
+    assert(ctx.count == count);
+    int *kitems = malloc(sizeof(int) * (count+10));
+    double *kdists = malloc(sizeof(double) * (count+10));
+    assert(kitems && kdists);
+    size_t ks[] = { 0, 1, 2, 10, 100, 1000, count-1, count, count+10 };
+    for (size_t i = 0; i < sizeof(ks)/sizeof(size_t); i++) {
+        size_t k = ks[i];
+        size_t n = kv_nearest_k(&tree, point, ndist, k, kitems, kdists, 0);
+        assert(n == (k < (size_t)count ? k : (size_t)count));
+        for (size_t j = 0; j < n; j++) {
+            // same order as nearby
+            assert(kitems[j] == ctx.items[j]);
+            double min[DIMS], max[DIMS];
+            item_rect(kitems[j], min, max);
+            assert(!(kdists[j] < ndist(min, max, point, 0) ||
+                     kdists[j] > ndist(min, max, point, 0)));
+            assert(j == 0 || !(kdists[j] < kdists[j-1]));
+        }
+    }
+    // random targets
+    for (int i = 0; i < 100; i++) {
+        double point[] = { rand_double()*360-180, rand_double()*180-90, 0 };
+        size_t k = rand()%50;
+        ctx.count = 0;
+        ctx.limit = k == 0 ? 1 : k;
+        kv_nearby(&tree, point, ndist, niter, &ctx);
+        size_t n = kv_nearest_k(&tree, point, ndist, k, kitems, kdists, 0);
+        assert(n == k);
+        for (size_t j = 0; j < n; j++) {
+            assert(kitems[j] == ctx.items[j]);
+        }
+    }
+    free(kitems);
+    free(kdists);
+    free(ctx.items);
+    kv_clear(&tree, 0);
+#else
+    assert(kv_insert(&tree, 1, 0, 0) == kv_INSERTED);
+    assert(kv_nearest_k(&tree, 0, ndist, 16, items, dists, 0) == 0);
+    kv_clear(&tree, 0);
+#endif
+    use_static_3d = false;
+    checkmem();
+}
+
 
 void riter(double *min, double *max, int depth, void *udata) {
     (void)depth, (void)udata;
@@ -2882,6 +4642,11 @@ int main(void) {
 
     test_sane();
     test_counted();
+    test_augment();
+    test_run_at();
+    test_quantiles();
+    test_upsert();
+    test_update();
     test_push();
     test_pop_front();
     test_pop_back();
@@ -2894,13 +4659,26 @@ int main(void) {
     test_compare();
     test_failures();
     test_intersects();
+    test_intersects_many();
+    test_spatial_join();
     test_nearby();
+    test_nearby_within();
+    test_nearest_k();
     test_scan();
     test_scan_desc();
     test_seek();
     test_seek_desc();
     test_seek_at();
     test_seek_at_desc();
+    test_iter_advance();
+    test_iter_inplace();
+    test_iter_next_batch();
+    test_scan_spans();
+    test_iter_stable();
+    test_iter_delete();
+    test_tree_edges();
+    test_tree_kept_root();
+    test_tree_header();
     test_rect();
 
     free(keys);
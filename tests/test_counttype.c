@@ -0,0 +1,4 @@
+// The actual work is done in "counttype_base.h"
+#define TESTNAME "counttype"
+#define NOCOV // Not a base. ignore coverage
+#include "counttype_base.h"
@@ -0,0 +1,5 @@
+// The actual work is done in "counttype_base.h"
+#define TESTNAME "counttype_prefix"
+#define NOCOV // Not a base. ignore coverage
+#define PREFIXCOUNTS
+#include "counttype_base.h"
@@ -0,0 +1,6 @@
+// The actual work is done in "test_base.h"
+#define TESTNAME "deque"
+#define COUNTED
+#define DEQUE
+#define BSEARCH
+#include "test_base.h"
@@ -0,0 +1,6 @@
+// The actual work is done in "multi_base.h"
+#define TESTNAME "multi"
+#define NOCOV // Not a base. ignore coverage
+#define COW
+#define COUNTED
+#include "multi_base.h"
@@ -0,0 +1,5 @@
+// The actual work is done in "multi_base.h"
+#define TESTNAME "multi_linear"
+#define NOCOV // Not a base. ignore coverage
+#define LINEAR
+#include "multi_base.h"
@@ -0,0 +1,7 @@
+// The actual work is done in "multi_base.h"
+#define TESTNAME "multi_prefix"
+#define NOCOV // Not a base. ignore coverage
+#define COUNTED
+#define PREFIXCOUNTS
+#define LINEAR
+#include "multi_base.h"
@@ -82,8 +82,43 @@ void test_clone(void) {
     checkmem();
 }
 
+bool count_span(struct col *const *cols, int count, void *udata) {
+    for (int i = 0; i < count; i++) {
+        assert(cols[i]->name[0] == 'c');
+    }
+    *(int*)udata += count;
+    return true;
+}
+
+void test_spans(void) {
+    testinit();
+    struct bt0 *tree = 0;
+    for (int i = 0; i < 100; i++) {
+        struct col *col = col_new();
+        snprintf(col->name, 100, "col:%d", i);
+        assert(bt0_insert(&tree, col, 0, 0) == bt0_INSERTED);
+    }
+    int total = 0;
+    assert(bt0_scan_spans(&tree, count_span, &total) == bt0_FINISHED);
+    assert(total == 100);
+    struct bt0_iter *iter;
+    bt0_iter_init(&tree, &iter, 0);
+    bt0_iter_scan(iter);
+    total = 0;
+    struct col *const *cols;
+    int count;
+    while ((count = bt0_iter_next_span(iter, &cols)) > 0) {
+        count_span(cols, count, &total);
+    }
+    assert(total == 100);
+    bt0_iter_release(iter);
+    bt0_clear(&tree, 0);
+    checkmem();
+}
+
 int main(void) {
     initrand();
     test_clone();
+    test_spans();
     return 0;
 }
@@ -0,0 +1,7 @@
+// The actual work is done in "test_base.h"
+#define TESTNAME "nocow"
+#define NOCOV // Not a base. ignore coverage
+#define COUNTED
+#define NOCOW
+#define LINEAR
+#include "test_base.h"
@@ -0,0 +1,6 @@
+// The actual work is done in "test_base.h"
+#define TESTNAME "prefix"
+#define COUNTED
+#define PREFIXCOUNTS
+#define LINEAR
+#include "test_base.h"